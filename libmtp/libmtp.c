@@ -2243,7 +2243,13 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_ObjectInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_ObjectInfoChanged in session %u\n", session_id);
-      /* TODO: rescan object cache or just for this one object */
+      *event = LIBMTP_EVENT_OBJECT_INFO_CHANGED;
+      *out1 = param1;
+      break;
+    case PTP_EC_MTP_ObjectPropChanged:
+      LIBMTP_INFO("Received event PTP_EC_MTP_ObjectPropChanged in session %u\n", session_id);
+      *event = LIBMTP_EVENT_OBJECT_INFO_CHANGED;
+      *out1 = param1;
       break;
     case PTP_EC_DeviceInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_DeviceInfoChanged in session %u\n", session_id);
@@ -2328,6 +2334,23 @@ int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, v
   return ret == PTP_RC_OK ? 0 : -1;
 }
 
+/**
+ * This function cancels an event read started with LIBMTP_Read_Event_Async().
+ * The callback is still invoked, with LIBMTP_HANDLER_RETURN_CANCEL, the next
+ * time events are polled with LIBMTP_Handle_Events_Timeout_Completed(). Call
+ * this, and poll until the callback ran, before releasing the device.
+ *
+ * @param device a pointer to the MTP device the event read was started on.
+ * @return 0 on success or when no event read is pending, any other value
+ *         means that the read could not be cancelled.
+ * @see LIBMTP_Read_Event_Async()
+ */
+int LIBMTP_Cancel_Event_Async(LIBMTP_mtpdevice_t *device) {
+  PTPParams *params = (PTPParams *) device->params;
+
+  return ptp_usb_event_async_cancel(params) == PTP_RC_OK ? 0 : -1;
+}
+
 /**
  * Recursive function that adds MTP devices to a linked list
  * @param devices a list of raw devices to have real devices created for.
@@ -4504,6 +4527,130 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
   return retfiles;
 }
 
+/**
+ * This function retrieves folder contents with a single GetObjPropList
+ * request, instead of fetching the metadata of each object with a
+ * separate transaction. Either all properties of the immediate children
+ * of a folder are requested (depth 1), or all properties of the objects
+ * below a folder at any depth, or of all objects on the device, which are
+ * then filtered by storage.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage to filter the result by, or 0 for any storage.
+ * @param parent the parent folder id; with <code>recursive</code> set,
+ *        0 stands for the whole device.
+ * @param recursive if set, list every object below the parent.
+ * @param files the resulting list of files and folders, NULL if there
+ *        are none.
+ * @return 0 on success, -1 if the device can not list folders this way
+ *         and the caller shall fall back to per-object metadata retrieval.
+ */
+static int get_files_and_folders_fast(LIBMTP_mtpdevice_t *device,
+				      uint32_t const storage,
+				      uint32_t const parent,
+				      int const recursive,
+				      LIBMTP_file_t **files)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *curfile = NULL;
+  MTPProperties *props = NULL;
+  int nrofprops = 0;
+  int have_parents = 0;
+  int oldtimeout;
+  int i, j;
+  uint16_t ret;
+
+  *files = NULL;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList)
+      || FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
+      || FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
+    return -1;
+  }
+
+  /*
+   * Handle 0xffffffff means "all objects" to GetObjPropList, while it is
+   * the root folder to GetObjectHandles, so root folders are always listed
+   * the classic way.
+   */
+  if (!recursive && parent == PTP_GOH_ROOT_PARENT)
+    return -1;
+
+  // Big folders can take a while to answer, see get_all_metadata_fast().
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  set_usb_device_timeout(ptp_usb, 60000);
+  if (recursive && parent == 0)
+    ret = ptp_mtp_getobjectproplist(params, 0xffffffff, &props, &nrofprops);
+  else if (recursive)
+    ret = ptp_mtp_getobjectproplist_generic(params, parent, 0x00000000U,
+					    0xFFFFFFFFU, 0x00000000U, 0xFFFFFFFFU,
+					    &props, &nrofprops);
+  else
+    ret = ptp_mtp_getobjectproplist_generic(params, parent, 0x00000000U,
+					    0xFFFFFFFFU, 0x00000000U, 1,
+					    &props, &nrofprops);
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+
+  if (ret != PTP_RC_OK)
+    return -1;
+  if (props == NULL && nrofprops != 0)
+    return -1;
+
+  /*
+   * The property list is sorted by object handle, so every run of equal
+   * handles describes one object.
+   */
+  for (i = 0; i < nrofprops; i = j) {
+    PTPObject ob;
+    LIBMTP_file_t *file;
+
+    for (j = i; j < nrofprops && props[j].ObjectHandle == props[i].ObjectHandle; j++)
+      if (props[j].property == PTP_OPC_ParentObject)
+	have_parents = 1;
+
+    // Some devices include the folder itself in the result.
+    if (parent != 0 && props[i].ObjectHandle == parent)
+      continue;
+
+    memset(&ob, 0, sizeof(ob));
+    ob.oid = props[i].ObjectHandle;
+    ob.mtpprops = &props[i];
+    ob.nrofmtpprops = j - i;
+    ptp_object_apply_proplist(&ob);
+
+    if ((!recursive && ob.oi.ParentObject != parent) ||
+	(storage != 0 && ob.oi.StorageID != storage)) {
+      ptp_free_objectinfo(&ob.oi);
+      continue;
+    }
+    if (ob.oi.Filename == NULL)
+      ob.oi.Filename = strdup("<null>");
+
+    file = obj2file(device, &ob);
+    ptp_free_objectinfo(&ob.oi);
+
+    if (curfile == NULL) {
+      *files = file;
+    } else {
+      curfile->next = file;
+    }
+    curfile = file;
+  }
+
+  ptp_destroy_object_prop_list(props, nrofprops);
+
+  // Without parent information we can not tell children from the rest.
+  if (nrofprops != 0 && !have_parents) {
+    while (*files != NULL) {
+      LIBMTP_file_t *tmp = *files;
+      *files = tmp->next;
+      LIBMTP_destroy_file_t(tmp);
+    }
+    return -1;
+  }
+  return 0;
+}
+
 /**
  * This function retrieves the contents of a certain folder
  * with id parent on a certain storage on a certain device.
@@ -4538,6 +4685,9 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
     return NULL;
   }
 
+  if (get_files_and_folders_fast(device, storage, parent, 0, &retfiles) == 0)
+    return retfiles;
+
   if (storage == 0)
     storageid = PTP_GOH_ALL_STORAGE;
   else
@@ -4584,6 +4734,202 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
   return retfiles;
 }
 
+/**
+ * This function retrieves the metadata of the contents of a certain
+ * folder with a single request. Unlike LIBMTP_Get_Files_And_Folders(),
+ * it never falls back to asking for the metadata of one object at a time,
+ * so it is cheap enough to compare a folder against an earlier listing.
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ *
+ * Root folders of storages, and all folders of devices that can not
+ * report object properties in bulk, can not be listed this way.
+ *
+ * NOTE: the request will always perform I/O with the device.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage on the device to report info from. If
+ *        0 is passed in, the files for the given parent will be
+ *        searched across all available storages.
+ * @param parent the parent folder id.
+ * @param files a pointer to the resulting list of files and folders.
+ *        The list is NULL if the folder is empty.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Files_And_Folders()
+ */
+int LIBMTP_Get_Folder_Contents(LIBMTP_mtpdevice_t *device,
+			       uint32_t const storage,
+			       uint32_t const parent,
+			       LIBMTP_file_t **files)
+{
+  *files = NULL;
+
+  if (device->cached) {
+    // This function is only supposed to be used by devices
+    // opened as uncached!
+    LIBMTP_ERROR("tried to use %s on a cached device!\n",
+		 __func__);
+    return -1;
+  }
+
+  if (get_files_and_folders_fast(device, storage, parent, 0, files) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Folder_Contents(): "
+			    "could not get the metadata of the folder.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This function retrieves the object handles of the contents of a certain
+ * folder, without any metadata. It is a cheap way to tell whether the
+ * contents of a folder changed since it was listed last time.
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ *
+ * NOTE: the request will always perform I/O with the device.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage on the device to report info from. If
+ *        0 is passed in, the handles for the given parent will be
+ *        searched across all available storages.
+ * @param parent the parent folder id.
+ * @param handles a pointer to the resulting array of object handles,
+ *        which must be freed by the caller. NULL for an empty folder.
+ * @param count a pointer to the number of returned handles.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Files_And_Folders()
+ */
+int LIBMTP_Get_Object_Handles(LIBMTP_mtpdevice_t *device,
+			      uint32_t const storage,
+			      uint32_t const parent,
+			      uint32_t **handles,
+			      uint32_t *count)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectHandles currentHandles;
+  uint16_t ret;
+
+  *handles = NULL;
+  *count = 0;
+
+  if (device->cached) {
+    // This function is only supposed to be used by devices
+    // opened as uncached!
+    LIBMTP_ERROR("tried to use %s on a cached device!\n",
+		 __func__);
+    return -1;
+  }
+
+  ret = ptp_getobjecthandles(params,
+			     storage == 0 ? PTP_GOH_ALL_STORAGE : storage,
+			     PTP_GOH_ALL_FORMATS,
+			     parent,
+			     &currentHandles);
+
+  if (ret != PTP_RC_OK) {
+    char buf[80];
+    sprintf(buf,"LIBMTP_Get_Object_Handles(): could not get object handles of %08x.", parent);
+    add_ptp_error_to_errorstack(device, ret, buf);
+    return -1;
+  }
+
+  *handles = currentHandles.Handler;
+  *count = currentHandles.n;
+  return 0;
+}
+
+/**
+ * This function retrieves the metadata of every file and folder on
+ * a certain storage with a single request. Use the <code>parent_id</code>
+ * field of the returned entries to arrange them into folders; objects
+ * in the root folder of the storage have the parent id 0.
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ *
+ * Not all devices can report all objects at once. If this function
+ * fails, traverse the storage using LIBMTP_Get_Files_And_Folders().
+ *
+ * NOTE: the request will always perform I/O with the device.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage on the device to report info from. If
+ *        0 is passed in, the objects of all storages are returned.
+ * @param files a pointer to the resulting list of files and folders.
+ *        The list is NULL if the storage is empty.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Files_And_Folders()
+ */
+int LIBMTP_Get_All_Files_And_Folders(LIBMTP_mtpdevice_t *device,
+				     uint32_t const storage,
+				     LIBMTP_file_t **files)
+{
+  *files = NULL;
+
+  if (device->cached) {
+    // This function is only supposed to be used by devices
+    // opened as uncached!
+    LIBMTP_ERROR("tried to use %s on a cached device!\n",
+		 __func__);
+    return -1;
+  }
+
+  if (get_files_and_folders_fast(device, storage, 0, 1, files) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_All_Files_And_Folders(): "
+			    "could not get the metadata of all objects.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This function retrieves the metadata of every file and folder below
+ * a certain folder, at any depth, with a single request. Use the
+ * <code>parent_id</code> field of the returned entries to arrange them
+ * into folders. Listing a storage subtree by subtree keeps each request
+ * short, at the cost of more requests than
+ * <code>LIBMTP_Get_All_Files_And_Folders()</code>.
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ *
+ * Not all devices can report objects below the immediate children of
+ * a folder. If this function fails, traverse the folder using
+ * LIBMTP_Get_Files_And_Folders().
+ *
+ * NOTE: the request will always perform I/O with the device.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage on the device to report info from. If
+ *        0 is passed in, the objects are not filtered by storage.
+ * @param parent the folder to list; not the root folder of a storage.
+ * @param files a pointer to the resulting list of files and folders.
+ *        The list is NULL if the folder is empty.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_All_Files_And_Folders()
+ */
+int LIBMTP_Get_Subtree_Files_And_Folders(LIBMTP_mtpdevice_t *device,
+					 uint32_t const storage,
+					 uint32_t const parent,
+					 LIBMTP_file_t **files)
+{
+  *files = NULL;
+
+  if (device->cached) {
+    // This function is only supposed to be used by devices
+    // opened as uncached!
+    LIBMTP_ERROR("tried to use %s on a cached device!\n",
+		 __func__);
+    return -1;
+  }
+
+  if (parent == 0 || parent == LIBMTP_FILES_AND_FOLDERS_ROOT ||
+      get_files_and_folders_fast(device, storage, parent, 1, files) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Subtree_Files_And_Folders(): "
+			    "could not get the metadata of the folder subtree.");
+    return -1;
+  }
+  return 0;
+}
+
 
 /**
  * This creates a new track metadata structure and allocates memory
@@ -6008,8 +6354,11 @@ int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
  * MTP device. A filename and a set of metadata must be
  * given as input.
  *
- * This can potentially be used for sending in a stream of unknown
- * length. Send music files with
+ * This can be used for sending in a stream of unknown length: set
+ * <code>filedata-&gt;filesize</code> to <code>LIBMTP_FILESIZE_UNKNOWN</code>
+ * and the stream ends with the first call of <code>get_func</code> that
+ * returns less data than asked for. Only whole requests may be returned
+ * before that. Send music files with
  * <code>LIBMTP_Send_Track_From_Handler()</code>
  *
  * @param device a pointer to the device to send the file to.
@@ -6062,7 +6411,10 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
   ptp_usb->callback_active = 1;
   // The callback will deactivate itself after this amount of data has been sent
   // One BULK header for the request, one for the data phase. No parameters to the request.
-  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
+  if (filedata->filesize == LIBMTP_FILESIZE_UNKNOWN)
+    ptp_usb->current_transfer_total = PTP_DL_UNKNOWN;
+  else
+    ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
   ptp_usb->current_transfer_complete = 0;
   ptp_usb->current_transfer_callback = callback;
   ptp_usb->current_transfer_callback_data = data;
@@ -6105,6 +6457,8 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
   if (newfilemeta != NULL) {
     filedata->parent_id = newfilemeta->parent_id;
     filedata->storage_id = newfilemeta->storage_id;
+    if (filedata->filesize == LIBMTP_FILESIZE_UNKNOWN)
+      filedata->filesize = newfilemeta->filesize;
     LIBMTP_destroy_file_t(newfilemeta);
   } else {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
@@ -9091,34 +9445,22 @@ int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
 }
 
 
-int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                            uint64_t offset, uint32_t maxbytes,
-                            unsigned char **data, unsigned int *size)
+/**
+ * Clamps a partial read to the size of the object and works around
+ * device quirks. Returns the number of bytes to request, 0 if the
+ * read starts at or beyond the end of the object.
+ */
+static uint32_t clamp_partial_read(PTPParams *params, uint64_t offset,
+                                   uint32_t maxbytes, uint64_t filesize)
 {
-  PTPParams	*params = (PTPParams *) device->params;
-  uint16_t	ret;
-  LIBMTP_file_t	*mtpfile = LIBMTP_Get_Filemetadata(device, id);
-
-  if (!mtpfile) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: could not find mtpfile");
-    *size = 0;
-    return -1;
-  }
-
   /* Some devices do not like reading over the end and hang instead of progressing */
-  if (offset >= mtpfile->filesize) {
-    *size = 0;
-    LIBMTP_destroy_file_t (mtpfile);
+  if (offset >= filesize) {
     return 0;
   }
-  if (offset + maxbytes > mtpfile->filesize) {
-    maxbytes = mtpfile->filesize - offset;
+  if (offset + maxbytes > filesize) {
+    maxbytes = filesize - offset;
   }
 
-  /* do not need it anymore */
-  LIBMTP_destroy_file_t (mtpfile);
-
   /* The MTP stack of Samsung Galaxy devices has a mysterious bug in
    * GetPartialObject. When GetPartialObject is invoked to read the
    * last bytes of a file and the amount of data to read is such that
@@ -9134,29 +9476,169 @@ int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
       (maxbytes % PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) == (PTP_USB_BULK_HS_MAX_PACKET_LEN_READ - PTP_USB_BULK_HDR_LEN)) {
     maxbytes--;
   }
+  return maxbytes;
+}
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
-    if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject not supported");
-      return -1;
-    }
+/**
+ * Checks that the device can read a part of an object at the given offset.
+ * Returns 1 if the 64bit Android extension is to be used, 0 for the plain
+ * operation and -1 if the read is not possible.
+ */
+static int check_partial_read(LIBMTP_mtpdevice_t *device, uint64_t offset)
+{
+  PTPParams *params = (PTPParams *) device->params;
 
-    if (offset >> 32 != 0) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject only supports 32bit offsets");
-      return -1;
-    }
+  if (ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64))
+    return 1;
 
-    ret = ptp_getpartialobject(params, id, (uint32_t)offset, maxbytes, data, size);
-  } else {
-    ret = ptp_android_getpartialobject64(params, id, offset, maxbytes, data, size);
+  if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject not supported");
+    return -1;
+  }
+
+  if (offset >> 32 != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject only supports 32bit offsets");
+    return -1;
   }
+  return 0;
+}
+
+/**
+ * Reads a part of an object whose size is already known, clamping the
+ * request to it.
+ */
+static int get_partial_object_clamped(LIBMTP_mtpdevice_t *device,
+                                      uint32_t const id, uint64_t offset,
+                                      uint32_t maxbytes, uint64_t filesize,
+                                      unsigned char **data, unsigned int *size)
+{
+  PTPParams	*params = (PTPParams *) device->params;
+  uint16_t	ret;
+  int		op64;
+
+  maxbytes = clamp_partial_read(params, offset, maxbytes, filesize);
+  if (maxbytes == 0) {
+    *size = 0;
+    return 0;
+  }
+
+  op64 = check_partial_read(device, offset);
+  if (op64 < 0)
+    return -1;
+
+  if (op64)
+    ret = ptp_android_getpartialobject64(params, id, offset, maxbytes, data, size);
+  else
+    ret = ptp_getpartialobject(params, id, (uint32_t)offset, maxbytes, data, size);
   if (ret == PTP_RC_OK)
       return 0;
   return -1;
 }
 
+int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                            uint64_t offset, uint32_t maxbytes,
+                            unsigned char **data, unsigned int *size)
+{
+  LIBMTP_file_t	*mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  uint64_t filesize;
+
+  if (!mtpfile) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+        "LIBMTP_GetPartialObject: could not find mtpfile");
+    *size = 0;
+    return -1;
+  }
+  filesize = mtpfile->filesize;
+
+  /* do not need it anymore */
+  LIBMTP_destroy_file_t (mtpfile);
+
+  return get_partial_object_clamped(device, id, offset, maxbytes, filesize,
+                                    data, size);
+}
+
+/**
+ * Private data of the handler which stores a partial read straight into
+ * the buffer of the caller.
+ */
+typedef struct {
+  unsigned char *data;
+  unsigned long size;
+  unsigned long curoff;
+} BufferHandler;
+
+static uint16_t buffer_put_func(PTPParams* params, void* priv,
+                                unsigned long sendlen, unsigned char *data)
+{
+  BufferHandler *buffer = (BufferHandler *) priv;
+
+  /* The device sent more than it was asked for */
+  if (sendlen > buffer->size - buffer->curoff)
+    return PTP_RC_GeneralError;
+  memcpy(buffer->data + buffer->curoff, data, sendlen);
+  buffer->curoff += sendlen;
+  return PTP_RC_OK;
+}
+
+/**
+ * This is LIBMTP_GetPartialObject() for callers which already know the
+ * size of the object, e.g. from an earlier listing, and supply the buffer.
+ * It saves the metadata request the plain variant issues on every call to
+ * clamp the read, and the data is stored into the buffer as it arrives
+ * from the device, so no intermediate buffer is allocated for the read.
+ * @param device a pointer to the device to read from.
+ * @param id the object ID of the file to read from.
+ * @param offset the offset into the object to start reading at.
+ * @param maxbytes the maximum number of bytes to read, which is also the
+ *        size of the buffer.
+ * @param filesize the size of the object; the read is clamped to it.
+ * @param data the buffer to read into.
+ * @param size a pointer to the number of bytes actually read.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_GetPartialObject()
+ */
+int LIBMTP_GetPartialObject_To_Buffer(LIBMTP_mtpdevice_t *device,
+                                      uint32_t const id, uint64_t offset,
+                                      uint32_t maxbytes, uint64_t filesize,
+                                      unsigned char *data, unsigned int *size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPDataHandler handler;
+  BufferHandler buffer;
+  uint16_t ret;
+  int op64;
+
+  *size = 0;
+  buffer.data = data;
+  buffer.size = maxbytes;
+  buffer.curoff = 0;
+
+  maxbytes = clamp_partial_read(params, offset, maxbytes, filesize);
+  if (maxbytes == 0)
+    return 0;
+
+  op64 = check_partial_read(device, offset);
+  if (op64 < 0)
+    return -1;
+
+  handler.getfunc = NULL;
+  handler.putfunc = buffer_put_func;
+  handler.priv = &buffer;
+
+  if (op64)
+    ret = ptp_android_getpartialobject64_to_handler(params, id, offset,
+                                                    maxbytes, &handler);
+  else
+    ret = ptp_getpartialobject_to_handler(params, id, (uint32_t)offset,
+                                          maxbytes, &handler);
+  if (ret != PTP_RC_OK)
+    return -1;
+  *size = buffer.curoff;
+  return 0;
+}
+
 
 int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
                              uint64_t offset, unsigned char *data, unsigned int size)
@@ -521,6 +521,13 @@ typedef uint16_t (* MTPDataPutFunc)	(void* params, void* priv,
 #define LIBMTP_HANDLER_RETURN_ERROR 1
 #define LIBMTP_HANDLER_RETURN_CANCEL 2
 
+/**
+ * File size of an object streamed by LIBMTP_Send_File_From_Handler()
+ * whose length is not known when the transfer starts, the same value as
+ * PTP_DL_UNKNOWN
+ */
+#define LIBMTP_FILESIZE_UNKNOWN 0xFFFFFFFFFFFFFFFFULL
+
 /**
  * @}
  * @defgroup structar libmtp data structures
@@ -813,6 +820,7 @@ enum LIBMTP_event_enum {
   LIBMTP_EVENT_OBJECT_ADDED,
   LIBMTP_EVENT_OBJECT_REMOVED,
   LIBMTP_EVENT_DEVICE_PROPERTY_CHANGED,
+  LIBMTP_EVENT_OBJECT_INFO_CHANGED,
 };
 typedef enum LIBMTP_event_enum LIBMTP_event_t;
 
@@ -922,6 +930,22 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *,
 LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *,
 					     uint32_t const,
 					     uint32_t const);
+int LIBMTP_Get_All_Files_And_Folders(LIBMTP_mtpdevice_t *,
+				     uint32_t const,
+				     LIBMTP_file_t **);
+int LIBMTP_Get_Subtree_Files_And_Folders(LIBMTP_mtpdevice_t *,
+					 uint32_t const,
+					 uint32_t const,
+					 LIBMTP_file_t **);
+int LIBMTP_Get_Folder_Contents(LIBMTP_mtpdevice_t *,
+			       uint32_t const,
+			       uint32_t const,
+			       LIBMTP_file_t **);
+int LIBMTP_Get_Object_Handles(LIBMTP_mtpdevice_t *,
+			      uint32_t const,
+			      uint32_t const,
+			      uint32_t **,
+			      uint32_t *);
 LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *, uint32_t const);
 int LIBMTP_Get_File_To_File(LIBMTP_mtpdevice_t*, uint32_t, char const * const,
 			LIBMTP_progressfunc_t const, void const * const);
@@ -1058,6 +1082,9 @@ int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *, uint32_t , char *);
 int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *, uint32_t const,
                             uint64_t, uint32_t,
                             unsigned char **, unsigned int *);
+int LIBMTP_GetPartialObject_To_Buffer(LIBMTP_mtpdevice_t *, uint32_t const,
+                                      uint64_t, uint32_t, uint64_t,
+                                      unsigned char *, unsigned int *);
 int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *, uint32_t const,
                              uint64_t, unsigned char *, unsigned int);
 int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *, uint32_t const);
@@ -1072,6 +1099,7 @@ int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *, uint32_t const, uint64_t);
 typedef void(* LIBMTP_event_cb_fn) (int, LIBMTP_event_t, uint32_t, void *);
 int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *, LIBMTP_event_t *, uint32_t *);
 int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *, LIBMTP_event_cb_fn, void *);
+int LIBMTP_Cancel_Event_Async(LIBMTP_mtpdevice_t *);
 int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *, int *);
 
 /**
@@ -1216,6 +1216,10 @@ ptp_usb_senddata(PTPParams* params, PTPContainer* ptp,
 
     LIBMTP_USB_DEBUG("SEND DATA PHASE\n");
 
+    /* data of unknown length is only streamed by the libusb1 glue */
+    if (size == PTP_DL_UNKNOWN)
+        return PTP_RC_OperationNotSupported;
+
     /* build appropriate USB container */
     usbdata.length = htod32(PTP_USB_BULK_HDR_LEN + size);
     usbdata.type = htod16(PTP_USB_CONTAINER_DATA);
@@ -1699,6 +1703,12 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
 	return PTP_ERROR_CANCEL;
 }
 
+uint16_t
+ptp_usb_event_async_cancel (PTPParams* params) {
+	/* Unsupported */
+	return PTP_ERROR_CANCEL;
+}
+
 int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *tv, int *completed) {
 	/* Unsupported */
 	return -12;
@@ -84,6 +84,8 @@ struct _PTP_USB {
   PTPParams *params;
 #ifdef HAVE_LIBUSB1
   libusb_device_handle* handle;
+  /** Pending asynchronous event read, if any */
+  struct libusb_transfer *event_transfer;
 #endif
 #ifdef HAVE_LIBUSB0
   usb_dev_handle* handle;
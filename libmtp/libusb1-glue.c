@@ -843,7 +843,8 @@ ptp_read_func (
   uint16_t handler_ret = 0;
   int xread;
   unsigned long curread = 0;
-  unsigned char *bytes;
+  /* This is the largest block we'll need to read in. */
+  unsigned char bytes[CONTEXT_BLOCK_SIZE];
   int expect_terminator_byte = 0;
   unsigned long usb_inep_maxpacket_size;
   unsigned long context_block_size_1;
@@ -862,8 +863,6 @@ ptp_read_func (
 		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
 	  }
   }
-  // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
   while (curread < size) {
     LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
 
@@ -930,7 +929,6 @@ ptp_read_func (
         if (handler_ret != PTP_RC_OK) {
             LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
                          "Not enough memory or temp/destination free space?");
-            free (bytes);
             return PTP_ERROR_CANCEL;
         }
     }
@@ -952,7 +950,6 @@ ptp_read_func (
                                                  ptp_usb->current_transfer_callback_data);
         if (ret != 0) {
           LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
-          free (bytes);
           return PTP_ERROR_CANCEL;
         }
       }
@@ -964,7 +961,6 @@ ptp_read_func (
 
   if (readbytes)
     *readbytes = curread;
-  free (bytes);
 
   // there might be a zero packet waiting for us...
   if (readzero &&
@@ -1064,6 +1060,7 @@ ptp_write_func (
   int ret = 0;
   unsigned long curwrite = 0;
   unsigned char *bytes;
+  int open_ended = ptp_usb->current_transfer_total == PTP_DL_UNKNOWN;
 
   // This is the largest block we'll need to read in.
   bytes = malloc(CONTEXT_BLOCK_SIZE);
@@ -1083,6 +1080,7 @@ ptp_write_func (
         towrite -= towrite % ptp_usb->outep_maxpacket;
       }
     }
+    unsigned long wanted = towrite;
     int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
     if (getfunc_ret != PTP_RC_OK) {
       free(bytes);
@@ -1109,6 +1107,9 @@ ptp_write_func (
 	    curwrite += xwritten;
 	    usbwritten += xwritten;
     }
+    // A short read ends a stream of unknown length, this is the last transfer
+    if (open_ended && towrite < wanted)
+      ptp_usb->current_transfer_total = ptp_usb->current_transfer_complete;
     // call callback
     if (ptp_usb->callback_active) {
       if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
@@ -1129,6 +1130,8 @@ ptp_write_func (
     }
     if (xwritten < towrite) /* short writes happen */
       break;
+    if (open_ended && towrite < wanted)
+      break;
   }
   free (bytes);
   if (written) {
@@ -1308,20 +1311,26 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 	PTPDataHandler memhandler;
 	unsigned long packet_size;
 	PTP_USB *ptp_usb = (PTP_USB *) params->data;
+	/* the data of unknown length ends with a short or zero length packet */
+	int open_ended = size == PTP_DL_UNKNOWN;
 
 	packet_size = ptp_usb->outep_maxpacket;
 
 
 	LIBMTP_USB_DEBUG("SEND DATA PHASE\n");
 
+	/* the header would end the data phase on its own */
+	if (open_ended && params->split_header_data)
+		return PTP_RC_OperationNotSupported;
+
 	/* build appropriate USB container */
-	usbdata.length	= htod32(PTP_USB_BULK_HDR_LEN+size);
+	usbdata.length	= open_ended ? htod32(0xFFFFFFFFU) : htod32(PTP_USB_BULK_HDR_LEN+size);
 	usbdata.type	= htod16(PTP_USB_CONTAINER_DATA);
 	usbdata.code	= htod16(ptp->Code);
 	usbdata.trans_id= htod32(ptp->Transaction_ID);
 
 	((PTP_USB*)params->data)->current_transfer_complete = 0;
-	((PTP_USB*)params->data)->current_transfer_total = size+PTP_USB_BULK_HDR_LEN;
+	((PTP_USB*)params->data)->current_transfer_total = open_ended ? PTP_DL_UNKNOWN : size+PTP_USB_BULK_HDR_LEN;
 
 	if (params->split_header_data) {
 		datawlen = 0;
@@ -1335,7 +1344,12 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 		ret = handler->getfunc(params, handler->priv, datawlen, usbdata.payload.data, &gotlen);
 		if (ret != PTP_RC_OK)
 			return ret;
-		if (gotlen != datawlen)
+		if (open_ended && gotlen < datawlen) {
+			/* the whole stream fits in the first packet */
+			datawlen = gotlen;
+			wlen = PTP_USB_BULK_HDR_LEN + datawlen;
+			ptp_usb->current_transfer_total = wlen;
+		} else if (gotlen != datawlen)
 			return PTP_RC_GeneralError;
 	}
 	ptp_init_send_memory_handler (&memhandler, (unsigned char *)&usbdata, wlen);
@@ -1345,6 +1359,8 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 	if (ret != PTP_RC_OK) {
 		return ret;
 	}
+	if (open_ended && ptp_usb->current_transfer_total != PTP_DL_UNKNOWN)
+		return ret;
 	if (size <= datawlen) return ret;
 	/* if everything OK send the rest */
 	bytes_left_to_transfer = size-datawlen;
@@ -1355,6 +1371,9 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 			handler, params->data, &written);
 		if (ret != PTP_RC_OK)
 			break;
+		/* ptp_write_func() marks the end of a stream of unknown length */
+		if (open_ended && ptp_usb->current_transfer_total != PTP_DL_UNKNOWN)
+			break;
 		if (written == 0) {
 			ret = PTP_ERROR_IO;
 			break;
@@ -1743,6 +1762,8 @@ ptp_usb_event_cb (struct libusb_transfer *t) {
 	PTPContainer event = {0,};
 	uint16_t code;
 
+	((PTP_USB *)params->data)->event_transfer = NULL;
+
 	switch (t->status) {
 	case LIBUSB_TRANSFER_COMPLETED:
 		if (t->actual_length < 8) {
@@ -1826,7 +1847,26 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
 	t->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
 
 	ret = libusb_submit_transfer(t);
-	return ret == 0 ? PTP_RC_OK : PTP_ERROR_IO;
+	if (ret != 0)
+		return PTP_ERROR_IO;
+	ptp_usb->event_transfer = t;
+	return PTP_RC_OK;
+}
+
+uint16_t
+ptp_usb_event_async_cancel (PTPParams* params) {
+	PTP_USB *ptp_usb;
+
+	if (params == NULL) {
+		return PTP_ERROR_BADPARAM;
+	}
+
+	ptp_usb = (PTP_USB *)(params->data);
+	if (ptp_usb->event_transfer == NULL)
+		return PTP_RC_OK;
+	/* The callback runs with PTP_ERROR_CANCEL on the next event poll */
+	return libusb_cancel_transfer(ptp_usb->event_transfer) == 0 ?
+		PTP_RC_OK : PTP_ERROR_IO;
 }
 
 /**
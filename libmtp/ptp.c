@@ -4832,6 +4832,32 @@ ptp_android_getpartialobject64 (PTPParams* params, uint32_t handle, uint64_t off
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object, len);
 }
 
+/**
+ * ptp_android_getpartialobject64_to_handler:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		offset			- Offset into object
+ *		maxbytes		- Maximum of bytes to read
+ *		handler			- a ptp data handler
+ *
+ * Get object 'handle' from device and send the data to the
+ * data handler. Start from offset and read at most maxbytes.
+ *
+ * This is a 64bit offset version of ptp_getpartialobject_to_handler.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle, uint64_t offset,
+				uint32_t maxbytes, PTPDataHandler *handler)
+{
+	PTPContainer ptp;
+
+	/* casts due to varargs otherwise pushing 64bit values on the stack */
+	PTP_CNT_INIT(ptp, PTP_OC_ANDROID_GetPartialObject64, handle, ((uint32_t)offset & 0xFFFFFFFF), (uint32_t)(offset >> 32), maxbytes);
+	return ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, handler);
+}
+
 uint16_t
 ptp_android_sendpartialobject (PTPParams* params, uint32_t handle, uint64_t offset,
 				unsigned char* object,	uint32_t len)
@@ -7470,6 +7496,64 @@ ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob
 	return PTP_RC_OK;
 }
 
+void
+ptp_object_apply_proplist (PTPObject *ob)
+{
+	unsigned int i;
+	MTPProperties *prop = ob->mtpprops;
+
+	for (i=0;i<ob->nrofmtpprops;i++,prop++) {
+		/* in case we got all subtree objects */
+		if (prop->ObjectHandle != ob->oid) continue;
+
+		switch (prop->property) {
+		case PTP_OPC_StorageID:
+			ob->oi.StorageID = prop->propval.u32;
+			break;
+		case PTP_OPC_ObjectFormat:
+			ob->oi.ObjectFormat = prop->propval.u16;
+			break;
+		case PTP_OPC_ProtectionStatus:
+			ob->oi.ProtectionStatus = prop->propval.u16;
+			break;
+		case PTP_OPC_ObjectSize:
+			if (prop->datatype == PTP_DTC_UINT64) {
+				ob->oi.ObjectCompressedSize = prop->propval.u64;
+			} else if (prop->datatype == PTP_DTC_UINT32) {
+				ob->oi.ObjectCompressedSize = prop->propval.u32;
+			}
+			break;
+		case PTP_OPC_AssociationType:
+			ob->oi.AssociationType = prop->propval.u16;
+			break;
+		case PTP_OPC_AssociationDesc:
+			ob->oi.AssociationDesc = prop->propval.u32;
+			break;
+		case PTP_OPC_ObjectFileName:
+			if (prop->propval.str) {
+				free(ob->oi.Filename);
+				ob->oi.Filename = strdup(prop->propval.str);
+			}
+			break;
+		case PTP_OPC_DateCreated:
+			ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->propval.str);
+			break;
+		case PTP_OPC_DateModified:
+			ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->propval.str);
+			break;
+		case PTP_OPC_Keywords:
+			if (prop->propval.str) {
+				free(ob->oi.Keywords);
+				ob->oi.Keywords = strdup(prop->propval.str);
+			}
+			break;
+		case PTP_OPC_ParentObject:
+			ob->oi.ParentObject = prop->propval.u32;
+			break;
+		}
+	}
+}
+
 uint16_t
 ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob)
 {
@@ -7567,61 +7651,8 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 		ob->nrofmtpprops = nrofprops;
 
 		/* Override the ObjectInfo data with data from properties */
-		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI) {
-			unsigned int i;
-			MTPProperties *prop = ob->mtpprops;
-
-			for (i=0;i<ob->nrofmtpprops;i++,prop++) {
-				/* in case we got all subtree objects */
-				if (prop->ObjectHandle != handle) continue;
-
-				switch (prop->property) {
-				case PTP_OPC_StorageID:
-					ob->oi.StorageID = prop->propval.u32;
-					break;
-				case PTP_OPC_ObjectFormat:
-					ob->oi.ObjectFormat = prop->propval.u16;
-					break;
-				case PTP_OPC_ProtectionStatus:
-					ob->oi.ProtectionStatus = prop->propval.u16;
-					break;
-				case PTP_OPC_ObjectSize:
-					if (prop->datatype == PTP_DTC_UINT64) {
-						ob->oi.ObjectCompressedSize = prop->propval.u64;
-					} else if (prop->datatype == PTP_DTC_UINT32) {
-						ob->oi.ObjectCompressedSize = prop->propval.u32;
-					}
-					break;
-				case PTP_OPC_AssociationType:
-					ob->oi.AssociationType = prop->propval.u16;
-					break;
-				case PTP_OPC_AssociationDesc:
-					ob->oi.AssociationDesc = prop->propval.u32;
-					break;
-				case PTP_OPC_ObjectFileName:
-					if (prop->propval.str) {
-						free(ob->oi.Filename);
-						ob->oi.Filename = strdup(prop->propval.str);
-					}
-					break;
-				case PTP_OPC_DateCreated:
-					ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->propval.str);
-					break;
-				case PTP_OPC_DateModified:
-					ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->propval.str);
-					break;
-				case PTP_OPC_Keywords:
-					if (prop->propval.str) {
-						free(ob->oi.Keywords);
-						ob->oi.Keywords = strdup(prop->propval.str);
-					}
-					break;
-				case PTP_OPC_ParentObject:
-					ob->oi.ParentObject = prop->propval.u32;
-					break;
-				}
-			}
-		}
+		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI)
+			ptp_object_apply_proplist (ob);
 
 #if 0
 		MTPProperties 	*xpl;
@@ -2763,6 +2763,9 @@ typedef struct _PTPDeviceProperty PTPDeviceProperty;
 #define PTP_DP_GETDATA          0x0002  /* receiving data */
 #define PTP_DP_DATA_MASK        0x00ff  /* data phase mask */
 
+/* Send length of a data phase that ends with a short packet instead. */
+#define PTP_DL_UNKNOWN          0xFFFFFFFFFFFFFFFFULL
+
 struct _PTPParams {
 	/* device flags */
 	uint32_t	device_flags;
@@ -2883,6 +2886,7 @@ uint16_t ptp_usb_getresp	(PTPParams* params, PTPContainer* resp);
 uint16_t ptp_usb_getdata	(PTPParams* params, PTPContainer* ptp, 
 	                         PTPDataHandler *handler);
 uint16_t ptp_usb_event_async	(PTPParams *params, PTPEventCbFn cb, void *user_data);
+uint16_t ptp_usb_event_async_cancel	(PTPParams *params);
 uint16_t ptp_usb_event_wait	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_usb_event_check	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_usb_event_check_queue	(PTPParams* params, PTPContainer* event);
@@ -3650,6 +3654,8 @@ uint16_t ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc, uint3
 uint16_t ptp_android_getpartialobject64	(PTPParams* params, uint32_t handle, uint64_t offset,
 					uint32_t maxbytes, unsigned char** object,
 					uint32_t *len);
+uint16_t ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle, uint64_t offset,
+					uint32_t maxbytes, PTPDataHandler *handler);
 #define ptp_android_begineditobject(params,handle) ptp_generic_no_data (params, PTP_OC_ANDROID_BeginEditObject, 1, handle)
 #define ptp_android_truncate(params,handle,offset) ptp_generic_no_data (params, PTP_OC_ANDROID_TruncateObject, 3, handle, (offset & 0xFFFFFFFF), (offset >> 32))
 uint16_t ptp_android_sendpartialobject (PTPParams *params, uint32_t handle,
@@ -3710,6 +3716,7 @@ MTPProperties *ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const h
 uint16_t ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_object_want (PTPParams *, uint32_t handle, unsigned int want, PTPObject**retob);
+void ptp_object_apply_proplist (PTPObject *ob);
 void ptp_objects_sort (PTPParams *);
 uint16_t ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob);
@@ -0,0 +1,114 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <cstring>
+#include "simple-mtpfs-block-cache.h"
+
+BlockCache::BlockCache():
+    m_mutex(),
+    m_slots(s_budget / s_block_size),
+    m_index(),
+    m_hand(0),
+    m_generation(0),
+    m_hits(0),
+    m_misses(0)
+{
+    for (Slot &slot : m_slots) {
+        slot.used = false;
+        slot.referenced = false;
+    }
+}
+
+bool BlockCache::get(uint32_t storage_id, uint32_t id, uint64_t block,
+    uint32_t offset, uint32_t size, unsigned char *buf)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(Key{storage_id, id, block});
+    if (it == m_index.end() ||
+        offset + size > m_slots[it->second].data.size()) {
+        ++m_misses;
+        return false;
+    }
+
+    Slot &slot = m_slots[it->second];
+    slot.referenced = true;
+    memcpy(buf, slot.data.data() + offset, size);
+    ++m_hits;
+    return true;
+}
+
+void BlockCache::put(uint32_t storage_id, uint32_t id, uint64_t block,
+    const unsigned char *data, uint32_t size, uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (generation != m_generation)
+        return;
+
+    const Key key{storage_id, id, block};
+    auto it = m_index.find(key);
+    const size_t n = it != m_index.end() ? it->second : evict();
+    Slot &slot = m_slots[n];
+    slot.key = key;
+    slot.used = true;
+    slot.referenced = false;
+    slot.data.assign(data, data + size);
+    m_index[key] = n;
+}
+
+size_t BlockCache::evict()
+{
+    for (;;) {
+        Slot &slot = m_slots[m_hand];
+        const size_t n = m_hand;
+        m_hand = (m_hand + 1) % m_slots.size();
+        if (!slot.used)
+            return n;
+        if (slot.referenced) {
+            slot.referenced = false;
+            continue;
+        }
+        m_index.erase(slot.key);
+        slot.used = false;
+        return n;
+    }
+}
+
+void BlockCache::invalidate(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_generation;
+    for (Slot &slot : m_slots) {
+        if (!slot.used || slot.key.id != id)
+            continue;
+        m_index.erase(slot.key);
+        slot.used = false;
+        slot.referenced = false;
+        std::vector<unsigned char>().swap(slot.data);
+    }
+}
+
+void BlockCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_generation;
+    m_index.clear();
+    for (Slot &slot : m_slots) {
+        slot.used = false;
+        slot.referenced = false;
+        std::vector<unsigned char>().swap(slot.data);
+    }
+}
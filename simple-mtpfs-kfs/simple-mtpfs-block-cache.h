@@ -0,0 +1,101 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_BLOCK_CACHE_H
+#define SMTPFS_BLOCK_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Cache of object content in fixed-size blocks, keyed by storage, object
+// and block index. The number of blocks is bounded by s_budget; the
+// blocks are evicted in CLOCK order, giving recently used blocks a second
+// chance.
+class BlockCache
+{
+public:
+    BlockCache();
+
+    static uint32_t blockSize() { return s_block_size; }
+
+    // Copies size bytes at offset within the block into buf; returns false
+    // if the block is not cached or shorter than that.
+    bool get(uint32_t storage_id, uint32_t id, uint64_t block, uint32_t offset,
+        uint32_t size, unsigned char *buf);
+    // Blocks read before an invalidation are dropped; pass the generation
+    // the read started at.
+    void put(uint32_t storage_id, uint32_t id, uint64_t block,
+        const unsigned char *data, uint32_t size, uint64_t generation);
+    uint64_t generation() const { return m_generation; }
+
+    void invalidate(uint32_t id);
+    void clear();
+
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
+
+private:
+    struct Key
+    {
+        uint32_t storage_id;
+        uint32_t id;
+        uint64_t block;
+
+        bool operator ==(const Key &rhs) const
+        {
+            return storage_id == rhs.storage_id && id == rhs.id &&
+                block == rhs.block;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator ()(const Key &key) const
+        {
+            uint64_t h = (uint64_t(key.storage_id) << 32 | key.id) *
+                0x9e3779b97f4a7c15ULL;
+            return static_cast<size_t>(h ^ (key.block * 0xc2b2ae3d27d4eb4fULL));
+        }
+    };
+
+    struct Slot
+    {
+        Key key;
+        bool used;
+        bool referenced;
+        std::vector<unsigned char> data;
+    };
+
+    size_t evict();
+
+    static const uint32_t s_block_size = 64 * 1024;
+    static const size_t s_budget = 32 * 1024 * 1024;
+
+    std::mutex m_mutex;
+    std::vector<Slot> m_slots;
+    std::unordered_map<Key, size_t, KeyHash> m_index;
+    size_t m_hand;
+    std::atomic<uint64_t> m_generation;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+};
+
+#endif // SMTPFS_BLOCK_CACHE_H
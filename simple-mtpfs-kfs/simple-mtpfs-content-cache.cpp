@@ -0,0 +1,274 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+extern "C" {
+#  include <copyfile.h>
+#  include <dirent.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  include <sys/time.h>
+}
+#include "simple-mtpfs-content-cache.h"
+#include "simple-mtpfs-log.h"
+#include "simple-mtpfs-util.h"
+
+ContentCache::ContentCache():
+    m_mutex(),
+    m_dir(),
+    m_prefix(),
+    m_lru(),
+    m_index(),
+    m_objects(),
+    m_size(0),
+    m_generation(0)
+{
+}
+
+bool ContentCache::open(const std::string &serial)
+{
+    if (isOpen())
+        return true;
+
+    const std::string cache_dir(smtpfs_get_cachedir());
+    if (cache_dir.empty() || serial.empty())
+        return false;
+
+    const std::string dir(cache_dir + "/content");
+    if (!smtpfs_check_dir(dir) && !smtpfs_create_dir(dir))
+        return false;
+
+    DIR *d = ::opendir(dir.c_str());
+    if (!d)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dir = dir;
+    m_prefix.clear();
+    for (char c : serial)
+        m_prefix += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    m_prefix += '-';
+
+    // Recency survives remounts as the modification time of the files.
+    struct Found
+    {
+        std::string name;
+        uint64_t size;
+        time_t used;
+    };
+    std::vector<Found> found;
+    struct dirent *entry;
+    while ((entry = ::readdir(d))) {
+        const std::string name(entry->d_name);
+        if (name == "." || name == "..")
+            continue;
+        const std::string path(m_dir + '/' + name);
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        // Left over by an interrupted store.
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            ::unlink(path.c_str());
+            continue;
+        }
+        found.push_back(Found{name, static_cast<uint64_t>(st.st_size), st.st_mtime});
+    }
+    ::closedir(d);
+
+    std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) {
+        return a.used > b.used;
+    });
+    for (const Found &f : found) {
+        m_lru.push_back(Entry{f.name, f.size});
+        m_index[f.name] = std::prev(m_lru.end());
+        m_size += f.size;
+        uint32_t storage_id;
+        uint32_t id;
+        if (parseKey(f.name, storage_id, id))
+            m_objects.emplace(std::make_pair(id, storage_id), f.name);
+    }
+    evict();
+
+    logmsg("Content cache holds ", m_lru.size(), " files, ", m_size, " bytes.\n");
+    return true;
+}
+
+void ContentCache::close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dir.clear();
+    m_lru.clear();
+    m_index.clear();
+    m_objects.clear();
+    m_size = 0;
+}
+
+std::string ContentCache::makeName(uint32_t storage_id, uint32_t id,
+    uint64_t size, time_t modif_date) const
+{
+    std::stringstream ss;
+    ss << m_prefix << std::hex << std::setfill('0') << std::setw(8) << storage_id
+       << '-' << std::setw(8) << id << std::dec << '-' << size << '-'
+       << static_cast<int64_t>(modif_date);
+    return ss.str();
+}
+
+bool ContentCache::parseKey(const std::string &name, uint32_t &storage_id,
+    uint32_t &id) const
+{
+    // <serial>-<storage>-<id>-<size>-<modification date>
+    if (name.compare(0, m_prefix.size(), m_prefix) != 0 ||
+        name.size() < m_prefix.size() + 18)
+        return false;
+
+    const std::string storage_hex(name.substr(m_prefix.size(), 8));
+    const std::string id_hex(name.substr(m_prefix.size() + 9, 8));
+    char *storage_end = nullptr;
+    char *id_end = nullptr;
+    storage_id = static_cast<uint32_t>(strtoul(storage_hex.c_str(), &storage_end, 16));
+    id = static_cast<uint32_t>(strtoul(id_hex.c_str(), &id_end, 16));
+    return storage_end && *storage_end == '\0' && id_end && *id_end == '\0';
+}
+
+bool ContentCache::fetch(uint32_t storage_id, uint32_t id, uint64_t size,
+    time_t modif_date, const std::string &path)
+{
+    const std::string name(makeName(storage_id, id, size, modif_date));
+    std::string cached;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_dir.empty())
+            return false;
+        auto it = m_index.find(name);
+        if (it == m_index.end())
+            return false;
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        cached = m_dir + '/' + name;
+    }
+
+    // Cloning needs the destination not to exist. The copy may fall back
+    // to reading the whole file, so it is done without the lock; a file
+    // evicted meanwhile is a miss.
+    ::unlink(path.c_str());
+    if (copyfile(cached.c_str(), path.c_str(), nullptr,
+            COPYFILE_DATA | COPYFILE_CLONE) != 0) {
+        ::unlink(path.c_str());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_index.find(name);
+        if (it != m_index.end())
+            remove(it->second);
+        return false;
+    }
+
+    ::utimes(cached.c_str(), nullptr);
+    return true;
+}
+
+void ContentCache::store(uint32_t storage_id, uint32_t id, uint64_t size,
+    time_t modif_date, const std::string &path)
+{
+    static std::atomic<unsigned int> tmp_counter(0);
+
+    const std::string name(makeName(storage_id, id, size, modif_date));
+    std::string dir;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_dir.empty() || size > s_budget || m_index.count(name))
+            return;
+        dir = m_dir;
+        generation = m_generation;
+    }
+
+    // Copied without the lock, see fetch().
+    const std::string cached(dir + '/' + name);
+    std::stringstream tmp_ss;
+    tmp_ss << cached << '.' << ++tmp_counter << ".tmp";
+    const std::string tmp(tmp_ss.str());
+    if (copyfile(path.c_str(), tmp.c_str(), nullptr,
+            COPYFILE_DATA | COPYFILE_CLONE) != 0) {
+        ::unlink(tmp.c_str());
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_dir != dir || m_generation != generation || m_index.count(name) ||
+        ::rename(tmp.c_str(), cached.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return;
+    }
+
+    // An older version of the object is of no use any more.
+    const std::pair<uint32_t, uint32_t> key(id, storage_id);
+    auto old = m_objects.find(key);
+    if (old != m_objects.end()) {
+        auto old_it = m_index.find(old->second);
+        if (old_it != m_index.end())
+            remove(old_it->second);
+    }
+
+    m_lru.push_front(Entry{name, size});
+    m_index[name] = m_lru.begin();
+    m_objects[key] = name;
+    m_size += size;
+    evict();
+}
+
+void ContentCache::invalidate(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_generation;
+    std::vector<std::string> names;
+    auto it = m_objects.lower_bound(std::make_pair(id, uint32_t(0)));
+    while (it != m_objects.end() && it->first.first == id) {
+        names.push_back(it->second);
+        it = m_objects.erase(it);
+    }
+    for (const std::string &name : names) {
+        auto index_it = m_index.find(name);
+        if (index_it != m_index.end())
+            remove(index_it->second);
+    }
+}
+
+void ContentCache::remove(List::iterator it)
+{
+    uint32_t storage_id;
+    uint32_t id;
+    if (parseKey(it->name, storage_id, id)) {
+        auto object = m_objects.find(std::make_pair(id, storage_id));
+        if (object != m_objects.end() && object->second == it->name)
+            m_objects.erase(object);
+    }
+
+    ::unlink((m_dir + '/' + it->name).c_str());
+    m_size -= it->size;
+    m_index.erase(it->name);
+    m_lru.erase(it);
+}
+
+void ContentCache::evict()
+{
+    while (m_size > s_budget && !m_lru.empty())
+        remove(std::prev(m_lru.end()));
+}
@@ -0,0 +1,82 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_CONTENT_CACHE_H
+#define SMTPFS_CONTENT_CACHE_H
+
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// On-disk copies of pulled objects, kept across mounts. An object is found
+// again only if its device serial number, storage, object id, size and
+// modification date all match. Files are cloned in and out of the cache,
+// which is kept within s_budget bytes by evicting the least recently used.
+class ContentCache
+{
+public:
+    ContentCache();
+
+    bool open(const std::string &serial);
+    void close();
+    bool isOpen() const { return !m_dir.empty(); }
+
+    // Copies a cached object to path; returns false on a miss.
+    bool fetch(uint32_t storage_id, uint32_t id, uint64_t size, time_t modif_date,
+        const std::string &path);
+    void store(uint32_t storage_id, uint32_t id, uint64_t size, time_t modif_date,
+        const std::string &path);
+    // Object ids are unique across storages; the entries of all storages
+    // are dropped.
+    void invalidate(uint32_t id);
+
+private:
+    struct Entry
+    {
+        std::string name;
+        uint64_t size;
+    };
+
+    typedef std::list<Entry> List;
+
+    std::string makeName(uint32_t storage_id, uint32_t id, uint64_t size,
+        time_t modif_date) const;
+    bool parseKey(const std::string &name, uint32_t &storage_id,
+        uint32_t &id) const;
+    void remove(List::iterator it);
+    void evict();
+
+    static const uint64_t s_budget = 4ULL * 1024 * 1024 * 1024;
+
+    std::mutex m_mutex;
+    std::string m_dir;
+    std::string m_prefix;
+    // Cached files, most recently used first.
+    List m_lru;
+    std::unordered_map<std::string, List::iterator> m_index;
+    // Files of the current device by object id and storage id.
+    std::map<std::pair<uint32_t, uint32_t>, std::string> m_objects;
+    uint64_t m_size;
+    // Bumped by every invalidation; a store copying meanwhile is dropped.
+    uint64_t m_generation;
+};
+
+#endif // SMTPFS_CONTENT_CACHE_H
@@ -0,0 +1,123 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include "simple-mtpfs-edit-sessions.h"
+
+EditSessions::EditSessions():
+    m_begin(),
+    m_end(),
+    m_mutex(),
+    m_cv(),
+    m_sessions(),
+    m_thread(),
+    m_stop(false)
+{
+}
+
+EditSessions::~EditSessions()
+{
+    stop();
+}
+
+int EditSessions::acquire(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(id);
+    if (it != m_sessions.end()) {
+        ++it->second.users;
+        it->second.used = Clock::now();
+        return 0;
+    }
+
+    int rval = m_begin(id);
+    if (rval != 0)
+        return rval;
+    m_sessions.emplace(id, Session{1, Clock::now()});
+    if (!m_thread.joinable()) {
+        m_stop = false;
+        m_thread = std::thread(&EditSessions::worker, this);
+    }
+    return 0;
+}
+
+void EditSessions::release(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(id);
+    if (it == m_sessions.end())
+        return;
+
+    --it->second.users;
+    it->second.used = Clock::now();
+}
+
+int EditSessions::end(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(id);
+    if (it == m_sessions.end())
+        return 0;
+
+    m_sessions.erase(it);
+    return m_end(id);
+}
+
+void EditSessions::drop(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sessions.erase(id);
+}
+
+int EditSessions::stop()
+{
+    int rval = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        for (const auto &entry : m_sessions) {
+            int end_rval = m_end(entry.first);
+            if (end_rval != 0)
+                rval = end_rval;
+        }
+        m_sessions.clear();
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+    return rval;
+}
+
+void EditSessions::worker()
+{
+    const std::chrono::seconds timeout(s_idle_timeout);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        m_cv.wait_for(lock, timeout);
+        if (m_stop)
+            break;
+
+        const Clock::time_point idle = Clock::now() - timeout;
+        for (auto it = m_sessions.begin(); it != m_sessions.end(); ) {
+            if (it->second.users == 0 && it->second.used <= idle) {
+                m_end(it->first);
+                it = m_sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
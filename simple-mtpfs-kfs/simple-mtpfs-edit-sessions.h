@@ -0,0 +1,81 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_EDIT_SESSIONS_H
+#define SMTPFS_EDIT_SESSIONS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Android edit sessions of objects being written in place. A session is
+// opened with BeginEditObject before the first partial write of an object
+// and kept open for the ones that follow, so that the device re-indexes
+// the object once, when EndEditObject closes the session. That happens on
+// an explicit end(), after s_idle_timeout without writes, or on stop().
+class EditSessions
+{
+public:
+    // Begins or ends editing an object; returns 0 or a negative errno.
+    typedef std::function<int(uint32_t id)> EditFunc;
+
+    EditSessions();
+    ~EditSessions();
+
+    void setBeginFunc(const EditFunc &begin) { m_begin = begin; }
+    void setEndFunc(const EditFunc &end) { m_end = end; }
+
+    // Opens the session of an object unless it is open already and keeps
+    // it open until the matching release().
+    int acquire(uint32_t id);
+    void release(uint32_t id);
+
+    int end(uint32_t id);
+    // Forgets the session of an object which is gone.
+    void drop(uint32_t id);
+    // Ends all sessions and stops the idle timer.
+    int stop();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Session
+    {
+        unsigned int users;
+        Clock::time_point used;
+    };
+
+    void worker();
+
+    static const int s_idle_timeout = 2;
+
+    EditFunc m_begin;
+    EditFunc m_end;
+    // Held across the device calls, so that a session is never begun and
+    // ended at the same time.
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::unordered_map<uint32_t, Session> m_sessions;
+    std::thread m_thread;
+    bool m_stop;
+};
+
+#endif // SMTPFS_EDIT_SESSIONS_H
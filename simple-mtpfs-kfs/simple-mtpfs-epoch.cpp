@@ -0,0 +1,156 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include "simple-mtpfs-epoch.h"
+
+thread_local Epoch::Local Epoch::s_local;
+
+Epoch::Local::~Local()
+{
+    // Hand the slot back when the thread exits.
+    if (slot) {
+        slot->start = 0;
+        slot->used = false;
+    }
+}
+
+Epoch::Epoch():
+    m_mutex(),
+    m_done(),
+    m_slots(),
+    m_entries(),
+    m_epoch(1),
+    m_pending(0),
+    m_collect_mutex(),
+    m_running(nullptr)
+{
+}
+
+Epoch &Epoch::instance()
+{
+    // Never destroyed; threads may still leave their sections while other
+    // static objects are torn down at exit.
+    static Epoch *epoch = new Epoch();
+    return *epoch;
+}
+
+Epoch::Slot *Epoch::slot()
+{
+    if (s_local.slot)
+        return s_local.slot;
+
+    Epoch &e = instance();
+    Slot *s = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(e.m_mutex);
+        for (const std::unique_ptr<Slot> &free : e.m_slots) {
+            if (!free->used) {
+                s = free.get();
+                break;
+            }
+        }
+        if (!s) {
+            e.m_slots.emplace_back(new Slot());
+            s = e.m_slots.back().get();
+            s->start = 0;
+        }
+        s->used = true;
+    }
+    s_local.slot = s;
+    return s;
+}
+
+void Epoch::enter()
+{
+    if (s_local.depth++ > 0)
+        return;
+    slot()->start = instance().m_epoch.load();
+}
+
+void Epoch::leave()
+{
+    if (--s_local.depth > 0)
+        return;
+    s_local.slot->start = 0;
+    if (instance().m_pending > 0)
+        collect();
+}
+
+void Epoch::retire(const void *owner, std::function<void()> func)
+{
+    Epoch &e = instance();
+    std::lock_guard<std::mutex> lock(e.m_mutex);
+    // Taken under the mutex, so the queue stays ordered by epoch.
+    e.m_entries.push_back(Entry{++e.m_epoch, owner, std::move(func)});
+    ++e.m_pending;
+}
+
+void Epoch::forget(const void *owner)
+{
+    Epoch &e = instance();
+    std::unique_lock<std::mutex> lock(e.m_mutex);
+    e.m_done.wait(lock, [&]() { return e.m_running != owner; });
+    for (auto it = e.m_entries.begin(); it != e.m_entries.end(); ) {
+        if (it->owner == owner) {
+            it = e.m_entries.erase(it);
+            --e.m_pending;
+        } else {
+            ++it;
+        }
+    }
+}
+
+uint64_t Epoch::oldest() const
+{
+    uint64_t oldest = UINT64_MAX;
+    for (const std::unique_ptr<Slot> &s : m_slots) {
+        const uint64_t start = s->start.load();
+        if (start != 0 && start < oldest)
+            oldest = start;
+    }
+    return oldest;
+}
+
+void Epoch::collect()
+{
+    Epoch &e = instance();
+    // One collector at a time; whoever finds it busy leaves the work to it.
+    std::unique_lock<std::mutex> collecting(e.m_collect_mutex, std::try_to_lock);
+    if (!collecting.owns_lock())
+        return;
+
+    // A section which started at or after an entry's epoch cannot have
+    // reached what it frees. The functions run outside of the mutex, as
+    // they take the directory locks.
+    std::unique_lock<std::mutex> lock(e.m_mutex);
+    while (!e.m_entries.empty() && e.m_entries.front().epoch <= e.oldest()) {
+        Entry entry = std::move(e.m_entries.front());
+        e.m_entries.pop_front();
+        --e.m_pending;
+        e.m_running = entry.owner;
+        lock.unlock();
+        entry.func();
+        lock.lock();
+        e.m_running = nullptr;
+        e.m_done.notify_all();
+    }
+}
+
+size_t Epoch::pending()
+{
+    return instance().m_pending;
+}
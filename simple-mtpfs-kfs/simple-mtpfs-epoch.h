@@ -0,0 +1,101 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_EPOCH_H
+#define SMTPFS_EPOCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Deferred reclamation of tree nodes. Threads which walk the tree without
+// holding the directory locks do so inside a Section; a node taken out of
+// the tree is retired with a function which frees it, and the function runs
+// once every section which was already running at that point has ended.
+// Retired functions run from the end of the outermost section, with no
+// directory locked.
+class Epoch
+{
+public:
+    class Section
+    {
+    public:
+        Section() { Epoch::enter(); }
+        ~Section() { Epoch::leave(); }
+
+        Section(const Section &) = delete;
+        Section &operator =(const Section &) = delete;
+    };
+
+    static void enter();
+    static void leave();
+
+    // Queues func on behalf of owner; may be called with locks held.
+    static void retire(const void *owner, std::function<void()> func);
+    // Drops what owner still has queued, waiting for a function of it
+    // which is running; called before owner goes away.
+    static void forget(const void *owner);
+    // Runs the functions which are due.
+    static void collect();
+
+    static size_t pending();
+
+private:
+    struct Slot {
+        // Epoch the section entered at, 0 outside of a section.
+        std::atomic<uint64_t> start;
+        std::atomic<bool> used;
+    };
+
+    struct Entry {
+        uint64_t epoch;
+        const void *owner;
+        std::function<void()> func;
+    };
+
+    // Section state of the calling thread.
+    struct Local {
+        Slot *slot = nullptr;
+        unsigned depth = 0;
+
+        ~Local();
+    };
+
+    static thread_local Local s_local;
+
+    Epoch();
+    static Epoch &instance();
+    static Slot *slot();
+
+    uint64_t oldest() const;
+
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    std::deque<Entry> m_entries;
+    std::atomic<uint64_t> m_epoch;
+    std::atomic<size_t> m_pending;
+    std::mutex m_collect_mutex;
+    const void *m_running;
+};
+
+#endif // SMTPFS_EPOCH_H
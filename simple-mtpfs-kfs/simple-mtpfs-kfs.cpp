@@ -23,12 +23,18 @@ extern "C" {
 #  include <fcntl.h>
 #  include <getopt.h>
 }
+#include "simple-mtpfs-epoch.h"
 #include "simple-mtpfs-kfs.h"
 #include "simple-mtpfs-log.h"
 #include "simple-mtpfs-util.h"
 
 #define PACKAGE_BUGREPORT "Nobody"
 
+// Root of the virtual tree of device generated thumbnails.
+static const char s_thumbnail_dir[] = "/.thumbnails";
+// KFS has no fsync; creating this virtual file syncs the whole volume.
+static const char s_sync_file[] = "/.smtpfs-sync";
+
 pthread_cond_t ready;
 
 static void fs_in(){
@@ -43,6 +49,7 @@ static void fs_out(){
 static bool wrap_getattr(const char *path, kfsstat_t *result, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     SMTPFileSystem *fs = (SMTPFileSystem*)ctx->fs;
     int ret = fs->getattr(path, result, error, (SMTPcontext_t*)context);
@@ -51,7 +58,7 @@ static bool wrap_getattr(const char *path, kfsstat_t *result, int *error, void *
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -59,6 +66,7 @@ static bool wrap_getattr(const char *path, kfsstat_t *result, int *error, void *
 static bool wrap_mkdir(const char *path, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->mkdir(path, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -66,7 +74,7 @@ static bool wrap_mkdir(const char *path, int *error, void *context)
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -74,6 +82,7 @@ static bool wrap_mkdir(const char *path, int *error, void *context)
 static bool wrap_rmdir(const char *path, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->rmdir(path, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -81,7 +90,7 @@ static bool wrap_rmdir(const char *path, int *error, void *context)
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -89,6 +98,7 @@ static bool wrap_rmdir(const char *path, int *error, void *context)
 static bool wrap_rename(const char *path, const char *newpath, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->rename(path, newpath, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -96,7 +106,7 @@ static bool wrap_rename(const char *path, const char *newpath, int *error, void
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -104,6 +114,7 @@ static bool wrap_rename(const char *path, const char *newpath, int *error, void
 static bool wrap_utime(const char *path, const kfstime_t *atime, const kfstime_t *mtime, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->utime(path, atime, mtime, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -111,7 +122,7 @@ static bool wrap_utime(const char *path, const kfstime_t *atime, const kfstime_t
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -119,36 +130,35 @@ static bool wrap_utime(const char *path, const kfstime_t *atime, const kfstime_t
 static ssize_t wrap_read(const char *path, char *buf, size_t offset, size_t length, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->read(path, buf, offset, length, error, (SMTPcontext_t*)context);
-    if(ret == 0){
-        *error = 0;
-        return true;
-    }
-    else {
-        *error = ret;
-        return false;
+    if (ret < 0) {
+        *error = -ret;
+        return -1;
     }
+    *error = 0;
+    return ret;
 }
 
 static ssize_t wrap_write(const char *path, const char *buf, size_t offset, size_t length, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->write(path, buf, offset, length, error, (SMTPcontext_t*)context);
-    if(ret == 0){
-        *error = 0;
-        return true;
-    }
-    else {
-        *error = ret;
-        return false;
+    if (ret < 0) {
+        *error = -ret;
+        return -1;
     }
+    *error = 0;
+    return ret;
 }
 
 static bool wrap_truncate(const char *path, uint64_t size, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->truncate(path, size);
     if(ret == 0){
@@ -156,7 +166,7 @@ static bool wrap_truncate(const char *path, uint64_t size, int *error, void *con
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -164,6 +174,7 @@ static bool wrap_truncate(const char *path, uint64_t size, int *error, void *con
 static bool wrap_statfs(const char *path, kfsstatfs_t *result, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->statfs(path, result, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -171,7 +182,7 @@ static bool wrap_statfs(const char *path, kfsstatfs_t *result, int *error, void
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -179,6 +190,7 @@ static bool wrap_statfs(const char *path, kfsstatfs_t *result, int *error, void
 static bool wrap_readdir(const char *path, kfscontents_t *contents, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->readdir(path, contents, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -186,7 +198,7 @@ static bool wrap_readdir(const char *path, kfscontents_t *contents, int *error,
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -206,6 +218,7 @@ static bool wrap_chmod(const char *path, kfsmode_t mode, int *error, void *conte
 static bool wrap_create(const char *path, int *error, void *context)
 {
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->create(path, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -213,13 +226,14 @@ static bool wrap_create(const char *path, int *error, void *context)
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
 
 static bool wrap_remove(const char *path, int *error, void *context){
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->unlink(path, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -227,14 +241,15 @@ static bool wrap_remove(const char *path, int *error, void *context){
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
 
-// not supported in kfs
+// not supported in kfs, see s_sync_file
 static bool wrap_fsync(const char *path, int *error, void *context){
     fs_in();
+    Epoch::Section section;
     SMTPcontext_t *ctx = (SMTPcontext_t*)context;
     int ret = ((SMTPFileSystem*)ctx->fs)->fsync(path, error, (SMTPcontext_t*)context);
     if(ret == 0){
@@ -242,7 +257,7 @@ static bool wrap_fsync(const char *path, int *error, void *context){
         return true;
     }
     else {
-        *error = ret;
+        *error = -ret;
         return false;
     }
 }
@@ -257,6 +272,10 @@ SMTPFileSystem::SMTPFileSystemOptions::SMTPFileSystemOptions()
     , m_verbose(false)
     , m_enable_move(false)
     , m_list_devices(false)
+    , m_prefetch(false)
+    , m_snapshot(false)
+    , m_thumbnails(false)
+    , m_content_cache(false)
     , m_device_no(1)
     , m_device_file(nullptr)
     , m_mount_point(nullptr)
@@ -277,6 +296,10 @@ m_kfs_filesystem(),
 m_tmp_files_pool(),
 m_options()
 {
+    m_tmp_files_pool.setReleaseFunc([this](const std::shared_ptr<TypeTmpFile> &tmp) {
+        Epoch::Section section;
+        tmpFileRelease(tmp);
+    });
     return;
 }
 
@@ -284,6 +307,8 @@ SMTPFileSystem::~SMTPFileSystem()
 {
     kfs_unmount(m_kfs_id);
     
+    // staged changes are queued for upload, which disconnect waits for
+    m_tmp_files_pool.releaseAll();
     m_device.disconnect();
 
     if (!m_tmp_files_pool.removeTmpDir()) {
@@ -301,6 +326,10 @@ enum opt_result{
 
 struct mntopts {
     int device_idx;
+    bool prefetch;
+    bool snapshot;
+    bool thumbnails;
+    bool content_cache;
     char* mntpt;
 };
 
@@ -313,10 +342,18 @@ int getmntopts(int argc, char **argv, struct mntopts &mount_opts){
     struct option long_opts[] = {
         { "all", no_argument, 0, 0 },
         { "device", required_argument, 0, 1 },
+        { "prefetch", no_argument, 0, 'p' },
+        { "snapshot", no_argument, 0, 's' },
+        { "thumbnails", no_argument, 0, 't' },
+        { "cache", no_argument, 0, 'c' },
         { 0, 0, 0, 0 }
     };
+    mount_opts.prefetch = false;
+    mount_opts.snapshot = false;
+    mount_opts.thumbnails = false;
+    mount_opts.content_cache = false;
     opterr = 0;
-    while ((c = getopt_long(argc, argv, "ad:", long_opts, &opt_ind)) != -1) {
+    while ((c = getopt_long(argc, argv, "ad:pstc", long_opts, &opt_ind)) != -1) {
         switch (c) {
         case OPT_LIST_ALL:
         case 'a':
@@ -328,6 +365,18 @@ int getmntopts(int argc, char **argv, struct mntopts &mount_opts){
             good = end[0] == '\0';
             break;
         }
+        case 'p':
+            mount_opts.prefetch = true;
+            break;
+        case 's':
+            mount_opts.snapshot = true;
+            break;
+        case 't':
+            mount_opts.thumbnails = true;
+            break;
+        case 'c':
+            mount_opts.content_cache = true;
+            break;
         case '?':
             return OPT_BAD_ARG;;
         }
@@ -367,6 +416,10 @@ bool SMTPFileSystem::parseOptions(int argc, char **argv)
         m_options.m_good = true;
         m_options.m_mount_point = opts.mntpt;
         m_options.m_device_no = opts.device_idx;
+        m_options.m_prefetch = opts.prefetch;
+        m_options.m_snapshot = opts.snapshot;
+        m_options.m_thumbnails = opts.thumbnails;
+        m_options.m_content_cache = opts.content_cache;
         m_options.m_good = true;
         m_options.m_verbose = true;
     }
@@ -415,6 +468,10 @@ void SMTPFileSystem::printHelp(std::string progname) const
         << "    -v   --verbose         verbose output, implies -f\n"
         << "    -l   --list-devices    print available devices. Supports <source> option\n"
         << "         --device          select a device number to mount\n"
+        << "    -p   --prefetch        read the whole directory tree in the background\n"
+        << "    -s   --snapshot        keep the directory tree on disk between mounts\n"
+        << "    -t   --thumbnails      serve device thumbnails under /.thumbnails\n"
+        << "    -c   --cache           keep pulled files on disk between mounts\n"
         << "    -o enable-move         enable the move operations\n\n";
         std::cerr << "\nReport bugs to <" << PACKAGE_BUGREPORT << ">.\n";
 }
@@ -454,6 +511,14 @@ bool SMTPFileSystem::mount(SMTPcontext_t *ctx){
         if (!m_device.connect(m_options.m_device_no))
             return false;
     }
+
+    if (m_options.m_snapshot)
+        m_device.snapshotLoad();
+    if (m_options.m_content_cache)
+        m_device.contentCacheOpen();
+    if (m_options.m_prefetch)
+        m_device.prefetchStart();
+    m_device.eventStart();
         
     kfsoptions_t opts = {m_options.m_mount_point};
     
@@ -483,7 +548,20 @@ bool SMTPFileSystem::mount(SMTPcontext_t *ctx){
 int SMTPFileSystem::getattr(const char *path, kfsstat_t *result, int *error, SMTPcontext_t *context)
 {
     int ret = 0;
+    std::string thumb_path;
     memset(result, 0, sizeof(struct kfsstat));
+
+    if (thumbnailPath(path, thumb_path)) {
+        ret = thumbnailGetattr(thumb_path, result);
+        goto out;
+    }
+
+    // always there and empty, so that touch succeeds
+    if (strcmp(path, s_sync_file) == 0) {
+        result->mode = (kfsmode_t)(0644);
+        result->type = KFS_REG;
+        goto out;
+    }
     
     if (std::string(path) == std::string("/")) {
         const TypeDir *content = opendir(path);
@@ -499,13 +577,20 @@ int SMTPFileSystem::getattr(const char *path, kfsstat_t *result, int *error, SMT
         goto out;
     }
     else {
+        // Finder keeps probing for .DS_Store, ._* and the like; answer
+        // repeated misses without resolving the path again.
+        if (m_device.negativeLookup(path)) {
+            ret = -ENOENT;
+            goto out;
+        }
+
         struct stat sbuf = {0};
         std::string tmp_path(smtpfs_dirname(path));
         std::string tmp_file(smtpfs_basename(path));
         const TypeDir *content = m_device.dirFetchContent(tmp_path);
         
         if (!content) {
-            ret = ENOENT;
+            ret = -ENOENT;
             goto out;
         }
         
@@ -517,7 +602,7 @@ int SMTPFileSystem::getattr(const char *path, kfsstat_t *result, int *error, SMT
             result->mtime.nsec = dir->modificationDate();
         }
         else if (content->file(tmp_file)) {
-            const TypeFile *file = content->file(tmp_file);
+            std::unique_ptr<const TypeFile> file = content->file(tmp_file);
             stat(tmp_file.c_str(), &sbuf);
             result->size = file->size();
             result->mode = static_cast<kfsmode_t>(result->mode | 0644);
@@ -528,7 +613,8 @@ int SMTPFileSystem::getattr(const char *path, kfsstat_t *result, int *error, SMT
             result->used = (file->size() / 512) + (file->size() % 512 > 0 ? 1 : 0);
         }
         else {
-            ret = ENOENT;
+            m_device.negativeInsert(path);
+            ret = -ENOENT;
             goto out;
         }
     }
@@ -540,6 +626,10 @@ out:
 
 int SMTPFileSystem::mkdir(const char *path, int *error, SMTPcontext_t *context)
 {
+    if (isThumbnailPath(path)) {
+        fs_out();
+        return -EROFS;
+    }
     int ret = m_device.dirCreateNew(std::string(path));
     fs_out();
     return ret;
@@ -547,6 +637,17 @@ int SMTPFileSystem::mkdir(const char *path, int *error, SMTPcontext_t *context)
 
 int SMTPFileSystem::unlink(const char *path, int *error, SMTPcontext_t *context)
 {
+    if (isThumbnailPath(path)) {
+        fs_out();
+        return -EROFS;
+    }
+    if (strcmp(path, s_sync_file) == 0) {
+        fs_out();
+        return 0;
+    }
+    // a staged copy released later would bring the file back
+    for (const auto &tmp_file : m_tmp_files_pool.takeFiles(std::string(path)))
+        tmpFileDiscard(tmp_file);
     int ret = m_device.fileRemove(std::string(path));
     fs_out();
     return ret;
@@ -554,6 +655,10 @@ int SMTPFileSystem::unlink(const char *path, int *error, SMTPcontext_t *context)
 
 int SMTPFileSystem::rmdir(const char *path, int *error, SMTPcontext_t *context)
 {
+    if (isThumbnailPath(path)) {
+        fs_out();
+        return -EROFS;
+    }
     int ret = m_device.dirRemove(std::string(path));
     fs_out();
     return ret;
@@ -562,31 +667,23 @@ int SMTPFileSystem::rmdir(const char *path, int *error, SMTPcontext_t *context)
 int SMTPFileSystem::rename(const char *path, const char *newpath, int *error, SMTPcontext_t *context)
 {
     int ret = 0;
+    if (isThumbnailPath(path) || isThumbnailPath(newpath)) {
+        fs_out();
+        return -EROFS;
+    }
     const std::string tmp_old_dirname(smtpfs_dirname(std::string(path)));
     const std::string tmp_new_dirname(smtpfs_dirname(std::string(newpath)));
-    std::string tmp_file;
     if (tmp_old_dirname == tmp_new_dirname){
-        ret = m_device.rename(std::string(path), std::string(newpath));
+        ret = renameStaged(path, newpath);
         goto out;
     }
 
     if (!m_options.m_enable_move){
-        ret = EPERM;
+        ret = -EPERM;
         goto out;
     }
 
-    tmp_file = (m_tmp_files_pool.makeTmpPath(std::string(newpath)));
-    ret = m_device.filePull(std::string(path), tmp_file);
-    if (ret != 0)
-        goto out;
-
-    ret = m_device.filePush(tmp_file, std::string(newpath));
-    if (ret != 0)
-        goto out;
-
-    ret = m_device.fileRemove(std::string(path));
-    if (ret != 0)
-        goto out;
+    ret = moveFile(path, newpath);
 out:
     fs_out();
     return ret;
@@ -594,6 +691,10 @@ out:
 
 int SMTPFileSystem::utime(const char *path, const kfstime_t *atime, const kfstime_t *mtime, int *error, SMTPcontext_t *context)
 {
+    if (strcmp(path, s_sync_file) == 0) {
+        fs_out();
+        return 0;
+    }
     std::string tmp_basename(smtpfs_basename(std::string(path)));
     std::string tmp_dirname(smtpfs_dirname(std::string(path)));
 
@@ -603,7 +704,7 @@ int SMTPFileSystem::utime(const char *path, const kfstime_t *atime, const kfstim
         return -ENOENT;
     }
 
-    const TypeFile *file = parent->file(tmp_basename);
+    std::unique_ptr<const TypeFile> file = parent->file(tmp_basename);
     if (!file){
         fs_out();
         return -ENOENT;
@@ -616,17 +717,37 @@ int SMTPFileSystem::utime(const char *path, const kfstime_t *atime, const kfstim
 
 int SMTPFileSystem::create(const char *path, int *error, SMTPcontext_t *context)
 {
-    const std::string tmp_path = m_tmp_files_pool.makeTmpPath(std::string(path));
+    if (isThumbnailPath(path)) {
+        fs_out();
+        return -EROFS;
+    }
+    if (strcmp(path, s_sync_file) == 0)
+        return fsync("-", error, context);
+    const std::string std_path(path);
+    const std::string tmp_path = m_tmp_files_pool.makeTmpPath(std_path);
 
-    int rval = ::creat(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY);
+    int rval = ::open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_RDWR,
+        S_IRUSR | S_IWUSR);
     if (rval < 0){
         fs_out();
         return -errno;
     }
 
-    m_tmp_files_pool.addFile(TypeTmpFile(std::string(path), tmp_path, rval, true));
-    rval = m_device.filePush(tmp_path, std::string(path));
+    // without partial writes the data is staged and uploaded on release;
+    // otherwise it goes to the device directly and the copy is not needed
+    std::shared_ptr<TypeTmpFile> tmp_file = std::make_shared<TypeTmpFile>(
+        std_path, tmp_path, rval, true);
+    std::shared_ptr<TypeTmpFile> added;
+    if (!hasPartialObjectSupport())
+        added = m_tmp_files_pool.addFile(tmp_file);
+    rval = m_device.filePush(tmp_path, std_path);
 
+    if (added != tmp_file) {
+        tmp_file->close();
+        ::unlink(tmp_path.c_str());
+        if (added)
+            tmpFileTruncate(added.get(), 0);
+    }
     if (rval != 0){
         fs_out();
         return rval;
@@ -640,93 +761,254 @@ int SMTPFileSystem::fsync(const char *path, int *error, SMTPcontext_t *context)
     int rval;
     
     const std::string std_path(path);
+    // the whole volume is synced, wait for the files queued for upload
     if (std_path == std::string("-")){
+        rval = m_device.fileSync();
         fs_out();
-        return 0;
+        return rval;
     }
 
-    TypeTmpFile *tmp_file = const_cast<TypeTmpFile*>(
-        m_tmp_files_pool.getFile(std_path));
-    
-    if (tmp_file->refcnt() != 0){
-        fs_out();
-        return 0;
+    // partial writes are buffered, send them to the device now
+    int flush_rval = 0;
+    if (hasPartialObjectSupport())
+        flush_rval = m_device.fileFlush(std_path);
+
+    // release the staged copy now, unless others still use it; the pool
+    // releases it once idle otherwise
+    std::shared_ptr<TypeTmpFile> tmp_file = m_tmp_files_pool.takeFile(std_path);
+    if (tmp_file)
+        tmpFileRelease(tmp_file);
+    fs_out();
+    return flush_rval;
+}
+
+int SMTPFileSystem::renameStaged(const char *path, const char *newpath)
+{
+    const std::string std_path(path);
+    const std::string std_newpath(newpath);
+
+    // Staged copies must not recreate the old path once released, they
+    // move along with the object. Those of the target are dropped once it
+    // is replaced.
+    std::vector<std::shared_ptr<TypeTmpFile>> staged =
+        m_tmp_files_pool.takeFiles(std_path);
+    std::vector<std::shared_ptr<TypeTmpFile>> replaced =
+        m_tmp_files_pool.takeFiles(std_newpath);
+    std::shared_ptr<TypeTmpFile> staged_file;
+    for (const auto &tmp_file : staged) {
+        // a stream goes to the old name
+        uploadCancel(tmp_file.get());
+        if (tmp_file->pathDevice() == std_path)
+            staged_file = tmp_file;
+    }
+
+    // another caller may have opened the path meanwhile
+    auto readd = [this](const std::shared_ptr<TypeTmpFile> &tmp_file) {
+        if (m_tmp_files_pool.addFile(tmp_file) != tmp_file)
+            tmpFileRelease(tmp_file);
+    };
+
+    int rval = m_device.rename(std_path, std_newpath);
+
+    // A cancelled stream of a new file leaves it only in the staged copy.
+    const TypeDir *parent = m_device.dirFetchContent(smtpfs_dirname(std_path));
+    if (rval != 0 && staged_file && staged_file->isModified() && parent &&
+        !parent->file(smtpfs_basename(std_path)))
+        rval = m_device.filePush(staged_file->pathTmp(), std_newpath);
+
+    if (rval != 0) {
+        for (const auto &tmp_file : staged)
+            readd(tmp_file);
+        for (const auto &tmp_file : replaced)
+            readd(tmp_file);
+        return rval;
     }
-    
-    tmp_file->close();
 
-    const bool modif = tmp_file->isModified();
-    const std::string tmp_path = tmp_file->pathTmp();
-    m_tmp_files_pool.removeFile(std_path);
-    if (modif) {
-        rval = m_device.filePush(tmp_path, std_path);
-        if (rval != 0) {
-            ::unlink(tmp_path.c_str());
-            fs_out();
-            return -rval;
+    for (const auto &tmp_file : replaced)
+        tmpFileDiscard(tmp_file);
+    for (const auto &tmp_file : staged) {
+        tmp_file->setPathDevice(std_newpath +
+            tmp_file->pathDevice().substr(std_path.size()));
+        readd(tmp_file);
+    }
+    return 0;
+}
+
+int SMTPFileSystem::moveFile(const char *path, const char *newpath)
+{
+    const std::string std_path(path);
+    const std::string std_newpath(newpath);
+
+    // The device copy is stale while a modified staged copy exists; that
+    // one is uploaded instead and moves to the new path.
+    std::shared_ptr<TypeTmpFile> staged;
+    for (const auto &tmp_file : m_tmp_files_pool.takeFiles(std_path)) {
+        if (tmp_file->pathDevice() == std_path)
+            staged = tmp_file;
+        else
+            m_tmp_files_pool.addFile(tmp_file);
+    }
+
+    int rval = 0;
+    if (staged) {
+        uploadCancel(staged.get());
+        std::shared_ptr<ObjectDownload> download = staged->download();
+        if (download)
+            rval = download->waitDone();
+        if (rval == 0)
+            rval = m_device.filePush(staged->pathTmp(), std_newpath);
+    } else {
+        const std::string tmp_path(m_tmp_files_pool.makeTmpPath(std_newpath));
+        rval = m_device.filePull(std_path, tmp_path);
+        if (rval == 0)
+            rval = m_device.filePush(tmp_path, std_newpath);
+        ::unlink(tmp_path.c_str());
+    }
+    if (rval == 0)
+        rval = m_device.fileRemove(std_path);
+
+    if (staged) {
+        if (rval == 0) {
+            staged->setPathDevice(std_newpath);
+            staged->setModified(false);
         }
+        if (m_tmp_files_pool.addFile(staged) != staged)
+            tmpFileRelease(staged);
     }
+    return rval;
+}
 
-    ::unlink(tmp_path.c_str());
-    fs_out();
-    return 0;
+void SMTPFileSystem::tmpFileDiscard(const std::shared_ptr<TypeTmpFile> &tmp_file)
+{
+    tmp_file->close();
+    if (tmp_file->download())
+        tmp_file->download()->cancel();
+    uploadCancel(tmp_file.get());
+    ::unlink(tmp_file->pathTmp().c_str());
+}
+
+void SMTPFileSystem::tmpFileRelease(const std::shared_ptr<TypeTmpFile> &tmp_file)
+{
+    tmp_file->close();
+    if (tmp_file->download())
+        tmp_file->download()->cancel();
+
+    // a stream that got all of the data leaves nothing to upload
+    bool modif = tmp_file->isModified();
+    std::shared_ptr<ObjectUpload> upload = tmp_file->upload();
+    if (upload) {
+        if (upload->close() && upload->wait() == 0)
+            modif = false;
+        else
+            uploadCancel(tmp_file.get());
+    }
+
+    // the upload takes over the staged file and removes it when done
+    if (modif) {
+        m_device.filePushQueued(tmp_file->pathTmp(), tmp_file->pathDevice());
+        return;
+    }
+    ::unlink(tmp_file->pathTmp().c_str());
 }
 
-int SMTPFileSystem::open(const char *path, int flags)
+int SMTPFileSystem::open(const char *path, int flags,
+    std::shared_ptr<TypeTmpFile> &tmp_file)
 {
     if (flags & O_WRONLY)
         flags |= O_TRUNC;
 
     const std::string std_path(path);
 
-    TypeTmpFile *tmp_file = const_cast<TypeTmpFile*>(
-        m_tmp_files_pool.getFile(std_path));
+    const std::string tmp_path = m_tmp_files_pool.makeTmpPath(std_path);
+    std::shared_ptr<ObjectDownload> download;
 
-    std::string tmp_path;
-    if (tmp_file) {
-        tmp_path = tmp_file->pathTmp();
-    } else {
-        tmp_path = m_tmp_files_pool.makeTmpPath(std_path);
-
-        // only copy the file if needed
-        if (!hasPartialObjectSupport()) {
-            int rval = m_device.filePull(std_path, tmp_path);
-            if (rval != 0)
-                return -rval;
-        } else {
-            int fd = ::creat(tmp_path.c_str(), S_IRUSR | S_IWUSR);
-            ::close(fd);
+    // only copy the file if needed; truncated files start out empty and
+    // reads of the others are served as soon as their range has landed
+    if (!hasPartialObjectSupport() && !(flags & O_TRUNC)) {
+        int rval = m_device.filePullAsync(std_path, tmp_path, download);
+        if (rval != 0) {
+            fs_out();
+            return rval;
         }
     }
 
     // we create the tmp file even if we can use partial get/send to
     // have a valid file descriptor
-    int fd = ::open(tmp_path.c_str(), flags);
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | (flags & O_TRUNC),
+        S_IRUSR | S_IWUSR);
     if (fd < 0) {
+        int errno_tmp = errno;
+        if (download)
+            download->cancel();
         ::unlink(tmp_path.c_str());
         fs_out();
-        return -errno;
+        return -errno_tmp;
     }
 
-    if (tmp_file)
-        tmp_file->addFileDescriptor(fd);
-    else
-        m_tmp_files_pool.addFile(TypeTmpFile(std_path, tmp_path, fd));
+    tmp_file = std::make_shared<TypeTmpFile>(std_path, tmp_path, fd);
+    tmp_file->setDownload(download);
     fs_out();
     return 0;
 }
 
+std::shared_ptr<TypeTmpFile> SMTPFileSystem::tmpFileGet(const char *path, int &rval)
+{
+    rval = 0;
+    std::shared_ptr<TypeTmpFile> tmp_file = m_tmp_files_pool.getFile(std::string(path));
+    if (tmp_file)
+        return tmp_file;
+
+    // KFS has no open callback, the first read or write opens the file
+    rval = open(path, O_RDWR, tmp_file);
+    if (rval != 0)
+        return nullptr;
+    std::shared_ptr<TypeTmpFile> added = m_tmp_files_pool.addFile(tmp_file);
+    if (added != tmp_file) {
+        // another caller opened it meanwhile
+        if (tmp_file->download())
+            tmp_file->download()->cancel();
+        tmp_file->close();
+        ::unlink(tmp_file->pathTmp().c_str());
+    }
+    return added;
+}
+
 int SMTPFileSystem::read(const char *path, char *buf, size_t offset, size_t length, int *error, SMTPcontext_t *context)
 {
     ssize_t rval = 0;
-    if (hasPartialObjectSupport()) {
+    std::string thumb_path;
+    if (thumbnailPath(path, thumb_path)) {
+        rval = thumbnailRead(thumb_path, buf, offset, length);
+    }
+    else if (strcmp(path, s_sync_file) == 0) {
+        rval = 0;
+    }
+    else if (hasPartialObjectSupport()) {
         const std::string std_path(path);
         rval = m_device.fileRead(std_path, buf, length, offset);
     }
     else {
-        const TypeTmpFile *tmp_file = m_tmp_files_pool.getFile(std::string(path));
-        int fd = open(tmp_file->pathTmp().c_str(), O_RDONLY);
-        rval = ::pread(fd, buf, length, offset);
+        int open_rval;
+        std::shared_ptr<TypeTmpFile> tmp_file = tmpFileGet(path, open_rval);
+        if (!tmp_file){
+            fs_out();
+            return open_rval;
+        }
+        std::shared_ptr<ObjectDownload> download = tmp_file->download();
+        if (download) {
+            int wait_rval = download->wait(offset + length);
+            if (wait_rval != 0) {
+                fs_out();
+                return wait_rval;
+            }
+        }
+        // the file is still growing while it is being pulled, so it is
+        // only mapped once the download is complete
+        rval = -1;
+        if (!download || download->isDone())
+            rval = tmp_file->readMapped(buf, length, offset);
+        if (rval < 0)
+            rval = ::pread(tmp_file->fileDescriptor(), buf, length, offset);
         if (rval < 0){
             fs_out();
             return -errno;
@@ -740,23 +1022,53 @@ int SMTPFileSystem::read(const char *path, char *buf, size_t offset, size_t leng
 int SMTPFileSystem::write(const char *path, const char *buf, size_t offset, size_t length, int *error, SMTPcontext_t *context)
 {
     ssize_t rval = 0;
+    if (isThumbnailPath(path)) {
+        fs_out();
+        return -EROFS;
+    }
+    if (strcmp(path, s_sync_file) == 0) {
+        fs_out();
+        return static_cast<int>(length);
+    }
     if (hasPartialObjectSupport()) {
         const std::string std_path(path);
         rval = m_device.fileWrite(std_path, buf, length, offset);
     } else {
-        const TypeTmpFile *tmp_file = m_tmp_files_pool.getFile(std::string(path));
+        int open_rval;
+        std::shared_ptr<TypeTmpFile> tmp_file = tmpFileGet(path, open_rval);
         if (!tmp_file){
             fs_out();
-            return -EINVAL;
+            return open_rval;
         }
-        int fd = open(tmp_file->pathTmp().c_str(), O_WRONLY);
-        rval = ::pwrite(fd, buf, length, offset);
+        // the rest of the download would overwrite the data
+        std::shared_ptr<ObjectDownload> download = tmp_file->download();
+        if (download) {
+            int wait_rval = download->waitDone();
+            if (wait_rval != 0) {
+                fs_out();
+                return wait_rval;
+            }
+        }
+        // Writing an empty file from its start streams it to the device
+        // right away; its size is announced as unknown.
+        if (offset == 0 && !tmp_file->upload())
+            tmpFileStream(tmp_file.get());
+        // the mapping stays coherent with writes inside it, but not with
+        // the file growing past its end
+        if (!tmp_file->isMappedRange(offset, length))
+            tmp_file->unmap();
+        rval = ::pwrite(tmp_file->fileDescriptor(), buf, length, offset);
         if (rval < 0){
             fs_out();
             return -errno;
         }
 
-        const_cast<TypeTmpFile*>(tmp_file)->setModified();
+        std::shared_ptr<ObjectUpload> upload = tmp_file->upload();
+        if (upload && !upload->write(buf, rval, offset)) {
+            logmsg("Streaming '", path, "' stopped, uploading it when closed.\n");
+            uploadCancel(tmp_file.get());
+        }
+        tmp_file->setModified();
     }
     
     fs_out();
@@ -785,7 +1097,10 @@ const TypeDir* SMTPFileSystem::opendir(const char *path)
 
 int SMTPFileSystem::readdir(const char *path, kfscontents_t *contents, int *error, SMTPcontext_t *context)
 {
-    const TypeDir *content = this->opendir(path);
+    // the thumbnail tree mirrors the real one
+    std::string thumb_path;
+    const bool thumbnails = thumbnailPath(path, thumb_path);
+    const TypeDir *content = this->opendir(thumbnails ? thumb_path.c_str() : path);
     if (content == NULL){
         fs_out();
         return -ENOENT;
@@ -794,29 +1109,50 @@ int SMTPFileSystem::readdir(const char *path, kfscontents_t *contents, int *erro
     // append these or else infinite loop!!!!
     kfscontents_append(contents, ".");
     kfscontents_append(contents, "..");
+    if (m_options.m_thumbnails && std::string(path) == std::string("/"))
+        kfscontents_append(contents, s_thumbnail_dir + 1);
     
-    const std::set<TypeDir> dirs = content->dirs();
-    const std::set<TypeFile> files = content->files();
-
-    for (const TypeDir &d : dirs) {
-        kfscontents_append(contents, d.name().c_str());
-    }
-
-    for (const TypeFile &f : files) {
-        kfscontents_append(contents, f.name().c_str());
-    }
+    content->forEachName([&](const char *name) {
+        kfscontents_append(contents, name);
+    });
     fs_out();
     return 0;
 }
 
 int SMTPFileSystem::truncate(const char *path, off_t new_size)
 {
+    if (isThumbnailPath(path)) {
+        fs_out();
+        return -EROFS;
+    }
+    if (strcmp(path, s_sync_file) == 0) {
+        fs_out();
+        return 0;
+    }
+
+    // an open staged file is truncated in place and uploaded when released
+    if (!hasPartialObjectSupport()) {
+        std::shared_ptr<TypeTmpFile> tmp_file =
+            m_tmp_files_pool.getFile(std::string(path));
+        if (tmp_file) {
+            int rval = tmpFileTruncate(tmp_file.get(), new_size);
+            fs_out();
+            return rval;
+        }
+    }
+
+    // the device changes the length in place, keeping the object id
+    if (m_device.getCapabilities().canEditObjects()) {
+        int rval = m_device.fileTruncate(std::string(path), new_size);
+        fs_out();
+        return rval;
+    }
     const std::string tmp_path = m_tmp_files_pool.makeTmpPath(std::string(path));
     int rval = m_device.filePull(std::string(path), tmp_path);
     if (rval != 0) {
         ::unlink(tmp_path.c_str());
         fs_out();
-        return -rval;
+        return rval;
     }
 
     rval = ::truncate(tmp_path.c_str(), new_size);
@@ -831,7 +1167,7 @@ int SMTPFileSystem::truncate(const char *path, off_t new_size)
     if (rval != 0) {
         ::unlink(tmp_path.c_str());
         fs_out();
-        return -rval;
+        return rval;
     }
 
     rval = m_device.filePush(tmp_path, std::string(path));
@@ -839,13 +1175,140 @@ int SMTPFileSystem::truncate(const char *path, off_t new_size)
 
     if (rval != 0){
         fs_out();
-        return -rval;
+        return rval;
     }
 
     fs_out();
     return 0;
 }
 
+int SMTPFileSystem::tmpFileTruncate(TypeTmpFile *tmp_file, off_t new_size)
+{
+    std::shared_ptr<ObjectDownload> download = tmp_file->download();
+    if (download) {
+        int rval = download->waitDone();
+        if (rval != 0)
+            return rval;
+    }
+
+    struct stat file_stat;
+    if (::fstat(tmp_file->fileDescriptor(), &file_stat) != 0)
+        return -errno;
+    uploadCancel(tmp_file);
+    tmp_file->unmap();
+    if (::ftruncate(tmp_file->fileDescriptor(), new_size) != 0)
+        return -errno;
+    tmp_file->setModified();
+
+    // Copying tools size an empty file before writing it. Knowing the final
+    // size, the device can take the data as it arrives instead of after the
+    // file is closed.
+    if (file_stat.st_size == 0 && new_size > 0) {
+        std::shared_ptr<ObjectUpload> upload = std::make_shared<ObjectUpload>(
+            tmp_file->pathDevice(), static_cast<uint64_t>(new_size));
+        tmp_file->setUpload(upload);
+        m_device.filePushAsync(upload);
+    }
+    return 0;
+}
+
+void SMTPFileSystem::tmpFileStream(TypeTmpFile *tmp_file)
+{
+    struct stat file_stat;
+    if (tmp_file->download() || !m_device.canStreamUnsized() ||
+        ::fstat(tmp_file->fileDescriptor(), &file_stat) != 0 ||
+        file_stat.st_size != 0)
+        return;
+
+    // a device refusing it stops the stream, the file is uploaded on release
+    std::shared_ptr<ObjectUpload> upload = std::make_shared<ObjectUpload>(
+        tmp_file->pathDevice());
+    tmp_file->setUpload(upload);
+    m_device.filePushAsync(upload);
+}
+
+void SMTPFileSystem::uploadCancel(TypeTmpFile *tmp_file)
+{
+    std::shared_ptr<ObjectUpload> upload = tmp_file->upload();
+    if (!upload)
+        return;
+
+    upload->cancel();
+    upload->wait();
+    tmp_file->setUpload(nullptr);
+}
+
+bool SMTPFileSystem::thumbnailPath(const char *path, std::string &file_path) const
+{
+    if (!m_options.m_thumbnails)
+        return false;
+
+    const size_t len = strlen(s_thumbnail_dir);
+    if (strncmp(path, s_thumbnail_dir, len) != 0 ||
+        (path[len] != '\0' && path[len] != '/'))
+        return false;
+
+    file_path = path[len] ? std::string(path + len) : std::string("/");
+    return true;
+}
+
+bool SMTPFileSystem::isThumbnailPath(const char *path) const
+{
+    std::string file_path;
+    return thumbnailPath(path, file_path);
+}
+
+int SMTPFileSystem::thumbnailGetattr(const std::string &file_path, kfsstat_t *result)
+{
+    if (file_path == std::string("/")) {
+        result->mode = (kfsmode_t)(0555);
+        result->type = KFS_DIR;
+        return 0;
+    }
+
+    const TypeDir *content = m_device.dirFetchContent(smtpfs_dirname(file_path));
+    if (!content)
+        return -ENOENT;
+
+    const std::string name(smtpfs_basename(file_path));
+    const TypeDir *dir = content->dir(name);
+    if (dir) {
+        result->type = KFS_DIR;
+        result->mode = (kfsmode_t)(S_IFDIR | 0555);
+        result->mtime.nsec = dir->modificationDate();
+        return 0;
+    }
+
+    std::unique_ptr<const TypeFile> file = content->file(name);
+    ThumbnailCache::Data thumb;
+    if (!file || m_device.fileThumbnail(file_path, thumb) != 0)
+        return -ENOENT;
+
+    result->size = thumb->size();
+    result->mode = (kfsmode_t)(0444);
+    result->type = KFS_REG;
+    result->mtime.nsec = file->modificationDate();
+    result->atime = result->mtime;
+    result->ctime = result->mtime;
+    result->used = (thumb->size() / 512) + (thumb->size() % 512 > 0 ? 1 : 0);
+    return 0;
+}
+
+int SMTPFileSystem::thumbnailRead(const std::string &file_path, char *buf, size_t offset, size_t length)
+{
+    ThumbnailCache::Data thumb;
+    int rval = m_device.fileThumbnail(file_path, thumb);
+    if (rval != 0)
+        return rval;
+
+    if (offset >= thumb->size())
+        return 0;
+    if (offset + length > thumb->size())
+        length = thumb->size() - offset;
+    memcpy(buf, thumb->data() + offset, length);
+    return static_cast<int>(length);
+}
+
 bool SMTPFileSystem::hasPartialObjectSupport()
 {
     MTPDevice::Capabilities caps = m_device.getCapabilities();
@@ -52,6 +52,10 @@ private:
         int m_verbose;
         int m_enable_move;
         int m_list_devices;
+        int m_prefetch;
+        int m_snapshot;
+        int m_thumbnails;
+        int m_content_cache;
         int m_device_no;
         char *m_device_file;
         char *m_mount_point;
@@ -106,11 +110,23 @@ public:
     int create(const char *path, int *error, SMTPcontext_t *context);
     int remove(const char *path, int *error, SMTPcontext_t *context);
     int fsync(const char *path, int *error, SMTPcontext_t *context);
-    int open(const char *path, int flags);
     int truncate(const char *path, off_t new_size);
 
 private:
     bool hasPartialObjectSupport();
+    int open(const char *path, int flags, std::shared_ptr<TypeTmpFile> &tmp_file);
+    std::shared_ptr<TypeTmpFile> tmpFileGet(const char *path, int &rval);
+    void tmpFileRelease(const std::shared_ptr<TypeTmpFile> &tmp_file);
+    void tmpFileDiscard(const std::shared_ptr<TypeTmpFile> &tmp_file);
+    int renameStaged(const char *path, const char *newpath);
+    int moveFile(const char *path, const char *newpath);
+    int tmpFileTruncate(TypeTmpFile *tmp_file, off_t new_size);
+    void tmpFileStream(TypeTmpFile *tmp_file);
+    void uploadCancel(TypeTmpFile *tmp_file);
+    bool thumbnailPath(const char *path, std::string &file_path) const;
+    bool isThumbnailPath(const char *path) const;
+    int thumbnailGetattr(const std::string &file_path, kfsstat_t *result);
+    int thumbnailRead(const std::string &file_path, char *buf, size_t offset, size_t length);
 
     kfsfilesystem_t m_kfs_filesystem;
     kfsid_t m_kfs_id;
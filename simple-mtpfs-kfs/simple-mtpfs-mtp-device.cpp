@@ -29,10 +29,13 @@ extern "C" {
 #  include <sys/stat.h>
 }
 
+#include "simple-mtpfs-epoch.h"
 #include "simple-mtpfs-kfs.h"
 #include "simple-mtpfs-libmtp.h"
 #include "simple-mtpfs-log.h"
 #include "simple-mtpfs-mtp-device.h"
+#include "simple-mtpfs-name-pool.h"
+#include "simple-mtpfs-snapshot.h"
 #include "simple-mtpfs-util.h"
 
 uint32_t MTPDevice::s_root_node = ~0;
@@ -41,11 +44,85 @@ MTPDevice::MTPDevice():
     m_device(nullptr),
     m_capabilities(),
     m_device_mutex(),
-    m_root_dir()
+    m_device_waiters(0),
+    m_object_index(),
+    m_root_dir(),
+    m_root_prefix(),
+    m_path_cache(),
+    m_path_cache_mutex(),
+    m_path_cache_generation(0),
+    m_path_cache_removals(0),
+    m_negative_lru(),
+    m_negative_cache(),
+    m_negative_mutex(),
+    m_fetch_mutex(),
+    m_fetch_cv(),
+    m_fetching(),
+    m_prefetch_subtree(0),
+    m_prefetch_subtrees(true),
+    m_prefetch_held(),
+    m_prefetch_thread(),
+    m_prefetch_stop(false),
+    m_event_mutex(),
+    m_events(),
+    m_event_thread(),
+    m_event_stop(false),
+    m_event_pending(false),
+    m_event_error(false),
+    m_events_deferred(),
+    m_read_ahead(),
+    m_block_cache(),
+    m_thumbnail_cache(),
+    m_content_cache(),
+    m_write_back(),
+    m_edit_sessions(),
+    m_download_mutex(),
+    m_download_cv(),
+    m_downloads(),
+    m_download_current(),
+    m_download_thread(),
+    m_download_stop(false),
+    m_upload_mutex(),
+    m_upload_cv(),
+    m_uploads(),
+    m_upload_current(),
+    m_upload_thread(),
+    m_upload_stop(false),
+    m_upload_unsized(true),
+    m_push_mutex(),
+    m_push_cv(),
+    m_pushes(),
+    m_push_current(),
+    m_push_thread(),
+    m_push_stop(false),
+    m_push_error(0),
+    m_read_mutex(),
+    m_read_cv(),
+    m_reads(),
+    m_snapshot(false),
+    m_serial()
 {
     StreamHelper::off();
     LIBMTP_Init();
     StreamHelper::on();
+
+    // Storage directories all share the root node id; their index entries
+    // are never looked up, see dirFind().
+    m_root_dir.setIndex(&m_object_index);
+    m_read_ahead.setFetchFunc([this](uint32_t storage_id, uint32_t id,
+        uint64_t file_size, uint64_t offset, uint32_t size, unsigned char *buf) {
+        return objectRead(storage_id, id, file_size, offset, size, buf);
+    });
+    m_write_back.setFlushFunc([this](uint32_t id, uint64_t offset,
+        const unsigned char *data, uint32_t size) {
+        return objectWrite(id, offset, data, size);
+    });
+    m_edit_sessions.setBeginFunc([this](uint32_t id) {
+        return objectEditBegin(id);
+    });
+    m_edit_sessions.setEndFunc([this](uint32_t id) {
+        return objectEditEnd(id);
+    });
 }
 
 MTPDevice::~MTPDevice()
@@ -205,11 +282,47 @@ void MTPDevice::disconnect()
     if (!m_device)
         return;
 
+    eventStop();
+    prefetchStop();
+    downloadStop();
+    uploadStop();
+    pushStop();
+    if (m_write_back.stop() != 0)
+        logerr("Could not write back buffered data.\n");
+    if (m_edit_sessions.stop() != 0)
+        logerr("Could not end edit sessions.\n");
+    m_read_ahead.stop();
+    snapshotSave();
+    logMemoryUsage();
+    if (m_block_cache.hits() || m_block_cache.misses()) {
+        logmsg("Block cache: ", m_block_cache.hits(), " hits, ",
+            m_block_cache.misses(), " misses.\n");
+    }
+    m_block_cache.clear();
+    m_thumbnail_cache.clear();
+    m_content_cache.close();
     LIBMTP_Release_Device(m_device);
     m_device = nullptr;
     logmsg("Disconnected.\n");
 }
 
+void MTPDevice::memoryUsage(size_t &objects, size_t &bytes) const
+{
+    objects = 0;
+    bytes = sizeof(m_root_dir) + NamePool::memoryUsage();
+    m_root_dir.memoryUsage(objects, bytes);
+}
+
+void MTPDevice::logMemoryUsage() const
+{
+    size_t objects, bytes;
+    memoryUsage(objects, bytes);
+    if (objects == 0)
+        return;
+    logmsg("Metadata of ", objects, " objects takes ", bytes, " bytes, ",
+        bytes / objects, " per object.\n");
+}
+
 uint64_t MTPDevice::storageTotalSize() const
 {
     uint64_t total = 0;
@@ -242,61 +355,73 @@ bool MTPDevice::enumStorages()
     return true;
 }
 
-const TypeDir *MTPDevice::dirFetchContent(std::string path)
+bool MTPDevice::dirClaim(TypeDir *dir, bool wait_prefetch)
 {
-    if (!m_root_dir.isFetched()) {
-        for (LIBMTP_devicestorage_t *s = m_device->storage; s; s = s->next) {
-            m_root_dir.addDir(TypeDir(s_root_node, 0, s->id,
-                std::string(s->StorageDescription)));
-            m_root_dir.setFetched();
-        }
-    }
+    // Another thread may already be listing this directory, either on its
+    // own or as a part of the subtree the prefetch is scanning. Wait for it
+    // instead of asking the device for the same content again.
+    std::unique_lock<std::mutex> lock(m_fetch_mutex);
+    m_fetch_cv.wait(lock, [&]() {
+        return dir->isFetched() || (m_fetching.count(dir) == 0 &&
+            (!wait_prefetch || !dirBelow(dir, m_prefetch_subtree)));
+    });
+    if (dir->isFetched())
+        return false;
+    m_fetching.insert(dir);
+    return true;
+}
 
-    if (m_root_dir.dirCount() == 1)
-        path = '/' + m_root_dir.dirs().begin()->name() + path;
+bool MTPDevice::dirBelow(const TypeDir *dir, uint32_t top_id)
+{
+    if (top_id == 0)
+        return false;
 
-    if (path == "/")
-        return &m_root_dir;
-    
-//    SMTPCacheEntry *entry = m_cache.getEntry(path);
-//    if(entry){
-//        return (TypeDir*)entry->object;
-//    }
-
-    std::string member;
-    std::istringstream ss(path);
-    TypeDir *dir = &m_root_dir;
-    while (std::getline(ss, member, '/')) {
-        if (member.empty())
-            continue;
+    uint32_t id = dir->id();
+    while (id != top_id) {
+        bool is_dir = false;
+        const TypeDir *parent = m_object_index.parent(id, is_dir);
+        if (!parent || parent->storageid() != dir->storageid() ||
+            parent->id() == s_root_node)
+            return false;
+        id = parent->id();
+    }
+    return true;
+}
 
-        const TypeDir *tmp = dir->dir(member);
-        if (!tmp && !dir->isFetched()) {
-            criticalEnter();
-            LIBMTP_file_t *content =
-                    LIBMTP_Get_Files_And_Folders(m_device, dir->storageid(), dir->id());
-            criticalLeave();
-            for (LIBMTP_file_t *f = content; f; f = f->next) {
-                if (f->filetype == LIBMTP_FILETYPE_FOLDER)
-                    dir->addDir(TypeDir(f));
-                else
-                    dir->addFile(TypeFile(f));
-            }
-            LIBMTP_Free_Files_And_Folders(&content);
-            dir->setFetched();
-            tmp = dir->dir(member);
-        }
+void MTPDevice::dirRelease(TypeDir *dir)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_fetch_mutex);
+        m_fetching.erase(dir);
+        dir->setFetched();
+    }
+    m_fetch_cv.notify_all();
+}
+
+void MTPDevice::rootFetch()
+{
+    if (m_root_dir.isFetched())
+        return;
 
-        if (!tmp)
-            return nullptr;
-        dir = const_cast<TypeDir*>(tmp);
+    for (LIBMTP_devicestorage_t *s = m_device->storage; s; s = s->next) {
+        m_root_dir.addDir(TypeDir(s_root_node, 0, s->id,
+            std::string(s->StorageDescription)));
+        m_root_dir.setFetched();
     }
+    if (m_root_dir.dirCount() == 1)
+        m_root_prefix = '/' + std::string(m_device->storage->StorageDescription);
+}
 
-    if (dir->isFetched())
-        return dir;
+void MTPDevice::dirFetch(TypeDir *dir)
+{
+    if (!dirClaim(dir, true))
+        return;
+    if (dir->isStale()) {
+        dirRevalidate(dir);
+        return;
+    }
 
     criticalEnter();
-    dir->setFetched();
     LIBMTP_file_t *content = LIBMTP_Get_Files_And_Folders(
         m_device, dir->storageid(), dir->id());
     criticalLeave();
@@ -307,244 +432,1543 @@ const TypeDir *MTPDevice::dirFetchContent(std::string path)
             dir->addFile(TypeFile(f));
     }
     LIBMTP_Free_Files_And_Folders(&content);
-    return dir;
+    dirRelease(dir);
 }
 
-int MTPDevice::dirCreateNew(const std::string &path)
+void MTPDevice::dirRevalidate(TypeDir *dir)
 {
-    const std::string tmp_basename(smtpfs_basename(path));
-    const std::string tmp_dirname(smtpfs_dirname(path));
-    const TypeDir *dir_parent = dirFetchContent(tmp_dirname);
-    if (!dir_parent || dir_parent->id() == 0) {
-        logerr("Can not remove directory '", path, "'.\n");
-        return -EINVAL;
-    }
-    char *c_name = strdup(tmp_basename.c_str());
+    // The content comes from a snapshot. If the device can describe the
+    // whole directory in one request, compare the metadata of every object.
+    // Otherwise compare the object handles the device reports and ask for
+    // metadata of new objects only; objects changed in place are then left
+    // to the prefetch.
+    LIBMTP_file_t *content = nullptr;
     criticalEnter();
-    uint32_t new_id = LIBMTP_Create_Folder(m_device, c_name,
-        dir_parent->id(), dir_parent->storageid());
-    criticalLeave();
-    if (new_id == 0) {
-        logerr("Could not create directory '", path, "'.\n");
-        LIBMTP_Dump_Errorstack(m_device);
+    int rval = LIBMTP_Get_Folder_Contents(m_device, dir->storageid(), dir->id(),
+        &content);
+    if (rval != 0)
         LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+
+    std::unordered_map<uint32_t, std::pair<std::string, time_t>> known_dirs;
+    std::unordered_map<uint32_t, TypeFile> known_files;
+    dir->forEachDir([&](const TypeDir &d) {
+        known_dirs.emplace(d.id(), std::make_pair(d.name(), d.modificationDate()));
+    });
+    dir->forEachFile([&](const TypeFile &f) { known_files.emplace(f.id(), f); });
+
+    std::unordered_set<uint32_t> ids;
+    if (rval == 0) {
+        for (LIBMTP_file_t *f = content; f; f = f->next)
+            ids.insert(f->item_id);
     } else {
-        const_cast<TypeDir*>(dir_parent)->addDir(TypeDir(new_id, dir_parent->id(),
-            dir_parent->storageid(), tmp_basename));
-        logmsg("Directory '", path, "' created.\n");
+        uint32_t *handles = nullptr;
+        uint32_t count = 0;
+        criticalEnter();
+        rval = LIBMTP_Get_Object_Handles(m_device, dir->storageid(), dir->id(),
+            &handles, &count);
+        if (rval != 0)
+            LIBMTP_Clear_Errorstack(m_device);
+        criticalLeave();
+        if (rval != 0) {
+            // Better show the snapshot content than nothing.
+            dir->setStale(false);
+            dirRelease(dir);
+            return;
+        }
+
+        ids.insert(handles, handles + count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (known_dirs.count(handles[i]) || known_files.count(handles[i]))
+                continue;
+            criticalEnter();
+            LIBMTP_file_t *f = LIBMTP_Get_Filemetadata(m_device, handles[i]);
+            if (!f)
+                LIBMTP_Clear_Errorstack(m_device);
+            criticalLeave();
+            if (!f)
+                continue;
+            f->next = content;
+            content = f;
+        }
+        free(handles);
     }
-    free(static_cast<void*>(c_name));
-    return new_id != 0 ? 0 : -EINVAL;
-}
 
-int MTPDevice::dirRemove(const std::string &path)
-{
-    const std::string tmp_basename(smtpfs_basename(path));
-    const std::string tmp_dirname(smtpfs_dirname(path));
-    const TypeDir *dir_parent = dirFetchContent(tmp_dirname);
-    const TypeDir *dir_to_remove = dir_parent ? dir_parent->dir(tmp_basename) : nullptr;
-    if (!dir_parent || !dir_to_remove || dir_parent->id() == 0) {
-        logerr("No such directory '", path, "' to remove.\n");
-        return -ENOENT;
+    // Removed directories may still be referenced by the prefetch worker;
+    // they are dropped after the directory is released.
+    const bool dirs_gone = dirPrune(dir, ids, false);
+    std::vector<LIBMTP_file_t*> deferred;
+    for (LIBMTP_file_t *f = content; f; f = f->next) {
+        if (f->filetype == LIBMTP_FILETYPE_FOLDER) {
+            auto it = known_dirs.find(f->item_id);
+            if (it != known_dirs.end()) {
+                const std::string &name = it->second.first;
+                if (name != f->filename)
+                    dir->renameDir(name, f->filename);
+                const TypeDir *d = dir->dir(f->filename);
+                if (d && d->id() == f->item_id)
+                    const_cast<TypeDir*>(d)->setModificationDate(f->modificationdate);
+                continue;
+            }
+        } else {
+            auto it = known_files.find(f->item_id);
+            if (it != known_files.end()) {
+                const TypeFile &file = it->second;
+                if (file.name() == f->filename) {
+                    if (file.size() != f->filesize ||
+                        file.modificationDate() != f->modificationdate)
+                        dir->replaceFile(file, TypeFile(f));
+                    continue;
+                }
+                dir->removeFile(file);
+            }
+        }
+        if (dir->dir(f->filename) || dir->file(f->filename)) {
+            deferred.push_back(f);
+            continue;
+        }
+        if (f->filetype == LIBMTP_FILETYPE_FOLDER)
+            dir->addDir(TypeDir(f));
+        else
+            dir->addFile(TypeFile(f));
     }
-    if (!dir_to_remove->isEmpty())
-        return -ENOTEMPTY;
-    criticalEnter();
-    int rval = LIBMTP_Delete_Object(m_device, dir_to_remove->id());
-    criticalLeave();
-    if (rval != 0){
-        logerr("Could not remove the directory '", path, "'.\n");
-        LIBMTP_Dump_Errorstack(m_device);
-        LIBMTP_Clear_Errorstack(m_device);
-        return -EINVAL;
+    dir->setStale(false);
+    dirRelease(dir);
+
+    if (dirs_gone) {
+        prefetchWait(dir->storageid());
+        dirPrune(dir, ids, true);
     }
-    const_cast<TypeDir*>(dir_parent)->removeDir(*dir_to_remove);
-    logmsg("Folder '", path, "' removed.\n");
-    return 0;
+    for (LIBMTP_file_t *f : deferred) {
+        negativeRemove(dir, f->filename);
+        if (f->filetype == LIBMTP_FILETYPE_FOLDER)
+            dir->addDir(TypeDir(f));
+        else
+            dir->addFile(TypeFile(f));
+    }
+    LIBMTP_Free_Files_And_Folders(&content);
 }
 
-int MTPDevice::dirRename(const std::string &oldpath, const std::string &newpath)
+void MTPDevice::dirMerge(TypeDir *dir, const std::vector<LIBMTP_file_t*> &entries)
 {
-    const std::string tmp_old_basename(smtpfs_basename(oldpath));
-    const std::string tmp_old_dirname(smtpfs_dirname(oldpath));
-    const std::string tmp_new_basename(smtpfs_basename(newpath));
-    const std::string tmp_new_dirname(smtpfs_dirname(newpath));
-    const TypeDir *dir_parent = dirFetchContent(tmp_old_dirname);
-    const TypeDir *dir_to_rename = dir_parent ? dir_parent->dir(tmp_old_basename) : nullptr;
-    if (!dir_parent || !dir_to_rename || dir_parent->id() == 0) {
-        logerr("Can not rename '", tmp_old_basename, "' to '",
-            tmp_new_basename, "'.\n");
-        return -EINVAL;
-    }
-    if (tmp_old_dirname != tmp_new_dirname) {
-        logerr("Can not move '", oldpath, "' to '", newpath, "'.\n");
-        return -EINVAL;
+    // Bring a directory restored from a snapshot up to date with a fresh
+    // listing, keeping the nodes of subdirectories which are still there.
+    std::unordered_set<uint32_t> ids;
+    for (LIBMTP_file_t *f : entries)
+        ids.insert(f->item_id);
+    dirPrune(dir, ids, true);
+
+    for (LIBMTP_file_t *f : entries) {
+        if (f->filetype == LIBMTP_FILETYPE_FOLDER) {
+            const TypeDir *d = dir->dir(f->filename);
+            if (d)
+                const_cast<TypeDir*>(d)->setModificationDate(f->modificationdate);
+            else
+                dir->addDir(TypeDir(f));
+        } else {
+            std::unique_ptr<const TypeFile> file = dir->file(f->filename);
+            if (file)
+                dir->replaceFile(*file, TypeFile(f));
+            else
+                dir->addFile(TypeFile(f));
+        }
     }
+    dir->setStale(false);
+}
 
-    LIBMTP_folder_t *folder = dir_to_rename->toLIBMTPFolder();
-    criticalEnter();
-    int ret = LIBMTP_Set_Folder_Name(m_device, folder, tmp_new_basename.c_str());
-    criticalLeave();
-    free(static_cast<void*>(folder->name));
-    free(static_cast<void*>(folder));
-    if (ret != 0) {
-        logerr("Could not rename '", oldpath, "' to '",  tmp_new_basename, "'.\n");
-        LIBMTP_Dump_Errorstack(m_device);
-        LIBMTP_Clear_Errorstack(m_device);
-        return -EINVAL;
-    }
-    const_cast<TypeDir*>(dir_to_rename)->setName(tmp_new_basename);
-    logmsg("Directory '", oldpath, "' renamed to '", tmp_new_basename, "'.\n");
-    return 0;
+bool MTPDevice::dirPrune(TypeDir *dir, const std::unordered_set<uint32_t> &ids,
+    bool prune_dirs)
+{
+    std::vector<TypeDir> gone_dirs;
+    std::vector<TypeFile> gone_files;
+    // a storage shown within the mounted one is not a part of its listing
+    dir->forEachDir([&](const TypeDir &d) {
+        if (!ids.count(d.id()) && d.storageid() == dir->storageid())
+            gone_dirs.push_back(TypeDir(d.id(), d.parentid(), d.storageid(), d.name()));
+    });
+    dir->forEachFile([&](const TypeFile &f) {
+        if (!ids.count(f.id()))
+            gone_files.push_back(f);
+    });
+
+    for (const TypeFile &f : gone_files)
+        dir->removeFile(f);
+    if (!prune_dirs || gone_dirs.empty())
+        return !gone_dirs.empty();
+
+    pathCacheClear();
+    for (const TypeDir &d : gone_dirs)
+        dir->removeDir(d);
+    pathCacheResume();
+    return true;
 }
 
-int MTPDevice::rename(const std::string &oldpath, const std::string &newpath)
+void MTPDevice::prefetchStart()
 {
-#ifndef SMTPFS_MOVE_BY_SET_OBJECT_PROPERTY
-    const std::string tmp_old_basename(smtpfs_basename(oldpath));
-    const std::string tmp_old_dirname(smtpfs_dirname(oldpath));
-    const std::string tmp_new_dirname(smtpfs_dirname(newpath));
-    if (tmp_old_dirname != tmp_new_dirname)
-        return -EINVAL;
+    if (!m_device || m_prefetch_thread.joinable())
+        return;
 
-    const TypeDir *dir_parent = dirFetchContent(tmp_old_dirname);
-    if (!dir_parent || dir_parent->id() == 0)
-        return -EINVAL;
-    const TypeDir *dir_to_rename = dir_parent->dir(tmp_old_basename);
-    if (dir_to_rename)
-        return dirRename(oldpath, newpath);
-    else
-        return fileRename(oldpath, newpath);
-#else
-    const std::string tmp_old_basename(smtpfs_basename(oldpath));
-    const std::string tmp_old_dirname(smtpfs_dirname(oldpath));
-    const std::string tmp_new_basename(smtpfs_basename(newpath));
-    const std::string tmp_new_dirname(smtpfs_dirname(newpath));
-    const TypeDir *dir_old_parent = dirFetchContent(tmp_old_dirname);
-    const TypeDir *dir_new_parent = dirFetchContent(tmp_new_dirname);
-    const TypeDir *dir_to_rename = dir_old_parent ? dir_old_parent->dir(tmp_old_basename) : nullptr;
-    const TypeFile *file_to_rename = dir_old_parent ? dir_old_parent->file(tmp_old_basename) : nullptr;
+    // Populate the storage list up front, so the worker and the foreground
+    // do not race on it.
+    rootFetch();
 
-    logdebug("dir_to_rename:    ", dir_to_rename, "\n");
-    logdebug("file_to_rename:   ", file_to_rename, "\n");
+    {
+        std::lock_guard<std::mutex> lock(m_fetch_mutex);
+        m_root_dir.forEachDir([&](const TypeDir &d) {
+            m_prefetch_held.insert(d.storageid());
+        });
+    }
+    m_prefetch_stop = false;
+    m_prefetch_thread = std::thread(&MTPDevice::prefetchWorker, this);
+}
 
-    if (!dir_old_parent || !dir_new_parent || dir_old_parent->id() == 0)
-        return -EINVAL;
+void MTPDevice::prefetchStop()
+{
+    if (!m_prefetch_thread.joinable())
+        return;
 
-    const TypeBasic *object_to_rename =  dir_to_rename ?
-        static_cast<const TypeBasic*>(dir_to_rename) :
-        static_cast<const TypeBasic*>(file_to_rename);
+    m_prefetch_stop = true;
+    m_prefetch_thread.join();
+}
 
-    logdebug("object_to_rename: ", object_to_rename, "\n");
-    logdebug("object_to_rename->id(): ", object_to_rename->id(), "\n");
+void MTPDevice::prefetchWait(uint32_t storage_id)
+{
+    if (std::this_thread::get_id() == m_prefetch_thread.get_id())
+        return;
 
-    if (!object_to_rename) {
-        logerr("No such file or directory to rename/move!\n");
-        return -ENOENT;
-    }
+    std::unique_lock<std::mutex> lock(m_fetch_mutex);
+    m_fetch_cv.wait(lock, [&]() { return m_prefetch_held.count(storage_id) == 0; });
+}
 
-    if (tmp_old_dirname != tmp_new_dirname) {
-        criticalEnter();
-        int rval = LIBMTP_Set_Object_u32(m_device, object_to_rename->id(),
-            LIBMTP_PROPERTY_ParentObject, dir_new_parent->id());
-        criticalLeave();
-        if (rval != 0) {
-            logerr("Could not move '", oldpath, "' to '", newpath, "'.\n");
-            LIBMTP_Dump_Errorstack(m_device);
-            LIBMTP_Clear_Errorstack(m_device);
-            return -EINVAL;
+void MTPDevice::prefetchWorker()
+{
+    logmsg("Metadata prefetch started.\n");
+
+    std::vector<TypeDir*> storages;
+    m_root_dir.forEachDir([&](const TypeDir &d) {
+        storages.push_back(const_cast<TypeDir*>(&d));
+    });
+    m_prefetch_subtrees = true;
+    for (TypeDir *storage_dir : storages) {
+        if (m_prefetch_stop)
+            break;
+        {
+            // Storages are held, so their directories stay in place; what
+            // is removed below them is reclaimed after each storage.
+            Epoch::Section section;
+            prefetchStorage(storage_dir);
         }
-        const_cast<TypeBasic*>(object_to_rename)->setParent(dir_new_parent->id());
-    }
-    if (tmp_old_basename != tmp_new_basename) {
-        criticalEnter();
-        int rval = LIBMTP_Set_Object_String(m_device, object_to_rename->id(),
-            LIBMTP_PROPERTY_Name, tmp_new_basename.c_str());
-        criticalLeave();
-        if (rval != 0) {
-            logerr("Could not rename '", oldpath, "' to '", newpath, "'.\n");
-            LIBMTP_Dump_Errorstack(m_device);
-            LIBMTP_Clear_Errorstack(m_device);
-            return -EINVAL;
+        {
+            std::lock_guard<std::mutex> lock(m_fetch_mutex);
+            m_prefetch_held.erase(storage_dir->storageid());
         }
+        m_fetch_cv.notify_all();
     }
-    return 0;
-#endif
-}
 
-int MTPDevice::fileRead(const std::string &path, char *buf, size_t size,
-    off_t offset)
-{
-    const std::string path_basename(smtpfs_basename(path));
-    const std::string path_dirname(smtpfs_dirname(path));
-    const TypeDir *dir_parent = dirFetchContent(path_dirname);
-    const TypeFile *file_to_fetch = dir_parent ?
-        dir_parent->file(path_basename) : nullptr;
-    long real_size = size;
-    if (!dir_parent) {
-        logerr("Can not fetch '", path, "'.\n");
-        return -EINVAL;
-    }
-    if (!file_to_fetch) {
-        logerr("No such file '", path, "'.\n");
-        return -ENOENT;
-    }
-    // handling read past EOF 
-    if (offset >= file_to_fetch->size()) {
-      printf("Skipping read with offset past EOF\n");
-    }
-    else if (offset + size > file_to_fetch->size()) {
-      printf("Reducing bytes_requested to avoid reading past EOF\n");
-      real_size = file_to_fetch->size() - offset;
+    {
+        std::lock_guard<std::mutex> lock(m_fetch_mutex);
+        m_prefetch_held.clear();
     }
+    m_fetch_cv.notify_all();
+    logmsg("Metadata prefetch ", m_prefetch_stop ? "stopped" : "finished", ".\n");
 
-    // all systems clear
-    unsigned char *tmp_buf;
-    unsigned int tmp_size;
-    int rval = LIBMTP_GetPartialObject(m_device, file_to_fetch->id(),
-        offset, real_size, &tmp_buf, &tmp_size);
-    if (tmp_size > 0) {
-        memcpy(buf, tmp_buf, tmp_size);
-        free(tmp_buf);
+    if (!m_prefetch_stop) {
+        Epoch::Section section;
+        logMemoryUsage();
+        snapshotSave();
     }
+}
 
-    if (rval != 0)
-        return -EIO;
-    return tmp_size;
+bool MTPDevice::serialFetch()
+{
+    if (!m_serial.empty())
+        return true;
+
+    criticalEnter();
+    char *serial = LIBMTP_Get_Serialnumber(m_device);
+    if (!serial)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    if (serial)
+        m_serial = serial;
+    free(serial);
+    return !m_serial.empty();
 }
 
-int MTPDevice::fileWrite(const std::string &path, const char *buf, size_t size,
-    off_t offset)
+void MTPDevice::snapshotLoad()
 {
-    const std::string path_basename(smtpfs_basename(path));
-    const std::string path_dirname(smtpfs_dirname(path));
-    const TypeDir *dir_parent = dirFetchContent(path_dirname);
-    const TypeFile *file_to_fetch = dir_parent ?
-        dir_parent->file(path_basename) : nullptr;
-    if (!dir_parent) {
+    if (!m_device)
+        return;
+
+    if (!serialFetch()) {
+        logerr("Device has no serial number, metadata snapshots disabled.\n");
+        return;
+    }
+    m_snapshot = true;
+
+    rootFetch();
+    std::vector<TypeDir*> storages;
+    m_root_dir.forEachDir([&](const TypeDir &d) {
+        storages.push_back(const_cast<TypeDir*>(&d));
+    });
+    for (TypeDir *storage_dir : storages) {
+        MetadataSnapshot::load(
+            MetadataSnapshot::makePath(m_serial, storage_dir->storageid()),
+            *storage_dir);
+    }
+}
+
+void MTPDevice::contentCacheOpen()
+{
+    if (!m_device)
+        return;
+
+    if (!serialFetch()) {
+        logerr("Device has no serial number, content cache disabled.\n");
+        return;
+    }
+    if (!m_content_cache.open(m_serial))
+        logerr("Can not open the content cache.\n");
+}
+
+void MTPDevice::snapshotSave()
+{
+    if (!m_snapshot)
+        return;
+
+    std::vector<const TypeDir*> storages;
+    m_root_dir.forEachDir([&](const TypeDir &d) { storages.push_back(&d); });
+    for (const TypeDir *storage_dir : storages) {
+        if (!storage_dir->isFetched() && !storage_dir->isStale())
+            continue;
+        MetadataSnapshot::save(
+            MetadataSnapshot::makePath(m_serial, storage_dir->storageid()),
+            *storage_dir);
+    }
+}
+
+void MTPDevice::prefetchStorage(TypeDir *storage_dir)
+{
+    // The device is taken for one subtree at a time, so that foreground
+    // requests get their turn in between; a lookup waits only for the
+    // subtree being scanned when it is in there.
+    dirFetch(storage_dir);
+    std::vector<TypeDir*> subtrees;
+    storage_dir->forEachDir([&](const TypeDir &d) {
+        if (d.storageid() == storage_dir->storageid())
+            subtrees.push_back(const_cast<TypeDir*>(&d));
+    });
+    for (TypeDir *dir : subtrees) {
+        if (m_prefetch_stop)
+            break;
+        if (!m_prefetch_subtrees || !prefetchSubtree(dir))
+            prefetchWalk(dir);
+    }
+}
+
+bool MTPDevice::prefetchSubtree(TypeDir *dir)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_fetch_mutex);
+        m_prefetch_subtree = dir->id();
+    }
+
+    LIBMTP_file_t *content = nullptr;
+    criticalEnter();
+    int rval = LIBMTP_Get_Subtree_Files_And_Folders(m_device,
+        dir->storageid(), dir->id(), &content);
+    if (rval != 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+
+    if (rval == 0) {
+        PrefetchChildren children;
+        bool deep = false;
+        bool folders = false;
+        for (LIBMTP_file_t *f = content; f; f = f->next) {
+            children[f->parent_id].push_back(f);
+            deep = deep || f->parent_id != dir->id();
+            folders = folders || f->filetype == LIBMTP_FILETYPE_FOLDER;
+        }
+        // A device ignoring the depth reports the children only; their
+        // folders would look empty.
+        if (folders && !deep)
+            rval = -1;
+        else
+            prefetchFill(dir, dir->id(), children);
+    }
+    LIBMTP_Free_Files_And_Folders(&content);
+    if (rval != 0) {
+        logmsg("Device can not list subtrees, listing directories one by one.\n");
+        m_prefetch_subtrees = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_fetch_mutex);
+        m_prefetch_subtree = 0;
+    }
+    m_fetch_cv.notify_all();
+    return rval == 0;
+}
+
+void MTPDevice::prefetchFill(TypeDir *top, uint32_t top_id, PrefetchChildren &children)
+{
+    // Fill the tree top-down, so that foreground lookups waiting for
+    // a directory can go on as soon as its level is reached.
+    std::vector<std::pair<TypeDir*, uint32_t>> queue;
+    queue.emplace_back(top, top_id);
+    for (size_t i = 0; i < queue.size() && !m_prefetch_stop; ++i) {
+        TypeDir *dir = queue[i].first;
+        const std::vector<LIBMTP_file_t*> &entries = children[queue[i].second];
+        if (dirClaim(dir, false)) {
+            if (dir->isStale()) {
+                dirMerge(dir, entries);
+            } else {
+                for (LIBMTP_file_t *f : entries) {
+                    if (f->filetype == LIBMTP_FILETYPE_FOLDER)
+                        dir->addDir(TypeDir(f));
+                    else
+                        dir->addFile(TypeFile(f));
+                }
+            }
+            dirRelease(dir);
+        }
+        for (LIBMTP_file_t *f : entries) {
+            if (f->filetype != LIBMTP_FILETYPE_FOLDER)
+                continue;
+            const TypeDir *child = dir->dir(f->filename);
+            if (child)
+                queue.emplace_back(const_cast<TypeDir*>(child), f->item_id);
+        }
+    }
+}
+
+void MTPDevice::prefetchWalk(TypeDir *dir)
+{
+    // The device can not report a whole subtree at once; list it one
+    // directory at a time instead.
+    std::vector<TypeDir*> queue(1, dir);
+    for (size_t i = 0; i < queue.size() && !m_prefetch_stop; ++i) {
+        dirFetch(queue[i]);
+        queue[i]->forEachDir([&](const TypeDir &d) {
+            if (d.storageid() == dir->storageid())
+                queue.push_back(const_cast<TypeDir*>(&d));
+        });
+    }
+}
+
+void MTPDevice::eventStart()
+{
+    if (!m_device || m_event_thread.joinable())
+        return;
+
+    rootFetch();
+    m_event_stop = false;
+    m_event_error = false;
+    m_events_deferred.clear();
+    m_event_thread = std::thread(&MTPDevice::eventWorker, this);
+}
+
+void MTPDevice::eventStop()
+{
+    if (!m_event_thread.joinable())
+        return;
+
+    m_event_stop = true;
+    m_event_thread.join();
+}
+
+void MTPDevice::eventCallback(int ret, LIBMTP_event_t event, uint32_t param,
+    void *user_data)
+{
+    // Runs from whichever thread polls libusb at the moment, which may be
+    // in the middle of a device transfer; only queue the event here.
+    MTPDevice *device = static_cast<MTPDevice*>(user_data);
+    std::lock_guard<std::mutex> lock(device->m_event_mutex);
+    device->m_event_pending = false;
+    if (ret == LIBMTP_HANDLER_RETURN_OK && event != LIBMTP_EVENT_NONE)
+        device->m_events.emplace_back(event, param);
+    else if (ret == LIBMTP_HANDLER_RETURN_ERROR)
+        device->m_event_error = true;
+}
+
+void MTPDevice::eventWorker()
+{
+    logmsg("Event listener started.\n");
+
+    std::vector<std::pair<LIBMTP_event_t, uint32_t>> events;
+    while (!m_event_stop) {
+        bool read = false;
+        {
+            std::lock_guard<std::mutex> lock(m_event_mutex);
+            if (m_event_error)
+                break;
+            if (!m_event_pending)
+                read = m_event_pending = true;
+        }
+        if (read && LIBMTP_Read_Event_Async(m_device, eventCallback, this) != 0) {
+            logerr("Can not listen to device events.\n");
+            std::lock_guard<std::mutex> lock(m_event_mutex);
+            m_event_pending = false;
+            break;
+        }
+
+        struct timeval tv = { 0, 250000 };
+        LIBMTP_Handle_Events_Timeout_Completed(&tv, nullptr);
+
+        {
+            std::lock_guard<std::mutex> lock(m_event_mutex);
+            events.swap(m_events);
+        }
+        Epoch::Section section;
+        for (const auto &e : events)
+            eventQueue(e.first, e.second);
+        events.clear();
+        eventReplay();
+    }
+
+    // The pending read refers to the device; wait for it to be cancelled
+    // before the device can be released.
+    LIBMTP_Cancel_Event_Async(m_device);
+    for (int i = 0; i < 20; ++i) {
+        {
+            std::lock_guard<std::mutex> lock(m_event_mutex);
+            if (!m_event_pending)
+                break;
+        }
+        struct timeval tv = { 0, 50000 };
+        LIBMTP_Handle_Events_Timeout_Completed(&tv, nullptr);
+    }
+    logmsg("Event listener stopped.\n");
+}
+
+void MTPDevice::eventQueue(LIBMTP_event_t event, uint32_t param)
+{
+    // The prefetch worker walks the nodes of storages it has not finished;
+    // changes to them wait for it instead of blocking the listener. Events
+    // queued before keep their order.
+    const uint32_t storage_id = eventStorage(event, param);
+    bool held;
+    {
+        std::lock_guard<std::mutex> lock(m_fetch_mutex);
+        held = storage_id ? m_prefetch_held.count(storage_id) > 0 :
+            !m_prefetch_held.empty();
+    }
+    if (held || m_events_deferred.count(storage_id)) {
+        m_events_deferred[storage_id].emplace_back(event, param);
+        return;
+    }
+    eventHandle(event, param);
+}
+
+void MTPDevice::eventReplay()
+{
+    for (auto it = m_events_deferred.begin(); it != m_events_deferred.end(); ) {
+        bool held;
+        {
+            std::lock_guard<std::mutex> lock(m_fetch_mutex);
+            held = it->first ? m_prefetch_held.count(it->first) > 0 :
+                !m_prefetch_held.empty();
+        }
+        if (held) {
+            ++it;
+            continue;
+        }
+
+        std::vector<std::pair<LIBMTP_event_t, uint32_t>> events;
+        events.swap(it->second);
+        it = m_events_deferred.erase(it);
+        for (const auto &e : events)
+            eventHandle(e.first, e.second);
+    }
+}
+
+uint32_t MTPDevice::eventStorage(LIBMTP_event_t event, uint32_t param)
+{
+    // A new object can not be placed without asking the device.
+    bool is_dir = false;
+    TypeDir *parent = nullptr;
+    switch (event) {
+    case LIBMTP_EVENT_STORE_ADDED:
+    case LIBMTP_EVENT_STORE_REMOVED:
+        return param;
+    case LIBMTP_EVENT_OBJECT_REMOVED:
+    case LIBMTP_EVENT_OBJECT_INFO_CHANGED:
+        parent = dirFindParent(param, is_dir);
+        return parent ? parent->storageid() : 0;
+    default:
+        return 0;
+    }
+}
+
+void MTPDevice::eventHandle(LIBMTP_event_t event, uint32_t param)
+{
+    logdebug("Device event ", event, ", parameter ", param, ".\n");
+    switch (event) {
+    case LIBMTP_EVENT_OBJECT_ADDED:
+        eventObjectAdded(param);
+        break;
+    case LIBMTP_EVENT_OBJECT_REMOVED:
+        eventObjectRemoved(param);
+        break;
+    case LIBMTP_EVENT_OBJECT_INFO_CHANGED:
+        eventObjectChanged(param);
+        break;
+    case LIBMTP_EVENT_STORE_ADDED:
+        eventStoreAdded(param);
+        break;
+    case LIBMTP_EVENT_STORE_REMOVED:
+        eventStoreRemoved(param);
+        break;
+    default:
+        break;
+    }
+}
+
+void MTPDevice::eventObjectAdded(uint32_t id)
+{
+    criticalEnter();
+    LIBMTP_file_t *f = LIBMTP_Get_Filemetadata(m_device, id);
+    if (!f)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    if (!f)
+        return;
+
+    // Directories not listed yet will see the object when they are.
+    TypeDir *parent = dirFind(f->storage_id, f->parent_id);
+    if (parent && (parent->isFetched() || parent->isStale())) {
+        negativeRemove(parent, f->filename);
+        if (f->filetype == LIBMTP_FILETYPE_FOLDER) {
+            parent->addDir(TypeDir(f));
+        } else {
+            std::unique_ptr<const TypeFile> file = parent->file(f->filename);
+            if (file)
+                parent->replaceFile(*file, TypeFile(f));
+            else
+                parent->addFile(TypeFile(f));
+        }
+    }
+    LIBMTP_destroy_file_t(f);
+}
+
+void MTPDevice::eventObjectRemoved(uint32_t id)
+{
+    bool is_dir = false;
+    TypeDir *parent = dirFindParent(id, is_dir);
+    if (!parent)
+        return;
+
+    if (!is_dir) {
+        m_write_back.discard(id);
+        m_edit_sessions.drop(id);
+        contentInvalidate(id);
+        std::unique_ptr<const TypeFile> file;
+        parent->forEachFile([&](const TypeFile &f) {
+            if (f.id() == id)
+                file.reset(new TypeFile(f));
+        });
+        if (file)
+            parent->removeFile(TypeFile(*file));
+        return;
+    }
+
+    pathCacheClear();
+    const TypeDir *dir = nullptr;
+    parent->forEachDir([&](const TypeDir &d) {
+        if (d.id() == id)
+            dir = &d;
+    });
+    if (dir)
+        parent->removeDir(TypeDir(dir->id(), dir->parentid(), dir->storageid(), dir->name()));
+    pathCacheResume();
+}
+
+void MTPDevice::eventObjectChanged(uint32_t id)
+{
+    bool is_dir = false;
+    TypeDir *old_parent = dirFindParent(id, is_dir);
+    if (!old_parent)
+        return;
+
+    criticalEnter();
+    LIBMTP_file_t *f = LIBMTP_Get_Filemetadata(m_device, id);
+    if (!f)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    if (!f)
+        return;
+
+    TypeDir *new_parent = dirFind(f->storage_id, f->parent_id);
+    if (new_parent && !new_parent->isFetched() && !new_parent->isStale())
+        new_parent = nullptr;
+    if (new_parent)
+        negativeRemove(new_parent, f->filename);
+
+    if (!is_dir) {
+        contentInvalidate(id);
+        std::unique_ptr<const TypeFile> file;
+        old_parent->forEachFile([&](const TypeFile &tf) {
+            if (tf.id() == id)
+                file.reset(new TypeFile(tf));
+        });
+        if (file && new_parent == old_parent) {
+            old_parent->replaceFile(*file, TypeFile(f));
+        } else if (file) {
+            old_parent->removeFile(TypeFile(*file));
+            if (new_parent)
+                new_parent->addFile(TypeFile(f));
+        }
+        LIBMTP_destroy_file_t(f);
+        return;
+    }
+
+    const TypeDir *dir = nullptr;
+    old_parent->forEachDir([&](const TypeDir &d) {
+        if (d.id() == id)
+            dir = &d;
+    });
+    if (dir && (new_parent != old_parent || dir->name() != f->filename)) {
+        pathCacheClear();
+        if (new_parent == old_parent) {
+            old_parent->renameDir(dir->name(), f->filename);
+        } else {
+            TypeDir moved(*dir);
+            moved.setName(f->filename);
+            old_parent->removeDir(*dir);
+            if (new_parent) {
+                moved.setParent(new_parent->id());
+                new_parent->addDir(moved);
+            }
+        }
+        pathCacheResume();
+    }
+    if (dir && new_parent) {
+        const TypeDir *d = new_parent->dir(f->filename);
+        if (d)
+            const_cast<TypeDir*>(d)->setModificationDate(f->modificationdate);
+    }
+    LIBMTP_destroy_file_t(f);
+}
+
+void MTPDevice::eventStoreAdded(uint32_t storage_id)
+{
+    criticalEnter();
+    int rval = LIBMTP_Get_Storage(m_device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    if (rval < 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    if (rval < 0)
+        return;
+
+    TypeDir *parent = nullptr;
+    if (storageFind(storage_id, parent))
+        return;
+
+    // With a single storage as the mount root, later ones show up in it.
+    parent = &m_root_dir;
+    if (!m_root_prefix.empty()) {
+        m_root_dir.forEachDir([&](const TypeDir &d) {
+            parent = const_cast<TypeDir*>(&d);
+        });
+    }
+    for (LIBMTP_devicestorage_t *s = m_device->storage; s; s = s->next) {
+        if (s->id != storage_id)
+            continue;
+        const std::string name(s->StorageDescription);
+        if (parent->dir(name) || parent->file(name)) {
+            logmsg("Storage '", name, "' added, remount to access it.\n");
+            return;
+        }
+        negativeRemove(parent, name);
+        parent->addDir(TypeDir(s_root_node, 0, s->id, name));
+        logmsg("Storage '", name, "' added.\n");
+    }
+}
+
+void MTPDevice::eventStoreRemoved(uint32_t storage_id)
+{
+    TypeDir *parent = nullptr;
+    const TypeDir *storage_dir = storageFind(storage_id, parent);
+    if (!storage_dir)
+        return;
+
+    pathCacheClear();
+    parent->removeDir(TypeDir(storage_dir->id(), storage_dir->parentid(),
+        storage_dir->storageid(), storage_dir->name()));
+    pathCacheResume();
+
+    criticalEnter();
+    if (LIBMTP_Get_Storage(m_device, LIBMTP_STORAGE_SORTBY_NOTSORTED) < 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+}
+
+TypeDir *MTPDevice::storageFind(uint32_t storage_id, TypeDir *&parent)
+{
+    // Storages added to a single storage mount are found in its root.
+    TypeDir *storage_dir = nullptr;
+    parent = &m_root_dir;
+    m_root_dir.forEachDir([&](const TypeDir &d) {
+        if (d.storageid() == storage_id)
+            storage_dir = const_cast<TypeDir*>(&d);
+    });
+    if (storage_dir || m_root_prefix.empty())
+        return storage_dir;
+
+    m_root_dir.forEachDir([&](const TypeDir &d) { parent = const_cast<TypeDir*>(&d); });
+    parent->forEachDir([&](const TypeDir &d) {
+        if (d.storageid() == storage_id && d.id() == s_root_node)
+            storage_dir = const_cast<TypeDir*>(&d);
+    });
+    return storage_dir;
+}
+
+TypeDir *MTPDevice::dirFind(uint32_t storage_id, uint32_t id)
+{
+    if (id == 0 || id == s_root_node || id == storage_id) {
+        TypeDir *parent = nullptr;
+        return storageFind(storage_id, parent);
+    }
+
+    TypeDir *dir = m_object_index.dir(id);
+    return dir && dir->storageid() == storage_id ? dir : nullptr;
+}
+
+TypeDir *MTPDevice::dirFindParent(uint32_t id, bool &is_dir)
+{
+    if (id == s_root_node)
+        return nullptr;
+    return m_object_index.parent(id, is_dir);
+}
+
+std::string MTPDevice::devicePath(const std::string &path) const
+{
+    // With a single storage, its root is presented as the mount root.
+    return smtpfs_normalize_path(m_root_prefix + path);
+}
+
+TypeDir *MTPDevice::pathCacheLookup(const std::string &path)
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_path_cache_mutex);
+    auto it = m_path_cache.find(path);
+    return it != m_path_cache.end() ? it->second : nullptr;
+}
+
+uint64_t MTPDevice::pathCacheGeneration()
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_path_cache_mutex);
+    return m_path_cache_generation;
+}
+
+void MTPDevice::pathCacheInsert(const std::string &path, TypeDir *dir,
+    uint64_t generation)
+{
+    // A walk which overlapped a removal may have picked up a directory
+    // which is retired by now; it must not outlive the epoch in the cache.
+    std::lock_guard<std::shared_timed_mutex> lock(m_path_cache_mutex);
+    if (m_path_cache_removals == 0 && generation == m_path_cache_generation)
+        m_path_cache[path] = dir;
+}
+
+void MTPDevice::pathCacheClear()
+{
+    std::lock_guard<std::shared_timed_mutex> lock(m_path_cache_mutex);
+    ++m_path_cache_removals;
+    ++m_path_cache_generation;
+    m_path_cache.clear();
+}
+
+void MTPDevice::pathCacheResume()
+{
+    std::lock_guard<std::shared_timed_mutex> lock(m_path_cache_mutex);
+    --m_path_cache_removals;
+    ++m_path_cache_generation;
+}
+
+void MTPDevice::pathCacheRemove(const std::string &path)
+{
+    // Drop the directory itself and everything cached below it; the
+    // entries point into the subtree which is about to change.
+    const std::string prefix(path + '/');
+    std::lock_guard<std::shared_timed_mutex> lock(m_path_cache_mutex);
+    ++m_path_cache_removals;
+    ++m_path_cache_generation;
+    for (auto it = m_path_cache.begin(); it != m_path_cache.end(); ) {
+        if (it->first == path || it->first.compare(0, prefix.size(), prefix) == 0)
+            it = m_path_cache.erase(it);
+        else
+            ++it;
+    }
+}
+
+const TypeDir *MTPDevice::negativeParent(const std::string &path)
+{
+    // Only directories already resolved are considered; a lookup here must
+    // never cause device I/O.
+    const std::string dirname(devicePath(smtpfs_dirname(path)));
+    if (dirname == "/")
+        return &m_root_dir;
+    return pathCacheLookup(dirname);
+}
+
+std::string MTPDevice::negativeKey(const TypeDir *parent, const std::string &name)
+{
+    const uint32_t ids[2] = { parent->storageid(), parent->id() };
+    std::string key(reinterpret_cast<const char*>(ids), sizeof(ids));
+    key += name;
+    return key;
+}
+
+bool MTPDevice::negativeLookup(const std::string &path)
+{
+    const TypeDir *parent = negativeParent(path);
+    if (!parent)
+        return false;
+
+    const std::string key(negativeKey(parent, smtpfs_basename(path)));
+    std::lock_guard<std::mutex> lock(m_negative_mutex);
+    auto it = m_negative_cache.find(key);
+    if (it == m_negative_cache.end())
+        return false;
+    m_negative_lru.splice(m_negative_lru.begin(), m_negative_lru, it->second);
+    return true;
+}
+
+void MTPDevice::negativeInsert(const std::string &path)
+{
+    const TypeDir *parent = negativeParent(path);
+    const std::string name(smtpfs_basename(path));
+    if (!parent || !parent->isFetched() || parent->dir(name) || parent->file(name))
+        return;
+
+    const std::string key(negativeKey(parent, name));
+    std::lock_guard<std::mutex> lock(m_negative_mutex);
+    if (m_negative_cache.count(key))
+        return;
+    if (m_negative_lru.size() >= s_negative_cache_size) {
+        m_negative_cache.erase(m_negative_lru.back());
+        m_negative_lru.pop_back();
+    }
+    m_negative_lru.push_front(key);
+    m_negative_cache.emplace(key, m_negative_lru.begin());
+}
+
+void MTPDevice::negativeRemove(const TypeDir *parent, const std::string &name)
+{
+    const std::string key(negativeKey(parent, name));
+    std::lock_guard<std::mutex> lock(m_negative_mutex);
+    auto it = m_negative_cache.find(key);
+    if (it == m_negative_cache.end())
+        return;
+    m_negative_lru.erase(it->second);
+    m_negative_cache.erase(it);
+}
+
+const TypeDir *MTPDevice::dirFetchContent(std::string path)
+{
+    rootFetch();
+    path = devicePath(path);
+    if (path == "/")
+        return &m_root_dir;
+
+    const uint64_t generation = pathCacheGeneration();
+    TypeDir *dir = pathCacheLookup(path);
+    if (!dir) {
+        // Resume the walk from the deepest ancestor we have already seen.
+        std::string::size_type resolved = path.size();
+        while (!dir && (resolved = path.rfind('/', resolved - 1)) != 0)
+            dir = pathCacheLookup(path.substr(0, resolved));
+        if (!dir)
+            dir = &m_root_dir;
+
+        std::string member;
+        std::istringstream ss(path.substr(resolved));
+        while (std::getline(ss, member, '/')) {
+            if (member.empty())
+                continue;
+
+            const TypeDir *tmp = dir->dir(member);
+            if (!tmp && !dir->isFetched()) {
+                dirFetch(dir);
+                tmp = dir->dir(member);
+            }
+
+            if (!tmp)
+                return nullptr;
+            dir = const_cast<TypeDir*>(tmp);
+            resolved = path.find('/', resolved + 1);
+            pathCacheInsert(path.substr(0, resolved), dir, generation);
+        }
+    }
+
+    if (!dir->isFetched())
+        dirFetch(dir);
+    return dir;
+}
+
+int MTPDevice::dirCreateNew(const std::string &path)
+{
+    const std::string tmp_basename(smtpfs_basename(path));
+    const std::string tmp_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(tmp_dirname);
+    if (!dir_parent || dir_parent->id() == 0) {
+        logerr("Can not remove directory '", path, "'.\n");
+        return -EINVAL;
+    }
+    char *c_name = strdup(tmp_basename.c_str());
+    criticalEnter();
+    uint32_t new_id = LIBMTP_Create_Folder(m_device, c_name,
+        dir_parent->id(), dir_parent->storageid());
+    criticalLeave();
+    if (new_id == 0) {
+        logerr("Could not create directory '", path, "'.\n");
+        LIBMTP_Dump_Errorstack(m_device);
+        LIBMTP_Clear_Errorstack(m_device);
+    } else {
+        TypeDir *parent = const_cast<TypeDir*>(dir_parent);
+        const uint64_t generation = pathCacheGeneration();
+        parent->addDir(TypeDir(new_id, dir_parent->id(),
+            dir_parent->storageid(), tmp_basename));
+        pathCacheInsert(devicePath(path),
+            const_cast<TypeDir*>(parent->dir(tmp_basename)), generation);
+        negativeRemove(parent, tmp_basename);
+        logmsg("Directory '", path, "' created.\n");
+    }
+    free(static_cast<void*>(c_name));
+    return new_id != 0 ? 0 : -EINVAL;
+}
+
+int MTPDevice::dirRemove(const std::string &path)
+{
+    const std::string tmp_basename(smtpfs_basename(path));
+    const std::string tmp_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(tmp_dirname);
+    const TypeDir *dir_to_remove = dir_parent ? dir_parent->dir(tmp_basename) : nullptr;
+    if (!dir_parent || !dir_to_remove || dir_parent->id() == 0) {
+        logerr("No such directory '", path, "' to remove.\n");
+        return -ENOENT;
+    }
+    // The prefetch worker keeps pointers to directories of the storage
+    // it has not finished yet, so they are not removed meanwhile.
+    prefetchWait(dir_to_remove->storageid());
+    dirFetch(const_cast<TypeDir*>(dir_to_remove));
+    if (!dir_to_remove->isEmpty())
+        return -ENOTEMPTY;
+    criticalEnter();
+    int rval = LIBMTP_Delete_Object(m_device, dir_to_remove->id());
+    criticalLeave();
+    if (rval != 0){
+        logerr("Could not remove the directory '", path, "'.\n");
+        LIBMTP_Dump_Errorstack(m_device);
+        LIBMTP_Clear_Errorstack(m_device);
+        return -EINVAL;
+    }
+    pathCacheRemove(devicePath(path));
+    const_cast<TypeDir*>(dir_parent)->removeDir(*dir_to_remove);
+    pathCacheResume();
+    logmsg("Folder '", path, "' removed.\n");
+    return 0;
+}
+
+int MTPDevice::dirRename(const std::string &oldpath, const std::string &newpath)
+{
+    const std::string tmp_old_basename(smtpfs_basename(oldpath));
+    const std::string tmp_old_dirname(smtpfs_dirname(oldpath));
+    const std::string tmp_new_basename(smtpfs_basename(newpath));
+    const std::string tmp_new_dirname(smtpfs_dirname(newpath));
+    const TypeDir *dir_parent = dirFetchContent(tmp_old_dirname);
+    const TypeDir *dir_to_rename = dir_parent ? dir_parent->dir(tmp_old_basename) : nullptr;
+    if (!dir_parent || !dir_to_rename || dir_parent->id() == 0) {
+        logerr("Can not rename '", tmp_old_basename, "' to '",
+            tmp_new_basename, "'.\n");
+        return -EINVAL;
+    }
+    if (tmp_old_dirname != tmp_new_dirname) {
+        logerr("Can not move '", oldpath, "' to '", newpath, "'.\n");
+        return -EINVAL;
+    }
+
+    LIBMTP_folder_t *folder = dir_to_rename->toLIBMTPFolder();
+    criticalEnter();
+    int ret = LIBMTP_Set_Folder_Name(m_device, folder, tmp_new_basename.c_str());
+    criticalLeave();
+    free(static_cast<void*>(folder->name));
+    free(static_cast<void*>(folder));
+    if (ret != 0) {
+        logerr("Could not rename '", oldpath, "' to '",  tmp_new_basename, "'.\n");
+        LIBMTP_Dump_Errorstack(m_device);
+        LIBMTP_Clear_Errorstack(m_device);
+        return -EINVAL;
+    }
+    pathCacheRemove(devicePath(oldpath));
+    const_cast<TypeDir*>(dir_parent)->renameDir(tmp_old_basename, tmp_new_basename);
+    pathCacheResume();
+    negativeRemove(dir_parent, tmp_new_basename);
+    logmsg("Directory '", oldpath, "' renamed to '", tmp_new_basename, "'.\n");
+    return 0;
+}
+
+int MTPDevice::rename(const std::string &oldpath, const std::string &newpath)
+{
+    // queued pushes follow the object to its new path
+    std::deque<PendingPush> pushes = pushTake(oldpath);
+    pushWait(newpath);
+    int rval = renameObject(oldpath, newpath);
+    pushRestore(pushes, oldpath, rval == 0 ? newpath : oldpath);
+    return rval;
+}
+
+int MTPDevice::renameObject(const std::string &oldpath, const std::string &newpath)
+{
+#ifndef SMTPFS_MOVE_BY_SET_OBJECT_PROPERTY
+    const std::string tmp_old_basename(smtpfs_basename(oldpath));
+    const std::string tmp_old_dirname(smtpfs_dirname(oldpath));
+    const std::string tmp_new_dirname(smtpfs_dirname(newpath));
+    if (tmp_old_dirname != tmp_new_dirname)
+        return -EINVAL;
+
+    const TypeDir *dir_parent = dirFetchContent(tmp_old_dirname);
+    if (!dir_parent || dir_parent->id() == 0)
+        return -EINVAL;
+    const TypeDir *dir_to_rename = dir_parent->dir(tmp_old_basename);
+    if (dir_to_rename)
+        return dirRename(oldpath, newpath);
+    else
+        return fileRename(oldpath, newpath);
+#else
+    const std::string tmp_old_basename(smtpfs_basename(oldpath));
+    const std::string tmp_old_dirname(smtpfs_dirname(oldpath));
+    const std::string tmp_new_basename(smtpfs_basename(newpath));
+    const std::string tmp_new_dirname(smtpfs_dirname(newpath));
+    const TypeDir *dir_old_parent = dirFetchContent(tmp_old_dirname);
+    const TypeDir *dir_new_parent = dirFetchContent(tmp_new_dirname);
+    const TypeDir *dir_to_rename = dir_old_parent ? dir_old_parent->dir(tmp_old_basename) : nullptr;
+    std::unique_ptr<const TypeFile> file_to_rename = dir_old_parent ? dir_old_parent->file(tmp_old_basename) : nullptr;
+
+    logdebug("dir_to_rename:    ", dir_to_rename, "\n");
+    logdebug("file_to_rename:   ", file_to_rename.get(), "\n");
+
+    if (!dir_old_parent || !dir_new_parent || dir_old_parent->id() == 0)
+        return -EINVAL;
+
+    const TypeBasic *object_to_rename =  dir_to_rename ?
+        static_cast<const TypeBasic*>(dir_to_rename) :
+        static_cast<const TypeBasic*>(file_to_rename.get());
+
+    logdebug("object_to_rename: ", object_to_rename, "\n");
+    logdebug("object_to_rename->id(): ", object_to_rename->id(), "\n");
+
+    if (!object_to_rename) {
+        logerr("No such file or directory to rename/move!\n");
+        return -ENOENT;
+    }
+
+    if (tmp_old_dirname != tmp_new_dirname) {
+        criticalEnter();
+        int rval = LIBMTP_Set_Object_u32(m_device, object_to_rename->id(),
+            LIBMTP_PROPERTY_ParentObject, dir_new_parent->id());
+        criticalLeave();
+        if (rval != 0) {
+            logerr("Could not move '", oldpath, "' to '", newpath, "'.\n");
+            LIBMTP_Dump_Errorstack(m_device);
+            LIBMTP_Clear_Errorstack(m_device);
+            return -EINVAL;
+        }
+    }
+    if (tmp_old_basename != tmp_new_basename) {
+        criticalEnter();
+        int rval = LIBMTP_Set_Object_String(m_device, object_to_rename->id(),
+            LIBMTP_PROPERTY_Name, tmp_new_basename.c_str());
+        criticalLeave();
+        if (rval != 0) {
+            logerr("Could not rename '", oldpath, "' to '", newpath, "'.\n");
+            LIBMTP_Dump_Errorstack(m_device);
+            LIBMTP_Clear_Errorstack(m_device);
+            return -EINVAL;
+        }
+    }
+
+    // Mirror the move in the cached tree.
+    TypeDir *old_parent = const_cast<TypeDir*>(dir_old_parent);
+    TypeDir *new_parent = const_cast<TypeDir*>(dir_new_parent);
+    negativeRemove(new_parent, tmp_new_basename);
+    if (dir_to_rename) {
+        pathCacheRemove(devicePath(oldpath));
+        if (old_parent == new_parent) {
+            old_parent->renameDir(tmp_old_basename, tmp_new_basename);
+        } else {
+            prefetchWait(old_parent->storageid());
+            TypeDir moved(*dir_to_rename);
+            moved.setParent(new_parent->id());
+            moved.setName(tmp_new_basename);
+            old_parent->removeDir(*dir_to_rename);
+            new_parent->addDir(moved);
+        }
+        pathCacheResume();
+    } else if (old_parent == new_parent) {
+        old_parent->renameFile(tmp_old_basename, tmp_new_basename);
+    } else {
+        TypeFile moved(*file_to_rename);
+        moved.setParent(new_parent->id());
+        moved.setName(tmp_new_basename);
+        old_parent->removeFile(*file_to_rename);
+        new_parent->addFile(moved);
+    }
+    return 0;
+#endif
+}
+
+int MTPDevice::fileRead(const std::string &path, char *buf, size_t size,
+    off_t offset)
+{
+    const std::string path_basename(smtpfs_basename(path));
+    const std::string path_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(path_dirname);
+    std::unique_ptr<const TypeFile> file_to_fetch = dir_parent ?
+        dir_parent->file(path_basename) : nullptr;
+    long real_size = size;
+    if (!dir_parent) {
+        logerr("Can not fetch '", path, "'.\n");
+        return -EINVAL;
+    }
+    if (!file_to_fetch) {
+        logerr("No such file '", path, "'.\n");
+        return -ENOENT;
+    }
+    // data not written back yet is newer than what the device has
+    int rval = m_write_back.read(file_to_fetch->id(), offset, size, buf);
+    if (rval != 0)
+        return rval;
+
+    // handling read past EOF 
+    if (offset >= file_to_fetch->size()) {
+      printf("Skipping read with offset past EOF\n");
+    }
+    else if (offset + size > file_to_fetch->size()) {
+      printf("Reducing bytes_requested to avoid reading past EOF\n");
+      real_size = file_to_fetch->size() - offset;
+    }
+
+    return m_read_ahead.read(file_to_fetch->storageid(), file_to_fetch->id(),
+        file_to_fetch->size(), buf, static_cast<uint32_t>(real_size), offset);
+}
+
+int MTPDevice::objectRead(uint32_t storage_id, uint32_t id, uint64_t file_size,
+    uint64_t offset, uint32_t size, unsigned char *buf)
+{
+    if (offset >= file_size || size == 0)
+        return 0;
+    if (offset + size > file_size)
+        size = static_cast<uint32_t>(file_size - offset);
+
+    // Read-ahead windows would only flush the cache.
+    const uint32_t block_size = BlockCache::blockSize();
+    if (size > block_size)
+        return objectFetch(id, file_size, offset, size, buf);
+
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (offset + size - 1) / block_size;
+    bool hit = true;
+    for (uint64_t block = first; hit && block <= last; ++block) {
+        const uint64_t start = std::max(offset, block * block_size);
+        const uint64_t end = std::min(offset + size, (block + 1) * block_size);
+        hit = m_block_cache.get(storage_id, id, block,
+            static_cast<uint32_t>(start - block * block_size),
+            static_cast<uint32_t>(end - start), buf + (start - offset));
+    }
+    if (hit)
+        return size;
+
+    // Read whole blocks, so that reads around this one hit.
+    const uint64_t generation = m_block_cache.generation();
+    const uint64_t span_offset = first * block_size;
+    const uint64_t span_end = std::min((last + 1) * block_size, file_size);
+    std::vector<unsigned char> data(span_end - span_offset);
+    int rval = objectFetch(id, file_size, span_offset,
+        static_cast<uint32_t>(data.size()), data.data());
+    if (rval < 0)
+        return rval;
+
+    for (uint64_t block = first; block <= last; ++block) {
+        const uint64_t start = block * block_size - span_offset;
+        const uint64_t end = std::min((block + 1) * block_size, file_size) -
+            span_offset;
+        if (end > static_cast<uint64_t>(rval))
+            break;
+        m_block_cache.put(storage_id, id, block, data.data() + start,
+            static_cast<uint32_t>(end - start), generation);
+    }
+
+    const uint64_t skip = offset - span_offset;
+    if (static_cast<uint64_t>(rval) <= skip)
+        return 0;
+    const uint32_t read_size = static_cast<uint32_t>(
+        std::min<uint64_t>(size, rval - skip));
+    memcpy(buf, data.data() + skip, read_size);
+    return read_size;
+}
+
+void MTPDevice::contentInvalidate(uint32_t id)
+{
+    m_read_ahead.invalidate(id);
+    m_block_cache.invalidate(id);
+    m_thumbnail_cache.invalidate(id);
+    m_content_cache.invalidate(id);
+}
+
+int MTPDevice::objectFetch(uint32_t id, uint64_t file_size, uint64_t offset,
+    uint32_t size, unsigned char *buf)
+{
+    std::unique_lock<std::mutex> lock(m_read_mutex);
+
+    // Join a read of the same object which covers this one, or which is
+    // still waiting for the device and can be widened to cover it.
+    std::shared_ptr<PendingRead> read;
+    for (const std::shared_ptr<PendingRead> &r : m_reads) {
+        if (r->id != id || r->file_size != file_size)
+            continue;
+        if (r->started) {
+            if (!r->direct && offset >= r->offset && offset + size <= r->end) {
+                read = r;
+                break;
+            }
+            continue;
+        }
+        const uint64_t begin = std::min(r->offset, offset);
+        const uint64_t end = std::max(r->end, offset + size);
+        if (offset <= r->end && offset + size >= r->offset &&
+            end - begin <= s_max_coalesced_read) {
+            r->offset = begin;
+            r->end = end;
+            read = r;
+            break;
+        }
+    }
+
+    if (read) {
+        ++read->joiners;
+        m_read_cv.wait(lock, [&]() { return read->done; });
+        lock.unlock();
+        return objectCopy(*read, offset, size, buf);
+    }
+
+    read = std::make_shared<PendingRead>();
+    read->id = id;
+    read->file_size = file_size;
+    read->offset = offset;
+    read->end = offset + size;
+    read->joiners = 0;
+    read->started = false;
+    read->direct = false;
+    read->done = false;
+    read->rval = 0;
+    m_reads.push_back(read);
+    lock.unlock();
+
+    // Others may join while the device is busy; once it is ours, the range
+    // is fixed. Nobody joined a read of just this range, so it can go
+    // straight to the buffer of the caller.
+    criticalEnter();
+    lock.lock();
+    read->started = true;
+    read->direct = read->joiners == 0 && read->offset == offset &&
+        read->end == offset + size;
+    const uint64_t read_offset = read->offset;
+    const uint32_t read_size = static_cast<uint32_t>(read->end - read->offset);
+    lock.unlock();
+
+    unsigned char *dest = buf;
+    if (!read->direct) {
+        read->data.resize(read_size);
+        dest = read->data.data();
+    }
+
+    // The size is known from the listing, no need to ask the device again.
+    unsigned int fetched = 0;
+    int rval = LIBMTP_GetPartialObject_To_Buffer(m_device, id, read_offset,
+        read_size, file_size, dest, &fetched);
+    if (rval != 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+
+    lock.lock();
+    read->rval = rval != 0 ? -EIO : static_cast<int>(fetched);
+    read->done = true;
+    m_reads.remove(read);
+    lock.unlock();
+    m_read_cv.notify_all();
+
+    if (read->direct)
+        return read->rval;
+    return objectCopy(*read, offset, size, buf);
+}
+
+int MTPDevice::objectCopy(const PendingRead &read, uint64_t offset,
+    uint32_t size, unsigned char *buf)
+{
+    if (read.rval < 0)
+        return read.rval;
+
+    const uint64_t skip = offset - read.offset;
+    if (static_cast<uint64_t>(read.rval) <= skip)
+        return 0;
+    const uint32_t copy_size = static_cast<uint32_t>(
+        std::min<uint64_t>(size, read.rval - skip));
+    memcpy(buf, read.data.data() + skip, copy_size);
+    return copy_size;
+}
+
+int MTPDevice::fileWrite(const std::string &path, const char *buf, size_t size,
+    off_t offset)
+{
+    const std::string path_basename(smtpfs_basename(path));
+    const std::string path_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(path_dirname);
+    std::unique_ptr<const TypeFile> file_to_fetch = dir_parent ?
+        dir_parent->file(path_basename) : nullptr;
+    if (!dir_parent) {
+        logerr("Can not fetch '", path, "'.\n");
+        return -EINVAL;
+    }
+    if (!file_to_fetch) {
+        logerr("No such file '", path, "'.\n");
+        return -ENOENT;
+    }
+
+    return m_write_back.write(file_to_fetch->id(), offset, buf, size);
+}
+
+int MTPDevice::fileFlush(const std::string &path)
+{
+    const std::string path_basename(smtpfs_basename(path));
+    const std::string path_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(path_dirname);
+    std::unique_ptr<const TypeFile> file_to_flush = dir_parent ?
+        dir_parent->file(path_basename) : nullptr;
+    if (!file_to_flush)
+        return 0;
+
+    int rval = m_write_back.flush(file_to_flush->id());
+    int end_rval = m_edit_sessions.end(file_to_flush->id());
+    if (rval == 0)
+        rval = end_rval;
+    if (rval != 0)
+        logerr("Could not write back '", path, "'.\n");
+    return rval;
+}
+
+int MTPDevice::fileTruncate(const std::string &path, uint64_t size)
+{
+    pushWait(path);
+
+    const std::string path_basename(smtpfs_basename(path));
+    const std::string path_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(path_dirname);
+    std::unique_ptr<const TypeFile> file_to_truncate = dir_parent ?
+        dir_parent->file(path_basename) : nullptr;
+    if (!dir_parent) {
         logerr("Can not fetch '", path, "'.\n");
         return -EINVAL;
     }
-    if (!file_to_fetch) {
+    if (!file_to_truncate) {
         logerr("No such file '", path, "'.\n");
         return -ENOENT;
     }
 
-    // all systems clear
-    int rval = LIBMTP_SendPartialObject(m_device, file_to_fetch->id(),
-        offset, (unsigned char *) buf, size);
+    // buffered writes past the new end would grow the object again
+    const uint32_t id = file_to_truncate->id();
+    int rval = m_write_back.flush(id);
+    if (rval != 0)
+        return rval;
+
+    // the device only truncates objects being edited
+    rval = m_edit_sessions.acquire(id);
+    if (rval == 0) {
+        criticalEnter();
+        rval = LIBMTP_TruncateObject(m_device, id, size);
+        if (rval != 0) {
+            LIBMTP_Dump_Errorstack(m_device);
+            LIBMTP_Clear_Errorstack(m_device);
+        }
+        criticalLeave();
+        m_edit_sessions.release(id);
+        if (m_edit_sessions.end(id) != 0)
+            rval = -1;
+    }
+    contentInvalidate(id);
+    if (rval != 0) {
+        logerr("Could not truncate '", path, "'.\n");
+        return -EIO;
+    }
+
+    TypeFile truncated(*file_to_truncate);
+    truncated.setSize(size);
+    truncated.setModificationDate(time(nullptr));
+    const_cast<TypeDir*>(dir_parent)->replaceFile(*file_to_truncate, truncated);
+    logmsg("File '", path, "' truncated.\n");
+    return 0;
+}
+
+int MTPDevice::objectWrite(uint32_t id, uint64_t offset,
+    const unsigned char *data, uint32_t size)
+{
+    // without a session the device handles each write on its own
+    const bool session = m_capabilities.canEditObjects() &&
+        m_edit_sessions.acquire(id) == 0;
 
+    criticalEnter();
+    int rval = LIBMTP_SendPartialObject(m_device, id, offset,
+        const_cast<unsigned char*>(data), size);
     if (rval < 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    contentInvalidate(id);
+
+    if (session) {
+        m_edit_sessions.release(id);
+        if (rval < 0)
+            m_edit_sessions.end(id);
+    }
+    return rval < 0 ? -EIO : 0;
+}
+
+int MTPDevice::objectEditBegin(uint32_t id)
+{
+    criticalEnter();
+    int rval = LIBMTP_BeginEditObject(m_device, id);
+    if (rval != 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    if (rval != 0) {
+        logerr("Could not begin editing object ", id, ".\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+int MTPDevice::objectEditEnd(uint32_t id)
+{
+    criticalEnter();
+    int rval = LIBMTP_EndEditObject(m_device, id);
+    if (rval != 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    if (rval != 0) {
+        logerr("Could not end editing object ", id, ".\n");
         return -EIO;
-    return size;
+    }
+    return 0;
 }
 
 int MTPDevice::filePull(const std::string &src, const std::string &dst)
 {
+    pushWait(src);
+
     const std::string src_basename(smtpfs_basename(src));
     const std::string src_dirname(smtpfs_dirname(src));
     const TypeDir *dir_parent = dirFetchContent(src_dirname);
-    const TypeFile *file_to_fetch = dir_parent ? dir_parent->file(src_basename) : nullptr;
+    std::unique_ptr<const TypeFile> file_to_fetch = dir_parent ? dir_parent->file(src_basename) : nullptr;
     if (!dir_parent) {
         logerr("Can not fetch '", src, "'.\n");
         return -EINVAL;
@@ -556,6 +1980,10 @@ int MTPDevice::filePull(const std::string &src, const std::string &dst)
     if (file_to_fetch->size() == 0) {
         int fd = ::creat(dst.c_str(), S_IRUSR | S_IWUSR);
         ::close(fd);
+    } else if (m_content_cache.fetch(file_to_fetch->storageid(),
+            file_to_fetch->id(), file_to_fetch->size(),
+            file_to_fetch->modificationDate(), dst)) {
+        logmsg("File '", src, "' found in the content cache.\n");
     } else {
         logmsg("Started fetching '", src, "'.\n");
         criticalEnter();
@@ -568,21 +1996,401 @@ int MTPDevice::filePull(const std::string &src, const std::string &dst)
             LIBMTP_Clear_Errorstack(m_device);
             return -ENOENT;
         }
+        m_content_cache.store(file_to_fetch->storageid(), file_to_fetch->id(),
+            file_to_fetch->size(), file_to_fetch->modificationDate(), dst);
     }
     logmsg("File fetched '", src, "'.\n");
     return 0;
 }
 
+int MTPDevice::filePullAsync(const std::string &src, const std::string &dst,
+    std::shared_ptr<ObjectDownload> &download)
+{
+    pushWait(src);
+
+    const std::string src_basename(smtpfs_basename(src));
+    const std::string src_dirname(smtpfs_dirname(src));
+    const TypeDir *dir_parent = dirFetchContent(src_dirname);
+    std::unique_ptr<const TypeFile> file_to_fetch = dir_parent ? dir_parent->file(src_basename) : nullptr;
+    if (!dir_parent) {
+        logerr("Can not fetch '", src, "'.\n");
+        return -EINVAL;
+    }
+    if (!file_to_fetch) {
+        logerr("No such file '", src, "'.\n");
+        return -ENOENT;
+    }
+
+    int fd = ::creat(dst.c_str(), S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return -errno;
+    ::close(fd);
+
+    download = std::make_shared<ObjectDownload>(src, file_to_fetch->storageid(),
+        file_to_fetch->id(), file_to_fetch->size(),
+        file_to_fetch->modificationDate(), dst);
+    if (file_to_fetch->size() == 0) {
+        download->finish(0);
+        return 0;
+    }
+    if (m_content_cache.fetch(file_to_fetch->storageid(), file_to_fetch->id(),
+            file_to_fetch->size(), file_to_fetch->modificationDate(), dst)) {
+        download->addLanded(file_to_fetch->size());
+        download->finish(0);
+        logmsg("File '", src, "' found in the content cache.\n");
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_download_mutex);
+    m_downloads.push_back(download);
+    if (!m_download_thread.joinable()) {
+        m_download_stop = false;
+        m_download_thread = std::thread(&MTPDevice::downloadWorker, this);
+    }
+    m_download_cv.notify_one();
+    return 0;
+}
+
+void MTPDevice::downloadStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_download_mutex);
+        m_download_stop = true;
+        if (m_download_current)
+            m_download_current->cancel();
+    }
+    m_download_cv.notify_all();
+    if (m_download_thread.joinable())
+        m_download_thread.join();
+}
+
+void MTPDevice::downloadWorker()
+{
+    std::unique_lock<std::mutex> lock(m_download_mutex);
+    while (!m_download_stop) {
+        if (m_downloads.empty()) {
+            m_download_cv.wait(lock);
+            continue;
+        }
+
+        m_download_current = m_downloads.front();
+        m_downloads.pop_front();
+        lock.unlock();
+        {
+            Epoch::Section section;
+            downloadRun(*m_download_current);
+        }
+        lock.lock();
+        m_download_current.reset();
+    }
+
+    for (auto &download : m_downloads)
+        download->finish(-EIO);
+    m_downloads.clear();
+}
+
+struct DownloadSink
+{
+    ObjectDownload *download;
+    int fd;
+};
+
+uint16_t MTPDevice::downloadPut(void *params, void *priv, uint32_t sendlen,
+    unsigned char *data, uint32_t *putlen)
+{
+    DownloadSink *sink = static_cast<DownloadSink*>(priv);
+    if (sink->download->isCancelled())
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+
+    uint32_t written = 0;
+    while (written < sendlen) {
+        ssize_t rval = ::write(sink->fd, data + written, sendlen - written);
+        if (rval < 0 && errno == EINTR)
+            continue;
+        if (rval <= 0)
+            return LIBMTP_HANDLER_RETURN_ERROR;
+        written += rval;
+    }
+    sink->download->addLanded(written);
+    *putlen = written;
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+void MTPDevice::downloadRun(ObjectDownload &download)
+{
+    if (download.isCancelled()) {
+        download.finish(-ECANCELED);
+        return;
+    }
+
+    int fd = ::open(download.pathTmp().c_str(), O_WRONLY);
+    if (fd < 0) {
+        download.finish(-errno);
+        return;
+    }
+
+    logmsg("Started fetching '", download.path(), "'.\n");
+    DownloadSink sink = { &download, fd };
+    criticalEnter();
+    int rval = LIBMTP_Get_File_To_Handler(m_device, download.id(),
+        &MTPDevice::downloadPut, &sink, nullptr, nullptr);
+    if (rval != 0 && !download.isCancelled())
+        LIBMTP_Dump_Errorstack(m_device);
+    if (rval != 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+    ::close(fd);
+
+    if (rval != 0) {
+        if (!download.isCancelled())
+            logerr("Could not fetch file '", download.path(), "'.\n");
+        download.finish(download.isCancelled() ? -ECANCELED : -EIO);
+        return;
+    }
+    // Writers wait for the download to finish; keep the copy before they
+    // can change it.
+    if (!download.isCancelled()) {
+        m_content_cache.store(download.storageId(), download.id(),
+            download.size(), download.modificationDate(), download.pathTmp());
+    }
+    download.finish(0);
+    logmsg("File fetched '", download.path(), "'.\n");
+}
+
 int MTPDevice::filePush(const std::string &src, const std::string &dst)
+{
+    pushWait(dst);
+    return fileUpload(src, dst);
+}
+
+void MTPDevice::filePushQueued(const std::string &src, const std::string &dst)
+{
+    // Show the new size right away; the object keeps its id until the
+    // upload replaces it.
+    struct stat file_stat;
+    const std::string dst_basename(smtpfs_basename(dst));
+    const TypeDir *dir_parent = dirFetchContent(smtpfs_dirname(dst));
+    std::shared_ptr<const TypeFile> file(dir_parent ? dir_parent->file(dst_basename) : nullptr);
+    if (file && ::stat(src.c_str(), &file_stat) == 0) {
+        TypeFile updated(*file);
+        updated.setSize(static_cast<uint64_t>(file_stat.st_size));
+        updated.setModificationDate(file_stat.st_mtime);
+        const_cast<TypeDir*>(dir_parent)->replaceFile(*file, updated);
+    }
+
+    std::unique_lock<std::mutex> lock(m_push_mutex);
+    // a newer copy supersedes one still queued, e.g. for a retry
+    for (auto it = m_pushes.begin(); it != m_pushes.end(); ) {
+        if (it->dst == dst) {
+            file = it->original;
+            ::unlink(it->src.c_str());
+            it = m_pushes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_push_cv.wait(lock, [&]() { return m_pushes.size() < s_max_pushes; });
+    m_pushes.push_back(PendingPush{src, dst, file, 0});
+    if (!m_push_thread.joinable()) {
+        m_push_stop = false;
+        m_push_thread = std::thread(&MTPDevice::pushWorker, this);
+    }
+    m_push_cv.notify_all();
+}
+
+int MTPDevice::fileSync()
+{
+    std::unique_lock<std::mutex> lock(m_push_mutex);
+    m_push_cv.wait(lock, [&]() {
+        return m_pushes.empty() && m_push_current.empty();
+    });
+    int rval = m_push_error;
+    m_push_error = 0;
+    return rval;
+}
+
+bool MTPDevice::pushPending(const std::string &path) const
+{
+    // a directory is pending while anything below it is
+    if (!m_push_current.empty() && isBelow(m_push_current, path))
+        return true;
+    for (const auto &push : m_pushes) {
+        if (isBelow(push.dst, path))
+            return true;
+    }
+    return false;
+}
+
+void MTPDevice::pushWait(const std::string &path)
+{
+    std::unique_lock<std::mutex> lock(m_push_mutex);
+    m_push_cv.wait(lock, [&]() { return !pushPending(path); });
+}
+
+std::deque<MTPDevice::PendingPush> MTPDevice::pushTake(const std::string &path)
+{
+    std::unique_lock<std::mutex> lock(m_push_mutex);
+    std::deque<PendingPush> taken;
+    for (auto it = m_pushes.begin(); it != m_pushes.end(); ) {
+        if (isBelow(it->dst, path)) {
+            taken.push_back(*it);
+            it = m_pushes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_push_cv.notify_all();
+    m_push_cv.wait(lock, [&]() {
+        return m_push_current.empty() || !isBelow(m_push_current, path);
+    });
+    return taken;
+}
+
+void MTPDevice::pushRestore(const std::deque<PendingPush> &pushes,
+    const std::string &oldpath, const std::string &newpath)
+{
+    if (pushes.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(m_push_mutex);
+    for (auto it = pushes.rbegin(); it != pushes.rend(); ++it) {
+        PendingPush push(*it);
+        push.dst = newpath + push.dst.substr(oldpath.size());
+        if (push.original) {
+            TypeFile original(*push.original);
+            original.setName(smtpfs_basename(push.dst));
+            push.original = std::make_shared<const TypeFile>(original);
+        }
+        m_pushes.push_front(push);
+    }
+    m_push_cv.notify_all();
+}
+
+bool MTPDevice::isBelow(const std::string &path, const std::string &dir)
+{
+    return path.compare(0, dir.size(), dir) == 0 &&
+        (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+void MTPDevice::pushDrop(const std::string &path)
+{
+    std::unique_lock<std::mutex> lock(m_push_mutex);
+    for (auto it = m_pushes.begin(); it != m_pushes.end(); ) {
+        if (it->dst == path) {
+            ::unlink(it->src.c_str());
+            it = m_pushes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_push_cv.notify_all();
+    m_push_cv.wait(lock, [&]() { return m_push_current != path; });
+}
+
+void MTPDevice::pushStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_push_mutex);
+        m_push_stop = true;
+    }
+    m_push_cv.notify_all();
+    if (m_push_thread.joinable())
+        m_push_thread.join();
+}
+
+void MTPDevice::pushWorker()
+{
+    // Queued files are uploaded even when stopping, they exist nowhere else.
+    std::unique_lock<std::mutex> lock(m_push_mutex);
+    while (true) {
+        if (m_pushes.empty()) {
+            if (m_push_stop)
+                break;
+            m_push_cv.wait(lock);
+            continue;
+        }
+
+        PendingPush push = m_pushes.front();
+        m_pushes.pop_front();
+        m_push_current = push.dst;
+        m_push_cv.notify_all();
+        lock.unlock();
+        int rval;
+        {
+            Epoch::Section section;
+            rval = fileUpload(push.src, push.dst);
+        }
+        // without its directory the push can not succeed
+        if (rval == -ENOENT)
+            push.attempts = s_push_attempts - 1;
+        if (rval == 0)
+            ::unlink(push.src.c_str());
+        else if (++push.attempts >= s_push_attempts)
+            pushGiveUp(push);
+        lock.lock();
+        if (rval != 0 && m_push_error == 0)
+            m_push_error = rval;
+        if (rval != 0 && push.attempts < s_push_attempts) {
+            bool superseded = false;
+            for (const auto &queued : m_pushes)
+                superseded = superseded || queued.dst == push.dst;
+            if (superseded) {
+                ::unlink(push.src.c_str());
+            } else {
+                logmsg("Retrying upload of '", push.dst, "'.\n");
+                m_pushes.push_back(push);
+            }
+        }
+        m_push_current.clear();
+        m_push_cv.notify_all();
+        // give the device a moment before the retry
+        if (rval != 0)
+            m_push_cv.wait_for(lock, std::chrono::seconds(1));
+    }
+}
+
+void MTPDevice::pushGiveUp(const PendingPush &push)
+{
+    // If the old object could not be deleted, the tree has to show it again;
+    // if it was deleted, fileUpload() already dropped its entry.
+    const TypeDir *dir_parent = dirFetchContent(smtpfs_dirname(push.dst));
+    std::unique_ptr<const TypeFile> file = dir_parent ?
+        dir_parent->file(smtpfs_basename(push.dst)) : nullptr;
+    if (file && push.original && file->id() == push.original->id())
+        const_cast<TypeDir*>(dir_parent)->replaceFile(*file, *push.original);
+
+    // Keep the data where the user can find it.
+    std::string kept(push.src);
+    const std::string cache_dir(smtpfs_get_cachedir());
+    if (!cache_dir.empty()) {
+        const std::string unsent_dir(cache_dir + "/unsent");
+        const std::string unsent(unsent_dir + "/" +
+            smtpfs_basename(push.src) + "-" + smtpfs_basename(push.dst));
+        if ((smtpfs_check_dir(unsent_dir) || smtpfs_create_dir(unsent_dir)) &&
+            ::rename(push.src.c_str(), unsent.c_str()) == 0)
+            kept = unsent;
+    }
+    logerr("Could not upload '", push.dst, "', its data is kept in '",
+        kept, "'.\n");
+}
+
+int MTPDevice::fileUpload(const std::string &src, const std::string &dst)
 {
     const std::string dst_basename(smtpfs_basename(dst));
     const std::string dst_dirname(smtpfs_dirname(dst));
     const TypeDir *dir_parent = dirFetchContent(dst_dirname);
-    const TypeFile *file_to_remove = dir_parent ? dir_parent->file(dst_basename) : nullptr;
-    if (dir_parent && file_to_remove) {
+    if (!dir_parent) {
+        logerr("Can not upload '", src, "' to '", dst, "'.\n");
+        return -ENOENT;
+    }
+    std::unique_ptr<const TypeFile> file_to_remove = dir_parent->file(dst_basename);
+    if (file_to_remove) {
         criticalEnter();
         int rval = LIBMTP_Delete_Object(m_device, file_to_remove->id());
         criticalLeave();
+        m_write_back.discard(file_to_remove->id());
+        m_edit_sessions.drop(file_to_remove->id());
+        contentInvalidate(file_to_remove->id());
         if (rval != 0) {
             logerr("Can not upload '", src, "' to '", dst, "'.\n");
             return -EINVAL;
@@ -598,22 +2406,29 @@ int MTPDevice::filePush(const std::string &src, const std::string &dst)
         logmsg("Started uploading '", dst, "'.\n");
     criticalEnter();
     int rval = LIBMTP_Send_File_From_File(m_device, src.c_str(), f, nullptr, nullptr);
-    criticalLeave();
     if (rval != 0) {
-        logerr("Could not upload file '", src, "'.\n");
         LIBMTP_Dump_Errorstack(m_device);
         LIBMTP_Clear_Errorstack(m_device);
+    }
+    criticalLeave();
+    if (rval != 0) {
+        logerr("Could not upload file '", src, "'.\n");
+        // the replaced object is gone
+        if (file_to_remove)
+            const_cast<TypeDir*>(dir_parent)->removeFile(*file_to_remove);
         rval = -EINVAL;
     } else {
         file_to_upload.setId(f->item_id);
         file_to_upload.setParent(f->parent_id);
         file_to_upload.setStorage(f->storage_id);
         file_to_upload.setName(std::string(f->filename));
+        file_to_upload.setSize(f->filesize);
         file_to_upload.setModificationDate(file_stat.st_mtime);
         if (file_to_remove)
             const_cast<TypeDir*>(dir_parent)->replaceFile(*file_to_remove, file_to_upload);
         else
             const_cast<TypeDir*>(dir_parent)->addFile(file_to_upload);
+        negativeRemove(dir_parent, file_to_upload.name());
     }
     free(static_cast<void*>(f->filename));
     free(static_cast<void*>(f));
@@ -621,12 +2436,148 @@ int MTPDevice::filePush(const std::string &src, const std::string &dst)
     return rval;
 }
 
+void MTPDevice::filePushAsync(const std::shared_ptr<ObjectUpload> &upload)
+{
+    std::lock_guard<std::mutex> lock(m_upload_mutex);
+    m_uploads.push_back(upload);
+    if (!m_upload_thread.joinable()) {
+        m_upload_stop = false;
+        m_upload_thread = std::thread(&MTPDevice::uploadWorker, this);
+    }
+    m_upload_cv.notify_one();
+}
+
+void MTPDevice::uploadStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_upload_mutex);
+        m_upload_stop = true;
+        if (m_upload_current)
+            m_upload_current->cancel();
+    }
+    m_upload_cv.notify_all();
+    if (m_upload_thread.joinable())
+        m_upload_thread.join();
+}
+
+void MTPDevice::uploadWorker()
+{
+    std::unique_lock<std::mutex> lock(m_upload_mutex);
+    while (!m_upload_stop) {
+        if (m_uploads.empty()) {
+            m_upload_cv.wait(lock);
+            continue;
+        }
+
+        m_upload_current = m_uploads.front();
+        m_uploads.pop_front();
+        lock.unlock();
+        {
+            Epoch::Section section;
+            uploadRun(*m_upload_current);
+        }
+        lock.lock();
+        m_upload_current.reset();
+    }
+
+    for (auto &upload : m_uploads)
+        upload->finish(-EIO);
+    m_uploads.clear();
+}
+
+uint16_t MTPDevice::uploadGet(void *params, void *priv, uint32_t wantlen,
+    unsigned char *data, uint32_t *gotlen)
+{
+    ObjectUpload *upload = static_cast<ObjectUpload*>(priv);
+    if (!upload->get(data, wantlen, *gotlen))
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+    return LIBMTP_HANDLER_RETURN_OK;
+}
+
+void MTPDevice::uploadRun(ObjectUpload &upload)
+{
+    if (upload.isCancelled()) {
+        upload.finish(-ECANCELED);
+        return;
+    }
+
+    const std::string dst(upload.path());
+    const std::string dst_basename(smtpfs_basename(dst));
+    const std::string dst_dirname(smtpfs_dirname(dst));
+    const TypeDir *dir_parent = dirFetchContent(dst_dirname);
+    if (!dir_parent) {
+        upload.finish(-ENOENT);
+        return;
+    }
+    std::unique_ptr<const TypeFile> file_to_remove = dir_parent->file(dst_basename);
+
+    logmsg("Started streaming '", dst, "'.\n");
+    if (file_to_remove) {
+        criticalEnter();
+        int rval = LIBMTP_Delete_Object(m_device, file_to_remove->id());
+        criticalLeave();
+        m_write_back.discard(file_to_remove->id());
+        m_edit_sessions.drop(file_to_remove->id());
+        contentInvalidate(file_to_remove->id());
+        if (rval != 0) {
+            // the old object is still there, the staged copy replaces it
+            logerr("Can not replace '", dst, "'.\n");
+            upload.finish(-EIO);
+            return;
+        }
+        // the replaced object is gone whether the stream succeeds or not
+        const_cast<TypeDir*>(dir_parent)->removeFile(*file_to_remove);
+    }
+
+    // the device learns the size of an unsized stream from its end
+    TypeFile file_to_upload(0, dir_parent->id(), dir_parent->storageid(),
+        dst_basename, upload.isSized() ? upload.size() : LIBMTP_FILESIZE_UNKNOWN, 0);
+    LIBMTP_file_t *f = file_to_upload.toLIBMTPFile();
+    criticalEnter();
+    upload.start([this]() { return m_device_waiters > 0; });
+    int rval = LIBMTP_Send_File_From_Handler(m_device, &MTPDevice::uploadGet,
+        &upload, f, nullptr, nullptr);
+    // do not leave a truncated object behind
+    if (rval != 0 && f->item_id != 0)
+        LIBMTP_Delete_Object(m_device, f->item_id);
+    if (rval != 0 && !upload.isCancelled())
+        LIBMTP_Dump_Errorstack(m_device);
+    if (rval != 0)
+        LIBMTP_Clear_Errorstack(m_device);
+    criticalLeave();
+
+    if (rval != 0) {
+        if (!upload.isCancelled() && !upload.isSized()) {
+            logmsg("Device refused a stream of unknown size.\n");
+            m_upload_unsized = false;
+        }
+        if (!upload.isCancelled())
+            logerr("Could not stream file '", dst, "'.\n");
+        upload.finish(upload.isCancelled() ? -ECANCELED : -EIO);
+    } else {
+        file_to_upload.setId(f->item_id);
+        file_to_upload.setParent(f->parent_id);
+        file_to_upload.setStorage(f->storage_id);
+        file_to_upload.setName(std::string(f->filename));
+        file_to_upload.setSize(f->filesize);
+        file_to_upload.setModificationDate(time(nullptr));
+        const_cast<TypeDir*>(dir_parent)->addFile(file_to_upload);
+        negativeRemove(dir_parent, file_to_upload.name());
+        upload.finish(0);
+        logmsg("File '", dst, "' streamed.\n");
+    }
+    free(static_cast<void*>(f->filename));
+    free(static_cast<void*>(f));
+}
+
 int MTPDevice::fileRemove(const std::string &path)
 {
+    pushDrop(path);
+
     const std::string tmp_basename(smtpfs_basename(path));
     const std::string tmp_dirname(smtpfs_dirname(path));
     const TypeDir *dir_parent = dirFetchContent(tmp_dirname);
-    const TypeFile *file_to_remove = dir_parent ? dir_parent->file(tmp_basename) : nullptr;
+    std::unique_ptr<const TypeFile> file_to_remove = dir_parent ? dir_parent->file(tmp_basename) : nullptr;
     if (!dir_parent || !file_to_remove) {
         logerr("No such file '", path, "' to remove.\n");
         return -ENOENT;
@@ -634,6 +2585,9 @@ int MTPDevice::fileRemove(const std::string &path)
     criticalEnter();
     int rval = LIBMTP_Delete_Object(m_device, file_to_remove->id());
     criticalLeave();
+    m_write_back.discard(file_to_remove->id());
+    m_edit_sessions.drop(file_to_remove->id());
+    contentInvalidate(file_to_remove->id());
     if (rval != 0) {
         logerr("Could not remove the directory '", path, "'.\n");
         return -EINVAL;
@@ -650,7 +2604,7 @@ int MTPDevice::fileRename(const std::string &oldpath, const std::string &newpath
     const std::string tmp_new_basename(smtpfs_basename(newpath));
     const std::string tmp_new_dirname(smtpfs_dirname(newpath));
     const TypeDir *dir_parent = dirFetchContent(tmp_old_dirname);
-    const TypeFile *file_to_rename = dir_parent ? dir_parent->file(tmp_old_basename) : nullptr;
+    std::unique_ptr<const TypeFile> file_to_rename = dir_parent ? dir_parent->file(tmp_old_basename) : nullptr;
     if (!dir_parent || !file_to_rename || tmp_old_dirname != tmp_new_dirname) {
         logerr("Can not rename '", oldpath, "' to '", tmp_new_basename, "'.\n");
         return -EINVAL;
@@ -668,11 +2622,41 @@ int MTPDevice::fileRename(const std::string &oldpath, const std::string &newpath
         LIBMTP_Clear_Errorstack(m_device);
         return -EINVAL;
     }
-    const_cast<TypeFile*>(file_to_rename)->setName(tmp_new_basename);
+    const_cast<TypeDir*>(dir_parent)->renameFile(tmp_old_basename, tmp_new_basename);
+    negativeRemove(dir_parent, tmp_new_basename);
     logmsg("File '", oldpath, "' renamed to '", tmp_new_basename, "'.\n");
     return 0;
 }
 
+int MTPDevice::fileThumbnail(const std::string &path, ThumbnailCache::Data &thumb)
+{
+    const std::string path_basename(smtpfs_basename(path));
+    const std::string path_dirname(smtpfs_dirname(path));
+    const TypeDir *dir_parent = dirFetchContent(path_dirname);
+    std::unique_ptr<const TypeFile> file = dir_parent ? dir_parent->file(path_basename) : nullptr;
+    if (!file)
+        return -ENOENT;
+
+    const uint32_t id = file->id();
+    thumb = m_thumbnail_cache.get(id);
+    if (!thumb) {
+        unsigned char *data = nullptr;
+        unsigned int size = 0;
+        criticalEnter();
+        int rval = LIBMTP_Get_Thumbnail(m_device, id, &data, &size);
+        if (rval != 0)
+            LIBMTP_Clear_Errorstack(m_device);
+        criticalLeave();
+
+        if (rval != 0 || !data)
+            size = 0;
+        thumb = std::make_shared<const std::vector<unsigned char>>(data, data + size);
+        free(static_cast<void*>(data));
+        m_thumbnail_cache.put(id, thumb);
+    }
+    return thumb->empty() ? -ENOENT : 0;
+}
+
 MTPDevice::Capabilities MTPDevice::getCapabilities() const
 {
     return m_capabilities;
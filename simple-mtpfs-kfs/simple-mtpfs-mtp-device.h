@@ -18,16 +18,34 @@
 #ifndef SMTPFS_MTP_DEVICE_H
 #define SMTPFS_MTP_DEVICE_H
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <stack>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 extern "C" {
 #  include <libmtp.h>
 }
+#include "simple-mtpfs-block-cache.h"
+#include "simple-mtpfs-content-cache.h"
+#include "simple-mtpfs-edit-sessions.h"
+#include "simple-mtpfs-object-download.h"
+#include "simple-mtpfs-object-index.h"
+#include "simple-mtpfs-object-upload.h"
+#include "simple-mtpfs-read-ahead.h"
+#include "simple-mtpfs-thumbnail-cache.h"
 #include "simple-mtpfs-type-dir.h"
 #include "simple-mtpfs-type-file.h"
+#include "simple-mtpfs-write-back.h"
 
 class MTPDevice
 {
@@ -66,6 +84,20 @@ public:
     bool connect(const std::string &dev_file);
     void disconnect();
 
+    void prefetchStart();
+    void prefetchStop();
+
+    void snapshotLoad();
+    void snapshotSave();
+
+    void contentCacheOpen();
+
+    void eventStart();
+    void eventStop();
+
+    void memoryUsage(size_t &objects, size_t &bytes) const;
+    void logMemoryUsage() const;
+
     uint64_t storageTotalSize() const;
     uint64_t storageFreeSize() const;
     LIBMTP_devicestorage_t *getStorage() {return m_device->storage; }
@@ -78,22 +110,155 @@ public:
 
     int rename(const std::string &oldpath, const std::string &newpath);
 
+    bool negativeLookup(const std::string &path);
+    void negativeInsert(const std::string &path);
+
     int fileRead(const std::string &path, char *buf, size_t size, off_t offset);
     int fileWrite(const std::string &path, const char *buf, size_t size, off_t offset);
+    int fileFlush(const std::string &path);
+    int fileTruncate(const std::string &path, uint64_t size);
     int filePull(const std::string &src, const std::string &dst);
+    int filePullAsync(const std::string &src, const std::string &dst,
+        std::shared_ptr<ObjectDownload> &download);
     int filePush(const std::string &src, const std::string &dst);
+    void filePushQueued(const std::string &src, const std::string &dst);
+    int fileSync();
+    void filePushAsync(const std::shared_ptr<ObjectUpload> &upload);
+    // Until the device refuses one, streams may start before their size is
+    // known.
+    bool canStreamUnsized() const { return m_upload_unsized; }
     int fileRemove(const std::string &path);
     int fileRename(const std::string &oldpath, const std::string &newpath);
+    int fileThumbnail(const std::string &path, ThumbnailCache::Data &thumb);
 
     Capabilities getCapabilities() const;
 
     static bool listDevices(bool verbose, const std::string &dev_file);
 
 private:
-    void criticalEnter() { m_device_mutex.lock(); }
+    // A partial read waiting for or holding the device. Reads of the same
+    // object that overlap or adjoin it join it while it waits, so that they
+    // cost one transfer.
+    struct PendingRead
+    {
+        uint32_t id;
+        uint64_t file_size;
+        uint64_t offset;
+        uint64_t end;
+        unsigned int joiners;
+        bool started;
+        bool direct;
+        bool done;
+        int rval;
+        std::vector<unsigned char> data;
+    };
+
+    // A staged file waiting to replace its object. The entry the tree had
+    // before the push is restored if the object could not be replaced.
+    struct PendingPush
+    {
+        std::string src;
+        std::string dst;
+        std::shared_ptr<const TypeFile> original;
+        int attempts;
+    };
+
+    // Objects of a listed subtree, by parent id.
+    typedef std::unordered_map<uint32_t, std::vector<LIBMTP_file_t*>> PrefetchChildren;
+
+    void criticalEnter()
+    {
+        ++m_device_waiters;
+        m_device_mutex.lock();
+        --m_device_waiters;
+    }
     void criticalLeave() { m_device_mutex.unlock(); }
 
     bool enumStorages();
+    bool serialFetch();
+    void rootFetch();
+    void dirFetch(TypeDir *dir);
+    void dirRevalidate(TypeDir *dir);
+    void dirMerge(TypeDir *dir, const std::vector<LIBMTP_file_t*> &entries);
+    bool dirPrune(TypeDir *dir, const std::unordered_set<uint32_t> &ids, bool prune_dirs);
+    bool dirClaim(TypeDir *dir, bool wait_prefetch);
+    bool dirBelow(const TypeDir *dir, uint32_t top_id);
+    void dirRelease(TypeDir *dir);
+
+    void prefetchWorker();
+    void prefetchStorage(TypeDir *storage_dir);
+    bool prefetchSubtree(TypeDir *dir);
+    void prefetchFill(TypeDir *top, uint32_t top_id, PrefetchChildren &children);
+    void prefetchWalk(TypeDir *dir);
+    void prefetchWait(uint32_t storage_id);
+    std::string devicePath(const std::string &path) const;
+
+    static void eventCallback(int ret, LIBMTP_event_t event, uint32_t param,
+        void *user_data);
+    void eventWorker();
+    void eventQueue(LIBMTP_event_t event, uint32_t param);
+    void eventReplay();
+    uint32_t eventStorage(LIBMTP_event_t event, uint32_t param);
+    void eventHandle(LIBMTP_event_t event, uint32_t param);
+    void eventObjectAdded(uint32_t id);
+    void eventObjectRemoved(uint32_t id);
+    void eventObjectChanged(uint32_t id);
+    void eventStoreAdded(uint32_t storage_id);
+    void eventStoreRemoved(uint32_t storage_id);
+    TypeDir *storageFind(uint32_t storage_id, TypeDir *&parent);
+    TypeDir *dirFind(uint32_t storage_id, uint32_t id);
+    TypeDir *dirFindParent(uint32_t id, bool &is_dir);
+
+    TypeDir *pathCacheLookup(const std::string &path);
+    uint64_t pathCacheGeneration();
+    void pathCacheInsert(const std::string &path, TypeDir *dir,
+        uint64_t generation);
+    // Start a change which removes or moves directories; until the matching
+    // pathCacheResume() nothing is cached.
+    void pathCacheRemove(const std::string &path);
+    void pathCacheClear();
+    void pathCacheResume();
+
+    const TypeDir *negativeParent(const std::string &path);
+    void negativeRemove(const TypeDir *parent, const std::string &name);
+    static std::string negativeKey(const TypeDir *parent, const std::string &name);
+
+    void downloadStop();
+    void downloadWorker();
+    void downloadRun(ObjectDownload &download);
+    static uint16_t downloadPut(void *params, void *priv, uint32_t sendlen,
+        unsigned char *data, uint32_t *putlen);
+
+    int renameObject(const std::string &oldpath, const std::string &newpath);
+    int fileUpload(const std::string &src, const std::string &dst);
+    bool pushPending(const std::string &path) const;
+    void pushWait(const std::string &path);
+    void pushDrop(const std::string &path);
+    std::deque<PendingPush> pushTake(const std::string &path);
+    void pushRestore(const std::deque<PendingPush> &pushes,
+        const std::string &oldpath, const std::string &newpath);
+    static bool isBelow(const std::string &path, const std::string &dir);
+    void pushStop();
+    void pushWorker();
+    void pushGiveUp(const PendingPush &push);
+
+    void uploadStop();
+    void uploadWorker();
+    void uploadRun(ObjectUpload &upload);
+    static uint16_t uploadGet(void *params, void *priv, uint32_t wantlen,
+        unsigned char *data, uint32_t *gotlen);
+
+    int objectRead(uint32_t storage_id, uint32_t id, uint64_t file_size,
+        uint64_t offset, uint32_t size, unsigned char *buf);
+    int objectFetch(uint32_t id, uint64_t file_size, uint64_t offset,
+        uint32_t size, unsigned char *buf);
+    int objectCopy(const PendingRead &read, uint64_t offset, uint32_t size,
+        unsigned char *buf);
+    int objectWrite(uint32_t id, uint64_t offset, const unsigned char *data,
+        uint32_t size);
+    int objectEditBegin(uint32_t id);
+    int objectEditEnd(uint32_t id);
+    void contentInvalidate(uint32_t id);
 
     static Capabilities getCapabilities(const MTPDevice &device);
     bool connect_priv(int dev_no, const std::string &dev_file);
@@ -102,8 +267,103 @@ private:
     LIBMTP_mtpdevice_t *m_device;
     Capabilities m_capabilities;
     std::mutex m_device_mutex;
+    // Threads blocked in criticalEnter(); a stream yields the device to them.
+    std::atomic<int> m_device_waiters;
+    ObjectIndex m_object_index;
     TypeDir m_root_dir;
+    std::string m_root_prefix;
+    std::unordered_map<std::string, TypeDir*> m_path_cache;
+    std::shared_timed_mutex m_path_cache_mutex;
+    uint64_t m_path_cache_generation;
+    uint32_t m_path_cache_removals;
+
+    // Names known to be missing from listed directories, keyed by the
+    // storage and object id of the parent, most recently used first.
+    std::list<std::string> m_negative_lru;
+    std::unordered_map<std::string, std::list<std::string>::iterator> m_negative_cache;
+    std::mutex m_negative_mutex;
+
+    // Directory listing state, shared with the prefetch worker.
+    std::mutex m_fetch_mutex;
+    std::condition_variable m_fetch_cv;
+    std::unordered_set<const TypeDir*> m_fetching;
+    // The folder whose subtree the prefetch is scanning, 0 if none.
+    uint32_t m_prefetch_subtree;
+    // Cleared once the device failed to list a subtree; used by the
+    // prefetch worker only.
+    bool m_prefetch_subtrees;
+    // Storages whose nodes the prefetch worker may still hold.
+    std::unordered_set<uint32_t> m_prefetch_held;
+    std::thread m_prefetch_thread;
+    std::atomic<bool> m_prefetch_stop;
+
+    // Device events, queued by the callback and applied by the listener.
+    std::mutex m_event_mutex;
+    std::vector<std::pair<LIBMTP_event_t, uint32_t>> m_events;
+    std::thread m_event_thread;
+    std::atomic<bool> m_event_stop;
+    bool m_event_pending;
+    bool m_event_error;
+    // Events about storages held by the prefetch, by storage; events of
+    // unknown storage are kept under 0. Used by the listener only.
+    std::map<uint32_t, std::vector<std::pair<LIBMTP_event_t, uint32_t>>> m_events_deferred;
+
+    // Object content, read ahead for sequential readers and cached in
+    // blocks for the others.
+    ReadAhead m_read_ahead;
+    BlockCache m_block_cache;
+    ThumbnailCache m_thumbnail_cache;
+    ContentCache m_content_cache;
+
+    // Partial writes not sent to the device yet, and the edit sessions of
+    // the objects they go to.
+    WriteBack m_write_back;
+    EditSessions m_edit_sessions;
+
+    // Objects pulled into temporary files in the background, in the order
+    // they were asked for.
+    std::mutex m_download_mutex;
+    std::condition_variable m_download_cv;
+    std::deque<std::shared_ptr<ObjectDownload>> m_downloads;
+    std::shared_ptr<ObjectDownload> m_download_current;
+    std::thread m_download_thread;
+    bool m_download_stop;
+
+    // New objects streamed to the device as they are written.
+    std::mutex m_upload_mutex;
+    std::condition_variable m_upload_cv;
+    std::deque<std::shared_ptr<ObjectUpload>> m_uploads;
+    std::shared_ptr<ObjectUpload> m_upload_current;
+    std::thread m_upload_thread;
+    bool m_upload_stop;
+    std::atomic<bool> m_upload_unsized;
+
+    // Staged files waiting to replace their objects, in the order they were
+    // closed. A failed push is retried s_push_attempts times; m_push_error
+    // keeps the first error since the last sync.
+    std::mutex m_push_mutex;
+    std::condition_variable m_push_cv;
+    std::deque<PendingPush> m_pushes;
+    std::string m_push_current;
+    std::thread m_push_thread;
+    bool m_push_stop;
+    int m_push_error;
+
+    // Partial reads in flight.
+    std::mutex m_read_mutex;
+    std::condition_variable m_read_cv;
+    std::list<std::shared_ptr<PendingRead>> m_reads;
+
+    // Metadata snapshots and cached content are keyed by the device
+    // serial number.
+    bool m_snapshot;
+    std::string m_serial;
+
     static uint32_t s_root_node;
+    static const size_t s_negative_cache_size = 4096;
+    static const uint32_t s_max_coalesced_read = 16 * 1024 * 1024;
+    static const size_t s_max_pushes = 32;
+    static const int s_push_attempts = 3;
 };
 
 #endif // SMTPFS_MTP_DEVICE_H
@@ -0,0 +1,150 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <cstring>
+#include "simple-mtpfs-name-pool.h"
+
+// Each entry is laid out as a 16-bit length, the name and a NUL byte.
+static const size_t s_header_size = sizeof(uint16_t);
+
+NamePool::NamePool():
+    m_mutex(),
+    m_chunks(new char*[s_max_chunks]),
+    m_chunk_count(0),
+    m_chunk_used(s_chunk_size),
+    m_table(1024, 0),
+    m_count(0)
+{
+    // The empty name goes first, so a zeroed handle refers to it.
+    insert("", 0);
+}
+
+NamePool &NamePool::instance()
+{
+    // Never destroyed; names may still be needed while other static
+    // objects are torn down at exit.
+    static NamePool *pool = new NamePool();
+    return *pool;
+}
+
+uint32_t NamePool::hash(const char *name, size_t length)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= static_cast<unsigned char>(name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+const char *NamePool::str(uint32_t handle)
+{
+    const NamePool &pool = instance();
+    return pool.m_chunks[handle / s_chunk_size] + handle % s_chunk_size + s_header_size;
+}
+
+size_t NamePool::length(uint32_t handle)
+{
+    const NamePool &pool = instance();
+    uint16_t len;
+    memcpy(&len, pool.m_chunks[handle / s_chunk_size] + handle % s_chunk_size,
+        sizeof(len));
+    return len;
+}
+
+bool NamePool::equals(uint32_t handle, const char *name, size_t len)
+{
+    return length(handle) == len && memcmp(str(handle), name, len) == 0;
+}
+
+uint32_t NamePool::intern(const char *name, size_t length)
+{
+    // Longer names can not come from a device; cut them rather than fail.
+    if (length > UINT16_MAX)
+        length = UINT16_MAX;
+
+    NamePool &pool = instance();
+    std::lock_guard<std::mutex> lock(pool.m_mutex);
+    const size_t mask = pool.m_table.size() - 1;
+    for (size_t i = hash(name, length) & mask; ; i = (i + 1) & mask) {
+        const uint32_t slot = pool.m_table[i];
+        if (slot == 0)
+            break;
+        if (equals(slot - 1, name, length))
+            return slot - 1;
+    }
+    return pool.insert(name, length);
+}
+
+uint32_t NamePool::insert(const char *name, size_t len)
+{
+    const size_t entry_size = s_header_size + len + 1;
+    if (m_chunk_used + entry_size > s_chunk_size) {
+        m_chunks[m_chunk_count++] = new char[s_chunk_size];
+        m_chunk_used = 0;
+    }
+
+    char *entry = m_chunks[m_chunk_count - 1] + m_chunk_used;
+    const uint16_t len16 = static_cast<uint16_t>(len);
+    memcpy(entry, &len16, sizeof(len16));
+    memcpy(entry + s_header_size, name, len);
+    entry[s_header_size + len] = '\0';
+
+    const uint32_t handle = static_cast<uint32_t>(
+        (m_chunk_count - 1) * s_chunk_size + m_chunk_used);
+    m_chunk_used += entry_size;
+
+    if (++m_count * 2 > m_table.size())
+        grow();
+    const size_t mask = m_table.size() - 1;
+    size_t i = hash(name, len) & mask;
+    while (m_table[i] != 0)
+        i = (i + 1) & mask;
+    m_table[i] = handle + 1;
+    return handle;
+}
+
+void NamePool::grow()
+{
+    std::vector<uint32_t> table(m_table.size() * 2, 0);
+    const size_t mask = table.size() - 1;
+    for (uint32_t slot : m_table) {
+        if (slot == 0)
+            continue;
+        size_t i = hash(slot - 1) & mask;
+        while (table[i] != 0)
+            i = (i + 1) & mask;
+        table[i] = slot;
+    }
+    m_table.swap(table);
+}
+
+size_t NamePool::count()
+{
+    NamePool &pool = instance();
+    std::lock_guard<std::mutex> lock(pool.m_mutex);
+    return pool.m_count;
+}
+
+size_t NamePool::memoryUsage()
+{
+    NamePool &pool = instance();
+    std::lock_guard<std::mutex> lock(pool.m_mutex);
+    return pool.m_chunk_count * s_chunk_size +
+        pool.m_table.size() * sizeof(uint32_t);
+}
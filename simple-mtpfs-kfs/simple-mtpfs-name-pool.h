@@ -0,0 +1,66 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_NAME_POOL_H
+#define SMTPFS_NAME_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Interned object names. Every distinct name is stored once, length
+// prefixed and NUL terminated, in append-only chunks, and is referred to
+// by a 32-bit handle which stays valid for the lifetime of the process.
+// Handle 0 is the empty name.
+class NamePool
+{
+public:
+    static uint32_t intern(const char *name, size_t length);
+    static uint32_t intern(const std::string &name) { return intern(name.data(), name.size()); }
+    static const char *str(uint32_t handle);
+    static size_t length(uint32_t handle);
+    static bool equals(uint32_t handle, const char *name, size_t length);
+
+    static uint32_t hash(const char *name, size_t length);
+    static uint32_t hash(uint32_t handle) { return hash(str(handle), length(handle)); }
+
+    static size_t count();
+    static size_t memoryUsage();
+
+private:
+    NamePool();
+    static NamePool &instance();
+
+    uint32_t insert(const char *name, size_t length);
+    void grow();
+
+    static const size_t s_chunk_size = 256 * 1024;
+    static const size_t s_max_chunks = (size_t(1) << 32) / s_chunk_size;
+
+    std::mutex m_mutex;
+    std::unique_ptr<char*[]> m_chunks;
+    size_t m_chunk_count;
+    size_t m_chunk_used;
+    // Open addressing table of handle + 1, 0 marks an empty slot.
+    std::vector<uint32_t> m_table;
+    size_t m_count;
+};
+
+#endif // SMTPFS_NAME_POOL_H
@@ -0,0 +1,311 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_NODE_ARENA_H
+#define SMTPFS_NODE_ARENA_H
+
+#include <cstddef>
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Packed storage for the children of a directory. Nodes live in segments
+// which are never moved, so a node keeps its address until it is erased,
+// and are referred to by 32-bit indices. Segments grow geometrically up to
+// s_max_segment nodes; erased slots are reused by later insertions.
+// Retired nodes are taken out like erased ones, but stay in place until
+// they are reclaimed or the arena is cleared.
+template <typename T>
+class NodeArena
+{
+public:
+    NodeArena(): m_segments(), m_live(), m_free(), m_retired(), m_capacity(0), m_size(0) {}
+    NodeArena(const NodeArena &copy): NodeArena() { *this = copy; }
+    ~NodeArena() { clear(); }
+
+    NodeArena &operator =(const NodeArena &rhs);
+
+    uint32_t insert(const T &value);
+    void erase(uint32_t index);
+    void retire(uint32_t index);
+    void reclaim(uint32_t index);
+    void clear();
+
+    T &operator [](uint32_t index) { return *slot(index); }
+    const T &operator [](uint32_t index) const { return *slot(index); }
+
+    uint32_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_t memoryUsage() const;
+
+    template <typename F> void forEach(F func) const;
+
+private:
+    static const uint32_t s_first_segment = 8;
+    static const uint32_t s_max_segment = 1024;
+
+    T *slot(uint32_t index) const;
+    uint32_t append();
+
+    std::vector<T*> m_segments;
+    std::vector<bool> m_live;
+    std::vector<uint32_t> m_free;
+    std::vector<uint32_t> m_retired;
+    uint32_t m_capacity;
+    uint32_t m_size;
+};
+
+// Open addressing index from a name hash to a node index. Hashes may
+// collide; the caller tells the nodes apart by comparing their names.
+class NameIndex
+{
+public:
+    static const uint32_t npos = UINT32_MAX;
+
+    NameIndex(): m_slots(), m_count(0) {}
+
+    template <typename Match> uint32_t find(uint32_t hash, Match match) const;
+    void insert(uint32_t hash, uint32_t index);
+    void erase(uint32_t hash, uint32_t index);
+    void clear() { m_slots.clear(); m_count = 0; }
+    size_t memoryUsage() const { return m_slots.capacity() * sizeof(Slot); }
+
+private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t index; // node index + 1, 0 marks an empty slot
+    };
+
+    void grow();
+
+    std::vector<Slot> m_slots;
+    uint32_t m_count;
+};
+
+template <typename T>
+T *NodeArena<T>::slot(uint32_t index) const
+{
+    size_t segment = 0;
+    uint32_t size = s_first_segment;
+    while (index >= size && size < s_max_segment) {
+        index -= size;
+        size *= 2;
+        ++segment;
+    }
+    segment += index / size;
+    return m_segments[segment] + index % size;
+}
+
+template <typename T>
+uint32_t NodeArena<T>::append()
+{
+    const uint32_t index = static_cast<uint32_t>(m_live.size());
+    if (index == m_capacity) {
+        uint32_t size = s_first_segment;
+        for (size_t i = 0; i < m_segments.size() && size < s_max_segment; ++i)
+            size *= 2;
+        m_segments.push_back(static_cast<T*>(::operator new(size * sizeof(T))));
+        m_capacity += size;
+    }
+    m_live.push_back(false);
+    return index;
+}
+
+template <typename T>
+uint32_t NodeArena<T>::insert(const T &value)
+{
+    uint32_t index;
+    if (!m_free.empty()) {
+        index = m_free.back();
+        m_free.pop_back();
+    } else {
+        index = append();
+    }
+    new (slot(index)) T(value);
+    m_live[index] = true;
+    ++m_size;
+    return index;
+}
+
+template <typename T>
+void NodeArena<T>::erase(uint32_t index)
+{
+    if (index >= m_live.size() || !m_live[index])
+        return;
+    slot(index)->~T();
+    m_live[index] = false;
+    m_free.push_back(index);
+    --m_size;
+}
+
+template <typename T>
+void NodeArena<T>::retire(uint32_t index)
+{
+    if (index >= m_live.size() || !m_live[index])
+        return;
+    m_live[index] = false;
+    m_retired.push_back(index);
+    --m_size;
+}
+
+template <typename T>
+void NodeArena<T>::reclaim(uint32_t index)
+{
+    auto it = std::find(m_retired.begin(), m_retired.end(), index);
+    if (it == m_retired.end())
+        return;
+    *it = m_retired.back();
+    m_retired.pop_back();
+    slot(index)->~T();
+    m_free.push_back(index);
+}
+
+template <typename T>
+void NodeArena<T>::clear()
+{
+    for (uint32_t i = 0; i < m_live.size(); ++i) {
+        if (m_live[i])
+            slot(i)->~T();
+    }
+    for (uint32_t i : m_retired)
+        slot(i)->~T();
+    for (T *segment : m_segments)
+        ::operator delete(segment);
+    m_segments.clear();
+    m_live.clear();
+    m_free.clear();
+    m_retired.clear();
+    m_capacity = 0;
+    m_size = 0;
+}
+
+template <typename T>
+NodeArena<T> &NodeArena<T>::operator =(const NodeArena &rhs)
+{
+    if (this == &rhs)
+        return *this;
+
+    // Keep the indices, so that a copied name index stays valid.
+    clear();
+    for (uint32_t i = 0; i < rhs.m_live.size(); ++i) {
+        append();
+        if (!rhs.m_live[i])
+            continue;
+        new (slot(i)) T(rhs[i]);
+        m_live[i] = true;
+        ++m_size;
+    }
+    m_free = rhs.m_free;
+    m_free.insert(m_free.end(), rhs.m_retired.begin(), rhs.m_retired.end());
+    return *this;
+}
+
+template <typename T>
+size_t NodeArena<T>::memoryUsage() const
+{
+    return m_capacity * sizeof(T) + m_segments.capacity() * sizeof(T*) +
+        m_live.capacity() / 8 + (m_free.capacity() + m_retired.capacity()) *
+        sizeof(uint32_t);
+}
+
+template <typename T>
+template <typename F>
+void NodeArena<T>::forEach(F func) const
+{
+    for (uint32_t i = 0; i < m_live.size(); ++i) {
+        if (m_live[i])
+            func(i, *slot(i));
+    }
+}
+
+template <typename Match>
+uint32_t NameIndex::find(uint32_t hash, Match match) const
+{
+    if (m_slots.empty())
+        return npos;
+
+    const size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; m_slots[i].index != 0; i = (i + 1) & mask) {
+        if (m_slots[i].hash == hash && match(m_slots[i].index - 1))
+            return m_slots[i].index - 1;
+    }
+    return npos;
+}
+
+inline void NameIndex::insert(uint32_t hash, uint32_t index)
+{
+    if ((m_count + 1) * 4 > m_slots.size() * 3)
+        grow();
+
+    const size_t mask = m_slots.size() - 1;
+    size_t i = hash & mask;
+    while (m_slots[i].index != 0)
+        i = (i + 1) & mask;
+    m_slots[i].hash = hash;
+    m_slots[i].index = index + 1;
+    ++m_count;
+}
+
+inline void NameIndex::erase(uint32_t hash, uint32_t index)
+{
+    if (m_slots.empty())
+        return;
+
+    const size_t mask = m_slots.size() - 1;
+    size_t i = hash & mask;
+    while (m_slots[i].index != index + 1) {
+        if (m_slots[i].index == 0)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    // Shift the following entries back instead of leaving a tombstone.
+    size_t j = i;
+    for (;;) {
+        m_slots[i].index = 0;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (m_slots[j].index == 0) {
+                --m_count;
+                return;
+            }
+            const size_t home = m_slots[j].hash & mask;
+            if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+                break;
+        }
+        m_slots[i] = m_slots[j];
+        i = j;
+    }
+}
+
+inline void NameIndex::grow()
+{
+    std::vector<Slot> slots(m_slots.empty() ? 8 : m_slots.size() * 2, Slot{0, 0});
+    const size_t mask = slots.size() - 1;
+    for (const Slot &s : m_slots) {
+        if (s.index == 0)
+            continue;
+        size_t i = s.hash & mask;
+        while (slots[i].index != 0)
+            i = (i + 1) & mask;
+        slots[i] = s;
+    }
+    m_slots.swap(slots);
+}
+
+#endif // SMTPFS_NODE_ARENA_H
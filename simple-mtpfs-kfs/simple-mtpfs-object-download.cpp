@@ -0,0 +1,82 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <cerrno>
+#include "simple-mtpfs-object-download.h"
+
+ObjectDownload::ObjectDownload(const std::string &path, uint32_t storage_id,
+        uint32_t id, uint64_t size, time_t modif_date,
+        const std::string &path_tmp):
+    m_path(path),
+    m_storage_id(storage_id),
+    m_id(id),
+    m_size(size),
+    m_modif_date(modif_date),
+    m_path_tmp(path_tmp),
+    m_mutex(),
+    m_cv(),
+    m_landed(0),
+    m_done(false),
+    m_error(0),
+    m_cancelled(false)
+{
+}
+
+int ObjectDownload::wait(uint64_t end)
+{
+    if (end > m_size)
+        end = m_size;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [&]() { return m_done || m_landed >= end; });
+    if (m_landed >= end)
+        return 0;
+    return m_error ? m_error : -EIO;
+}
+
+uint64_t ObjectDownload::landed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_landed;
+}
+
+bool ObjectDownload::isDone() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_done;
+}
+
+void ObjectDownload::addLanded(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_landed += bytes;
+    }
+    m_cv.notify_all();
+}
+
+void ObjectDownload::finish(int error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done = true;
+        m_error = error;
+        if (!error && m_landed < m_size)
+            m_error = -EIO;
+    }
+    m_cv.notify_all();
+}
@@ -0,0 +1,74 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_OBJECT_DOWNLOAD_H
+#define SMTPFS_OBJECT_DOWNLOAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+
+// An object being pulled into a temporary file in the background. The
+// download worker reports how many bytes have landed in the file, readers
+// wait until the range they need is there.
+class ObjectDownload
+{
+public:
+    ObjectDownload(const std::string &path, uint32_t storage_id, uint32_t id,
+        uint64_t size, time_t modif_date, const std::string &path_tmp);
+
+    std::string path() const { return m_path; }
+    uint32_t storageId() const { return m_storage_id; }
+    uint32_t id() const { return m_id; }
+    uint64_t size() const { return m_size; }
+    time_t modificationDate() const { return m_modif_date; }
+    std::string pathTmp() const { return m_path_tmp; }
+
+    // Waits until the first end bytes of the object have landed; returns
+    // 0, or a negative errno if the download failed short of them.
+    int wait(uint64_t end);
+    int waitDone() { return wait(m_size); }
+    uint64_t landed() const;
+    bool isDone() const;
+
+    void cancel() { m_cancelled = true; }
+    bool isCancelled() const { return m_cancelled; }
+
+    // Called by the download worker.
+    void addLanded(uint64_t bytes);
+    void finish(int error);
+
+private:
+    const std::string m_path;
+    const uint32_t m_storage_id;
+    const uint32_t m_id;
+    const uint64_t m_size;
+    const time_t m_modif_date;
+    const std::string m_path_tmp;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    uint64_t m_landed;
+    bool m_done;
+    int m_error;
+    std::atomic<bool> m_cancelled;
+};
+
+#endif // SMTPFS_OBJECT_DOWNLOAD_H
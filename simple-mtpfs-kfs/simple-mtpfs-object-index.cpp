@@ -0,0 +1,61 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include "simple-mtpfs-object-index.h"
+
+ObjectIndex::ObjectIndex():
+    m_mutex(),
+    m_objects()
+{
+}
+
+void ObjectIndex::insert(uint32_t id, TypeDir *parent, TypeDir *dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_objects[id] = Entry{parent, dir};
+}
+
+void ObjectIndex::erase(uint32_t id, const TypeDir *parent)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_objects.find(id);
+    if (it != m_objects.end() && it->second.parent == parent)
+        m_objects.erase(it);
+}
+
+void ObjectIndex::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_objects.clear();
+}
+
+TypeDir *ObjectIndex::parent(uint32_t id, bool &is_dir) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_objects.find(id);
+    if (it == m_objects.end())
+        return nullptr;
+    is_dir = it->second.dir != nullptr;
+    return it->second.parent;
+}
+
+TypeDir *ObjectIndex::dir(uint32_t id) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_objects.find(id);
+    return it != m_objects.end() ? it->second.dir : nullptr;
+}
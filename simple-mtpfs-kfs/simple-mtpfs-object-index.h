@@ -0,0 +1,57 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_OBJECT_INDEX_H
+#define SMTPFS_OBJECT_INDEX_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+class TypeDir;
+
+// Directory holding each object of the tree, by object id, so that device
+// events which name objects by id do not have to walk the tree. TypeDir
+// keeps it up to date as children come and go; storage directories
+// themselves are not indexed.
+class ObjectIndex
+{
+public:
+    ObjectIndex();
+
+    // dir is the node of the object itself, or nullptr for a file.
+    void insert(uint32_t id, TypeDir *parent, TypeDir *dir);
+    // Forgets the object, unless it was inserted under another parent
+    // since.
+    void erase(uint32_t id, const TypeDir *parent);
+    void clear();
+
+    TypeDir *parent(uint32_t id, bool &is_dir) const;
+    TypeDir *dir(uint32_t id) const;
+
+private:
+    struct Entry
+    {
+        TypeDir *parent;
+        TypeDir *dir;
+    };
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<uint32_t, Entry> m_objects;
+};
+
+#endif // SMTPFS_OBJECT_INDEX_H
@@ -0,0 +1,169 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include "simple-mtpfs-object-upload.h"
+
+ObjectUpload::ObjectUpload(const std::string &path, uint64_t size):
+    m_path(path),
+    m_size(size),
+    m_mutex(),
+    m_cv(),
+    m_contended(),
+    m_ring(),
+    m_written(0),
+    m_sent(0),
+    m_started(false),
+    m_closed(false),
+    m_done(false),
+    m_error(0),
+    m_cancelled(false)
+{
+}
+
+bool ObjectUpload::write(const char *buf, size_t size, uint64_t offset)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_cancelled || m_closed || m_done || offset != m_written ||
+        offset + size > m_size)
+        return false;
+    if (m_ring.empty())
+        m_ring.resize(s_ring_size);
+
+    const std::chrono::seconds timeout(s_stall_timeout);
+    size_t done = 0;
+    while (done < size) {
+        if (m_written - m_sent == m_ring.size()) {
+            // A stream still queued may wait behind another one fed by this
+            // very writer; never wait for it to make room.
+            if (!m_started)
+                return false;
+            if (!m_cv.wait_for(lock, timeout, [&]() {
+                    return m_cancelled || m_done ||
+                        m_written - m_sent < m_ring.size();
+                }))
+                return false;
+            if (m_cancelled || m_done)
+                return false;
+        }
+
+        const size_t pos = static_cast<size_t>(m_written % m_ring.size());
+        const size_t room = m_ring.size() -
+            static_cast<size_t>(m_written - m_sent);
+        const size_t len = std::min(std::min(size - done, room),
+            m_ring.size() - pos);
+        memcpy(m_ring.data() + pos, buf + done, len);
+        m_written += len;
+        done += len;
+        m_cv.notify_all();
+    }
+    return true;
+}
+
+uint64_t ObjectUpload::written() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+}
+
+bool ObjectUpload::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_cancelled || (isSized() && m_written != m_size))
+            return false;
+        m_closed = true;
+    }
+    m_cv.notify_all();
+    return true;
+}
+
+int ObjectUpload::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [&]() { return m_done; });
+    return m_error;
+}
+
+void ObjectUpload::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+    }
+    m_cv.notify_all();
+}
+
+void ObjectUpload::start(const std::function<bool()> &contended)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_contended = contended;
+        m_started = true;
+    }
+    m_cv.notify_all();
+}
+
+bool ObjectUpload::get(unsigned char *data, uint32_t size, uint32_t &got)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const std::chrono::milliseconds poll(static_cast<int>(s_contention_poll));
+    uint32_t done = 0;
+    got = 0;
+    while (done < size) {
+        const auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::seconds(static_cast<int>(s_stall_timeout));
+        while (!m_cancelled && !m_closed && m_written == m_sent) {
+            if (std::chrono::steady_clock::now() >= deadline ||
+                (m_contended && m_contended())) {
+                m_cancelled = true;
+                m_cv.notify_all();
+                return false;
+            }
+            m_cv.wait_for(lock, poll);
+        }
+        if (m_cancelled)
+            return false;
+        // the short read ends the data
+        if (m_written == m_sent)
+            break;
+
+        const size_t pos = static_cast<size_t>(m_sent % m_ring.size());
+        const size_t len = std::min(std::min(size_t(size - done),
+            static_cast<size_t>(m_written - m_sent)), m_ring.size() - pos);
+        memcpy(data + done, m_ring.data() + pos, len);
+        m_sent += len;
+        done += static_cast<uint32_t>(len);
+        m_cv.notify_all();
+    }
+    got = done;
+    return true;
+}
+
+void ObjectUpload::finish(int error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done = true;
+        m_error = error;
+        std::vector<unsigned char>().swap(m_ring);
+    }
+    m_cv.notify_all();
+}
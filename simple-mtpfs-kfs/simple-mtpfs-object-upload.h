@@ -0,0 +1,94 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_OBJECT_UPLOAD_H
+#define SMTPFS_OBJECT_UPLOAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A new object streamed to the device while it is being written. The
+// writer appends to a bounded ring, the upload worker hands the ring to
+// libmtp as the data of a single SendObject transaction. MTP announces the
+// object size before the data; a stream started before the final size is
+// known announces an unknown size and ends its data with a short packet
+// once the writer calls close().
+class ObjectUpload
+{
+public:
+    ObjectUpload(const std::string &path, uint64_t size = s_size_unknown);
+
+    std::string path() const { return m_path; }
+    uint64_t size() const { return m_size; }
+    bool isSized() const { return m_size != s_size_unknown; }
+
+    // Appends data written at offset. Returns false when the data does not
+    // continue the stream, or the stream failed or stalled; the caller then
+    // has to cancel it and upload the staged copy instead.
+    bool write(const char *buf, size_t size, uint64_t offset);
+    uint64_t written() const;
+
+    // Called by the writer once it is done. Ends a stream of unknown size
+    // with the data written so far; returns false when the stream is missing
+    // some of the data and has to be cancelled.
+    bool close();
+
+    // Waits until the transaction has ended; returns 0, or a negative errno
+    // if the object did not make it to the device.
+    int wait();
+
+    void cancel();
+    bool isCancelled() const { return m_cancelled; }
+
+    // Called by the upload worker, get() blocks until size bytes are there,
+    // or fewer once the stream is closed, and returns false if the writer
+    // stalls or the stream is cancelled. The transaction holds the device,
+    // so get() also gives up when the writer has fallen behind and
+    // contended() reports others waiting for the device; the stream is
+    // then cancelled.
+    void start(const std::function<bool()> &contended);
+    bool get(unsigned char *data, uint32_t size, uint32_t &got);
+    void finish(int error);
+
+private:
+    const std::string m_path;
+    const uint64_t m_size;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::function<bool()> m_contended;
+    std::vector<unsigned char> m_ring;
+    uint64_t m_written;
+    uint64_t m_sent;
+    bool m_started;
+    bool m_closed;
+    bool m_done;
+    int m_error;
+    std::atomic<bool> m_cancelled;
+
+    static const uint64_t s_size_unknown = ~static_cast<uint64_t>(0);
+    static const size_t s_ring_size = 4 * 1024 * 1024;
+    static const int s_stall_timeout = 5;
+    static const int s_contention_poll = 100;
+};
+
+#endif // SMTPFS_OBJECT_UPLOAD_H
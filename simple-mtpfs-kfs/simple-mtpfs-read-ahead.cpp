@@ -0,0 +1,238 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <algorithm>
+#include <cstring>
+#include "simple-mtpfs-read-ahead.h"
+
+ReadAhead::ReadAhead():
+    m_fetch(),
+    m_mutex(),
+    m_job_cv(),
+    m_done_cv(),
+    m_streams(),
+    m_jobs(),
+    m_serial(0),
+    m_thread(),
+    m_stop(false)
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+    stop();
+}
+
+void ReadAhead::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+    }
+    m_job_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_streams.clear();
+    m_stop = false;
+    m_done_cv.notify_all();
+}
+
+ReadAhead::Stream *ReadAhead::find(uint32_t id)
+{
+    for (Stream &s : m_streams) {
+        if (s.id == id)
+            return &s;
+    }
+    return nullptr;
+}
+
+ReadAhead::Stream *ReadAhead::stream(uint32_t storage_id, uint32_t id,
+    uint64_t file_size)
+{
+    auto it = std::find_if(m_streams.begin(), m_streams.end(),
+        [&](const Stream &s) { return s.id == id; });
+    if (it != m_streams.end()) {
+        m_streams.splice(m_streams.begin(), m_streams, it);
+        if (it->file_size == file_size)
+            return &*it;
+        m_streams.erase(it);
+    } else if (m_streams.size() >= s_max_streams) {
+        m_streams.pop_back();
+    }
+
+    Stream s;
+    s.storage_id = storage_id;
+    s.id = id;
+    s.serial = ++m_serial;
+    s.file_size = file_size;
+    s.next = 0;
+    s.sequential = 0;
+    s.window = s_min_window;
+    s.data_offset = 0;
+    s.pending = false;
+    s.fetch_offset = 0;
+    s.fetch_size = 0;
+    m_streams.push_front(std::move(s));
+    return &m_streams.front();
+}
+
+void ReadAhead::invalidate(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find_if(m_streams.begin(), m_streams.end(),
+        [&](const Stream &s) { return s.id == id; });
+    if (it == m_streams.end())
+        return;
+    m_streams.erase(it);
+    m_done_cv.notify_all();
+}
+
+int ReadAhead::read(uint32_t storage_id, uint32_t id, uint64_t file_size,
+    char *buf, uint32_t size, uint64_t offset)
+{
+    if (offset >= file_size || size == 0)
+        return 0;
+    if (offset + size > file_size)
+        size = static_cast<uint32_t>(file_size - offset);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Stream *s = stream(storage_id, id, file_size);
+
+    // The worker is reading the window this read falls into.
+    while (s->pending && offset >= s->data_offset &&
+           offset < s->fetch_offset + s->fetch_size) {
+        m_done_cv.wait(lock);
+        s = stream(storage_id, id, file_size);
+    }
+
+    const bool sequential = offset == s->next;
+    s->next = offset + size;
+    if (!sequential) {
+        s->sequential = 0;
+        s->window = s_min_window;
+    } else if (s->sequential < s_sequential_trigger) {
+        ++s->sequential;
+    }
+
+    if (offset >= s->data_offset &&
+        offset + size <= s->data_offset + s->data.size()) {
+        memcpy(buf, &s->data[offset - s->data_offset], size);
+        schedule(*s);
+        return size;
+    }
+
+    if (s->sequential < s_sequential_trigger) {
+        lock.unlock();
+        return m_fetch(storage_id, id, file_size, offset, size,
+            reinterpret_cast<unsigned char*>(buf));
+    }
+
+    // A sequential reader outran the buffer; read its request together
+    // with a window behind it.
+    const uint64_t serial = s->serial;
+    const uint32_t fetch_size = static_cast<uint32_t>(std::min<uint64_t>(
+        std::max(size, s->window), file_size - offset));
+    lock.unlock();
+
+    std::vector<unsigned char> data(fetch_size);
+    int rval = m_fetch(storage_id, id, file_size, offset, fetch_size,
+        data.data());
+    if (rval < 0)
+        return rval;
+    data.resize(rval);
+    const uint32_t read_size = std::min<uint32_t>(size, rval);
+    memcpy(buf, data.data(), read_size);
+
+    lock.lock();
+    s = find(id);
+    if (s && s->serial == serial) {
+        s->data.swap(data);
+        s->data_offset = offset;
+        schedule(*s);
+    }
+    return read_size;
+}
+
+void ReadAhead::schedule(Stream &s)
+{
+    if (s.pending || m_stop || s.sequential < s_sequential_trigger)
+        return;
+
+    // Keep at least half a window ahead of the reader.
+    const uint64_t end = s.data_offset + s.data.size();
+    if (end >= s.file_size || (end > s.next && end - s.next >= s.window / 2))
+        return;
+
+    s.pending = true;
+    s.fetch_offset = end;
+    s.fetch_size = static_cast<uint32_t>(std::min<uint64_t>(s.window,
+        s.file_size - end));
+    if (s.window < s_max_window)
+        s.window *= 2;
+
+    m_jobs.push_back(std::make_pair(s.id, s.serial));
+    if (!m_thread.joinable())
+        m_thread = std::thread(&ReadAhead::worker, this);
+    m_job_cv.notify_one();
+}
+
+void ReadAhead::worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        if (m_jobs.empty()) {
+            m_job_cv.wait(lock);
+            continue;
+        }
+
+        const uint32_t id = m_jobs.front().first;
+        const uint64_t serial = m_jobs.front().second;
+        m_jobs.pop_front();
+        Stream *s = find(id);
+        if (!s || s->serial != serial || !s->pending)
+            continue;
+
+        const uint32_t storage_id = s->storage_id;
+        const uint64_t file_size = s->file_size;
+        const uint64_t offset = s->fetch_offset;
+        std::vector<unsigned char> data(s->fetch_size);
+        lock.unlock();
+        int rval = m_fetch(storage_id, id, file_size, offset,
+            static_cast<uint32_t>(data.size()), data.data());
+        lock.lock();
+
+        s = find(id);
+        if (s && s->serial == serial) {
+            s->pending = false;
+            // Append unless the buffer was replaced meanwhile, dropping
+            // what the reader has consumed already.
+            if (rval > 0 && s->data_offset + s->data.size() == offset) {
+                if (s->next > s->data_offset) {
+                    const size_t consumed = std::min<uint64_t>(
+                        s->next - s->data_offset, s->data.size());
+                    s->data.erase(s->data.begin(), s->data.begin() + consumed);
+                    s->data_offset += consumed;
+                }
+                s->data.insert(s->data.end(), data.begin(), data.begin() + rval);
+            }
+        }
+        m_done_cv.notify_all();
+    }
+}
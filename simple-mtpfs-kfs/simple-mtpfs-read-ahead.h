@@ -0,0 +1,97 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_READ_AHEAD_H
+#define SMTPFS_READ_AHEAD_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Sequential read-ahead for partial object reads. Each object being read
+// gets a stream, which tracks where the next sequential read would start.
+// Once a reader goes front to back, the stream reads a window ahead of it,
+// doubling the window up to s_max_window, and refills it in the background
+// before the reader runs dry. Random reads go straight to the device.
+class ReadAhead
+{
+public:
+    // Reads up to size bytes of an object at offset into buf; returns the
+    // number of bytes read or a negative errno.
+    typedef std::function<int(uint32_t storage_id, uint32_t id,
+        uint64_t file_size, uint64_t offset, uint32_t size,
+        unsigned char *buf)> FetchFunc;
+
+    ReadAhead();
+    ~ReadAhead();
+
+    void setFetchFunc(const FetchFunc &fetch) { m_fetch = fetch; }
+    void stop();
+
+    int read(uint32_t storage_id, uint32_t id, uint64_t file_size, char *buf,
+        uint32_t size, uint64_t offset);
+    void invalidate(uint32_t id);
+
+private:
+    struct Stream
+    {
+        uint32_t storage_id;
+        uint32_t id;
+        uint64_t serial;
+        uint64_t file_size;
+        // Offset the next sequential read starts at.
+        uint64_t next;
+        unsigned int sequential;
+        uint32_t window;
+        // Bytes read ahead, starting at data_offset.
+        std::vector<unsigned char> data;
+        uint64_t data_offset;
+        // Window being read by the worker.
+        bool pending;
+        uint64_t fetch_offset;
+        uint32_t fetch_size;
+    };
+
+    Stream *find(uint32_t id);
+    Stream *stream(uint32_t storage_id, uint32_t id, uint64_t file_size);
+    void schedule(Stream &s);
+    void worker();
+
+    static const uint32_t s_min_window = 64 * 1024;
+    static const uint32_t s_max_window = 8 * 1024 * 1024;
+    static const unsigned int s_sequential_trigger = 2;
+    static const size_t s_max_streams = 4;
+
+    FetchFunc m_fetch;
+    std::mutex m_mutex;
+    std::condition_variable m_job_cv;
+    std::condition_variable m_done_cv;
+    // Streams, most recently used first.
+    std::list<Stream> m_streams;
+    std::deque<std::pair<uint32_t, uint64_t>> m_jobs;
+    uint64_t m_serial;
+    std::thread m_thread;
+    bool m_stop;
+};
+
+#endif // SMTPFS_READ_AHEAD_H
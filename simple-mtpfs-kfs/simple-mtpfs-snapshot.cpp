@@ -0,0 +1,237 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+extern "C" {
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+}
+#include "simple-mtpfs-log.h"
+#include "simple-mtpfs-snapshot.h"
+#include "simple-mtpfs-util.h"
+
+const char MetadataSnapshot::s_magic[8] = { 'S', 'M', 'T', 'P', 'S', 'N', 'A', 'P' };
+
+std::string MetadataSnapshot::makePath(const std::string &serial, uint32_t storage_id)
+{
+    const std::string cache_dir(smtpfs_get_cachedir());
+    if (cache_dir.empty() || serial.empty())
+        return std::string();
+
+    std::stringstream ss;
+    ss << cache_dir << '/';
+    for (char c : serial)
+        ss << (isalnum(static_cast<unsigned char>(c)) ? c : '_');
+    ss << '-' << std::hex << std::setfill('0') << std::setw(8) << storage_id
+       << ".snapshot";
+    return ss.str();
+}
+
+void MetadataSnapshot::saveEntry(std::string &buf, uint32_t id, uint32_t children,
+    uint64_t size, time_t modif_date, uint16_t flags, const std::string &name)
+{
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.id = id;
+    entry.children = children;
+    entry.size = size;
+    entry.modif_date = modif_date;
+    entry.flags = flags;
+    entry.name_len = static_cast<uint16_t>(name.size());
+
+    buf.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    buf.append(name, 0, entry.name_len);
+    buf.append((8 - entry.name_len % 8) % 8, '\0');
+}
+
+void MetadataSnapshot::saveDir(std::string &buf, const TypeDir &dir, uint64_t &entries)
+{
+    const bool listed = dir.isFetched() || dir.isStale();
+    const std::string::size_type offset = buf.size();
+    saveEntry(buf, dir.id(), 0, 0, dir.modificationDate(),
+        ENTRY_DIR | (listed ? ENTRY_LISTED : 0), dir.name());
+    ++entries;
+    if (!listed)
+        return;
+
+    // The children are counted while they are written, so the entry stays
+    // consistent even if the directory changes meanwhile.
+    uint32_t children = 0;
+    dir.forEachDir([&](const TypeDir &d) {
+        // another storage shown in this one is not a part of it
+        if (d.storageid() != dir.storageid())
+            return;
+        saveDir(buf, d, entries);
+        ++children;
+    });
+    dir.forEachFile([&](const TypeFile &f) {
+        saveEntry(buf, f.id(), 0, f.size(), f.modificationDate(), 0, f.name());
+        ++entries;
+        ++children;
+    });
+    memcpy(&buf[offset + offsetof(Entry, children)], &children, sizeof(children));
+}
+
+bool MetadataSnapshot::save(const std::string &path, const TypeDir &storage)
+{
+    if (path.empty())
+        return false;
+
+    std::string buf(sizeof(Header), '\0');
+    uint64_t entries = 0;
+    saveDir(buf, storage, entries);
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_magic, sizeof(header.magic));
+    header.version = s_version;
+    header.storage_id = storage.storageid();
+    header.entries = entries;
+    memcpy(&buf[0], &header, sizeof(header));
+
+    // Write a new file and move it over the old one, so a snapshot is
+    // never seen half written.
+    const std::string tmp_path(path + ".tmp");
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        logerr("Can not create snapshot '", tmp_path, "'.\n");
+        return false;
+    }
+    const char *data = buf.data();
+    size_t left = buf.size();
+    while (left > 0) {
+        ssize_t written = ::write(fd, data, left);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            logerr("Can not write snapshot '", tmp_path, "'.\n");
+            ::close(fd);
+            ::unlink(tmp_path.c_str());
+            return false;
+        }
+        data += written;
+        left -= written;
+    }
+    ::close(fd);
+
+    if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    logmsg("Snapshot '", path, "' saved, ", entries, " entries.\n");
+    return true;
+}
+
+bool MetadataSnapshot::loadChildren(const char *&data, const char *end,
+    TypeDir &dir, uint32_t children)
+{
+    for (uint32_t i = 0; i < children; ++i) {
+        Entry entry;
+        if (static_cast<size_t>(end - data) < sizeof(entry))
+            return false;
+        memcpy(&entry, data, sizeof(entry));
+        data += sizeof(entry);
+
+        const size_t padded = (entry.name_len + 7) & ~static_cast<size_t>(7);
+        if (static_cast<size_t>(end - data) < padded)
+            return false;
+        const std::string name(data, entry.name_len);
+        data += padded;
+
+        if (!(entry.flags & ENTRY_DIR)) {
+            dir.addFile(TypeFile(entry.id, dir.id(), dir.storageid(), name,
+                entry.size, entry.modif_date));
+            continue;
+        }
+
+        TypeDir child(entry.id, dir.id(), dir.storageid(), name);
+        child.setModificationDate(entry.modif_date);
+        dir.addDir(child);
+        if (!(entry.flags & ENTRY_LISTED))
+            continue;
+
+        TypeDir *added = const_cast<TypeDir*>(dir.dir(name));
+        if (added->id() != entry.id) {
+            // Duplicate name, the first one wins; skip over the rest.
+            if (!loadChildren(data, end, child, entry.children))
+                return false;
+            continue;
+        }
+        added->setStale();
+        if (!loadChildren(data, end, *added, entry.children))
+            return false;
+    }
+    return true;
+}
+
+bool MetadataSnapshot::load(const std::string &path, TypeDir &storage)
+{
+    if (path.empty())
+        return false;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) != 0 ||
+        static_cast<size_t>(file_stat.st_size) < sizeof(Header) + sizeof(Entry)) {
+        ::close(fd);
+        return false;
+    }
+
+    const size_t length = static_cast<size_t>(file_stat.st_size);
+    void *map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const char *data = static_cast<const char*>(map);
+    const char *end = data + length;
+
+    Header header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+
+    Entry root;
+    memcpy(&root, data, sizeof(root));
+    data += sizeof(root) + ((root.name_len + 7) & ~static_cast<size_t>(7));
+
+    bool rval = memcmp(header.magic, s_magic, sizeof(header.magic)) == 0 &&
+        header.version == s_version &&
+        header.storage_id == storage.storageid() &&
+        (root.flags & ENTRY_LISTED) && data <= end &&
+        loadChildren(data, end, storage, root.children);
+    ::munmap(map, length);
+
+    if (!rval) {
+        logerr("Ignoring invalid snapshot '", path, "'.\n");
+        storage.clear();
+        return false;
+    }
+    storage.setStale();
+    logmsg("Snapshot '", path, "' loaded, ", header.entries, " entries.\n");
+    return true;
+}
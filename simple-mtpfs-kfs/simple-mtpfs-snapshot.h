@@ -0,0 +1,72 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_SNAPSHOT_H
+#define SMTPFS_SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include "simple-mtpfs-type-dir.h"
+
+// Binary image of the cached directory tree of one storage, used to make
+// a remounted device browsable before it is listed again. Directories
+// restored from a snapshot are marked stale and revalidated on first use.
+class MetadataSnapshot
+{
+public:
+    MetadataSnapshot() = delete;
+
+    static std::string makePath(const std::string &serial, uint32_t storage_id);
+    static bool save(const std::string &path, const TypeDir &storage);
+    static bool load(const std::string &path, TypeDir &storage);
+
+private:
+    static const char s_magic[8];
+    static const uint32_t s_version = 1;
+
+    enum {
+        ENTRY_DIR = 0x0001,
+        ENTRY_LISTED = 0x0002
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t storage_id;
+        uint64_t entries;
+    };
+
+    // Entries are stored in pre-order, each one followed by its name padded
+    // to 8 bytes, and a listed directory by its children.
+    struct Entry {
+        uint32_t id;
+        uint32_t children;
+        uint64_t size;
+        int64_t modif_date;
+        uint16_t flags;
+        uint16_t name_len;
+        uint32_t reserved;
+    };
+
+    static void saveDir(std::string &buf, const TypeDir &dir, uint64_t &entries);
+    static void saveEntry(std::string &buf, uint32_t id, uint32_t children,
+        uint64_t size, time_t modif_date, uint16_t flags, const std::string &name);
+    static bool loadChildren(const char *&data, const char *end,
+        TypeDir &dir, uint32_t children);
+};
+
+#endif // SMTPFS_SNAPSHOT_H
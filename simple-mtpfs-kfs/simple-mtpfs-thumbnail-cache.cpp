@@ -0,0 +1,75 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include "simple-mtpfs-thumbnail-cache.h"
+
+ThumbnailCache::ThumbnailCache():
+    m_mutex(),
+    m_lru(),
+    m_index(),
+    m_size(0)
+{
+}
+
+ThumbnailCache::Data ThumbnailCache::get(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(id);
+    if (it == m_index.end())
+        return Data();
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+}
+
+void ThumbnailCache::put(uint32_t id, const Data &data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(id);
+    if (it != m_index.end()) {
+        m_size -= entrySize(it->second->second);
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+
+    m_lru.push_front(std::make_pair(id, data));
+    m_index[id] = m_lru.begin();
+    m_size += entrySize(data);
+    while (m_size > s_budget && m_lru.size() > 1) {
+        m_size -= entrySize(m_lru.back().second);
+        m_index.erase(m_lru.back().first);
+        m_lru.pop_back();
+    }
+}
+
+void ThumbnailCache::invalidate(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(id);
+    if (it == m_index.end())
+        return;
+    m_size -= entrySize(it->second->second);
+    m_lru.erase(it->second);
+    m_index.erase(it);
+}
+
+void ThumbnailCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_lru.clear();
+    m_index.clear();
+    m_size = 0;
+}
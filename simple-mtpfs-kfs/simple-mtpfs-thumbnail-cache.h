@@ -0,0 +1,61 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_THUMBNAIL_CACHE_H
+#define SMTPFS_THUMBNAIL_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Thumbnails generated by the device, keyed by object id, most recently
+// used first, within s_budget bytes. An empty thumbnail records that the
+// device has none for the object. Every entry is charged s_entry_cost on
+// top of its data, so that those empty ones are evicted as well.
+class ThumbnailCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<unsigned char>> Data;
+
+    ThumbnailCache();
+
+    Data get(uint32_t id);
+    void put(uint32_t id, const Data &data);
+    void invalidate(uint32_t id);
+    void clear();
+
+private:
+    typedef std::list<std::pair<uint32_t, Data>> List;
+
+    static size_t entrySize(const Data &data) { return data->size() + s_entry_cost; }
+
+    static const size_t s_budget = 4 * 1024 * 1024;
+    // List and index nodes, the shared vector and its control block.
+    static const size_t s_entry_cost = 128;
+
+    std::mutex m_mutex;
+    List m_lru;
+    std::unordered_map<uint32_t, List::iterator> m_index;
+    size_t m_size;
+};
+
+#endif // SMTPFS_THUMBNAIL_CACHE_H
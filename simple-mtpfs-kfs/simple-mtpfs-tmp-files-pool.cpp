@@ -15,7 +15,7 @@
 *   along with this program. If not, see <http://www.gnu.org/licenses/>.
 * ***** END LICENSE BLOCK ***** */
 
-#include <algorithm>
+#include <atomic>
 #include <sstream>
 #include "simple-mtpfs-tmp-files-pool.h"
 #include "simple-mtpfs-sha1.h"
@@ -23,33 +23,153 @@
 
 TmpFilesPool::TmpFilesPool():
     m_tmp_dir(smtpfs_get_tmpdir()),
-    m_pool()
+    m_release(),
+    m_mutex(),
+    m_cv(),
+    m_pool(),
+    m_thread(),
+    m_stop(false)
 {
 }
 
 TmpFilesPool::~TmpFilesPool()
 {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+    for (auto &it : m_pool)
+        it.second.file->close();
 }
 
-void TmpFilesPool::removeFile(const std::string &path)
+std::shared_ptr<TypeTmpFile> TmpFilesPool::addFile(
+    const std::shared_ptr<TypeTmpFile> &tmp)
 {
-    auto it = std::find(m_pool.begin(), m_pool.end(), path);
-    if (it == m_pool.end())
-        return;
-    m_pool.erase(it);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_pool.emplace(tmp->pathDevice(), Entry{tmp, Clock::now()}).first;
+    if (!m_thread.joinable() && !m_stop)
+        m_thread = std::thread(&TmpFilesPool::worker, this);
+    return it->second.file;
 }
 
-const TypeTmpFile *TmpFilesPool::getFile(const std::string &path) const
+std::shared_ptr<TypeTmpFile> TmpFilesPool::getFile(const std::string &path)
 {
-    auto it = std::find(m_pool.begin(), m_pool.end(), path);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_pool.find(path);
     if (it == m_pool.end())
         return nullptr;
-    return static_cast<const TypeTmpFile*>(&*it);
+    it->second.used = Clock::now();
+    return it->second.file;
+}
+
+std::shared_ptr<TypeTmpFile> TmpFilesPool::takeFile(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_pool.find(path);
+    if (it == m_pool.end() || isHeld(it->second))
+        return nullptr;
+    std::shared_ptr<TypeTmpFile> tmp = it->second.file;
+    m_pool.erase(it);
+    return tmp;
+}
+
+std::vector<std::shared_ptr<TypeTmpFile>> TmpFilesPool::takeFiles(
+    const std::string &path)
+{
+    auto below = [&](const std::string &key) {
+        return key.compare(0, path.size(), path) == 0 &&
+            (key.size() == path.size() || key[path.size()] == '/');
+    };
+
+    std::vector<std::shared_ptr<TypeTmpFile>> taken;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        bool held = false;
+        for (auto it = m_pool.lower_bound(path);
+             it != m_pool.end() && it->first.compare(0, path.size(), path) == 0; ++it) {
+            if (below(it->first) && isHeld(it->second))
+                held = true;
+        }
+        if (!held)
+            break;
+        // holders only keep a file for the duration of one call
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        lock.lock();
+    }
+
+    for (auto it = m_pool.lower_bound(path);
+         it != m_pool.end() && it->first.compare(0, path.size(), path) == 0; ) {
+        if (below(it->first)) {
+            taken.push_back(it->second.file);
+            it = m_pool.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return taken;
+}
+
+void TmpFilesPool::releaseAll()
+{
+    std::map<std::string, Entry> pool;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        pool.swap(m_pool);
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+    for (auto &it : pool)
+        m_release(it.second.file);
+}
+
+bool TmpFilesPool::isHeld(const Entry &entry)
+{
+    // Callers drop their references without the pool lock; pair the count
+    // with the release of the last of them before touching the file.
+    if (entry.file.use_count() > 1)
+        return true;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return false;
+}
+
+void TmpFilesPool::worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        m_cv.wait_for(lock, std::chrono::seconds(1));
+        if (m_stop)
+            break;
+
+        const Clock::time_point idle = Clock::now() -
+            std::chrono::seconds(s_idle_timeout);
+        std::vector<std::shared_ptr<TypeTmpFile>> released;
+        for (auto it = m_pool.begin(); it != m_pool.end();) {
+            if (it->second.used > idle || isHeld(it->second)) {
+                ++it;
+                continue;
+            }
+            released.push_back(it->second.file);
+            it = m_pool.erase(it);
+        }
+        if (released.empty())
+            continue;
+
+        lock.unlock();
+        for (const std::shared_ptr<TypeTmpFile> &tmp : released)
+            m_release(tmp);
+        lock.lock();
+    }
 }
 
 std::string TmpFilesPool::makeTmpPath(const std::string &path_device) const
 {
-    static int cnt = 0;
+    static std::atomic<int> cnt(0);
     std::stringstream ss;
     ss << path_device << ++cnt;
     return m_tmp_dir + std::string("/") + SHA1::sumString(ss.str());
@@ -18,33 +18,69 @@
 #ifndef SMTPFS_TMP_FILES_POOL_H
 #define SMTPFS_TMP_FILES_POOL_H
 
-#include <set>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <utility>
+#include <thread>
+#include <vector>
 #include "simple-mtpfs-type-tmp-file.h"
 
+// Staged copies of open device files. KFS does not tell when a file is
+// closed, so a file is released once no caller holds it and it has not
+// been looked up for s_idle_timeout, and at the latest by releaseAll().
 class TmpFilesPool
 {
 public:
+    // Closes a file taken out of the pool and disposes of its staged copy.
+    typedef std::function<void(const std::shared_ptr<TypeTmpFile> &tmp)> ReleaseFunc;
+
     TmpFilesPool();
     ~TmpFilesPool();
 
     void setTmpDir(const std::string &tmp_dir) { m_tmp_dir = tmp_dir; }
     std::string getTmpDir(){ return m_tmp_dir; }
+    void setReleaseFunc(const ReleaseFunc &release) { m_release = release; }
 
-    void addFile(const TypeTmpFile &tmp) { m_pool.insert(tmp); }
-    void removeFile(const std::string &path);
-    bool empty() const { return m_pool.size(); }
-
-    const TypeTmpFile *getFile(const std::string &path) const;
+    // Returns the file already in the pool under the same path, if any.
+    std::shared_ptr<TypeTmpFile> addFile(const std::shared_ptr<TypeTmpFile> &tmp);
+    std::shared_ptr<TypeTmpFile> getFile(const std::string &path);
+    // Takes the file out of the pool, unless another caller holds it.
+    std::shared_ptr<TypeTmpFile> takeFile(const std::string &path);
+    // Takes the file at path and those below it out of the pool, waiting
+    // for callers still holding them.
+    std::vector<std::shared_ptr<TypeTmpFile>> takeFiles(const std::string &path);
+    // Releases every file and stops the idle timer.
+    void releaseAll();
 
     std::string makeTmpPath(const std::string &path_device) const;
     bool createTmpDir();
     bool removeTmpDir();
 
 private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+        std::shared_ptr<TypeTmpFile> file;
+        Clock::time_point used;
+    };
+
+    static bool isHeld(const Entry &entry);
+    void worker();
+
+    static const int s_idle_timeout = 5;
+
     std::string m_tmp_dir;
-    std::set<TypeTmpFile> m_pool;
+    ReleaseFunc m_release;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::map<std::string, Entry> m_pool;
+    std::thread m_thread;
+    bool m_stop;
 };
 
 #endif // SMTPFS_TMP_FILES_POOL_H
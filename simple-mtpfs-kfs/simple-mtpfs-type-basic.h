@@ -18,9 +18,13 @@
 #ifndef SMTPFS_TYPE_BASIC
 #define SMTPFS_TYPE_BASIC
 
+#include <atomic>
+#include <cstring>
 #include <string>
 #include <cstdint>
+#include "simple-mtpfs-name-pool.h"
 
+// Names are interned in the NamePool; an object only keeps the handle.
 class TypeBasic
 {
 public:
@@ -28,7 +32,7 @@ public:
         m_id(0),
         m_parent_id(0),
         m_storage_id(0),
-        m_name()
+        m_name(0)
     {}
 
     TypeBasic(uint32_t id, uint32_t parent_id, uint32_t storage_id,
@@ -36,45 +40,53 @@ public:
         m_id(id),
         m_parent_id(parent_id),
         m_storage_id(storage_id),
-        m_name(name)
+        m_name(NamePool::intern(name))
     {}
 
     TypeBasic(const TypeBasic &copy):
         m_id(copy.m_id),
         m_parent_id(copy.m_parent_id),
         m_storage_id(copy.m_storage_id),
-        m_name(copy.m_name)
+        m_name(copy.m_name.load())
     {}
 
     uint32_t id() const { return m_id; }
     uint32_t parentid() const { return m_parent_id; }
     uint32_t storageid() const { return m_storage_id; }
-    std::string name() const { return m_name; }
+    std::string name() const
+    {
+        const uint32_t name = m_name;
+        return std::string(NamePool::str(name), NamePool::length(name));
+    }
+    const char *cname() const { return NamePool::str(m_name); }
+    size_t nameLength() const { return NamePool::length(m_name); }
+    uint32_t nameHandle() const { return m_name; }
 
     void setId(uint32_t id) { m_id = id; }
     void setParent(uint32_t parent_id) { m_parent_id = parent_id; }
     void setStorage(uint32_t storage_id) { m_storage_id = storage_id; }
-    void setName(const std::string &name) { m_name = name; }
+    void setName(const std::string &name) { m_name = NamePool::intern(name); }
 
     TypeBasic &operator= (const TypeBasic &rhs)
     {
         m_id = rhs.m_id;
         m_parent_id = rhs.m_parent_id;
         m_storage_id = rhs.m_storage_id;
-        m_name = rhs.m_name;
+        m_name = rhs.m_name.load();
         return *this;
     }
 
-    bool operator ==(const std::string &rhs) const { return m_name == rhs; }
-    bool operator ==(const TypeBasic &rhs) const { return m_name == rhs.m_name; }
-    bool operator <(const std::string &rhs) const { return m_name < rhs; }
-    bool operator <(const TypeBasic &rhs) const { return m_name < rhs.m_name; }
+    bool operator ==(const std::string &rhs) const { return NamePool::equals(m_name, rhs.data(), rhs.size()); }
+    bool operator ==(const TypeBasic &rhs) const { return m_name == rhs.m_name.load(); }
+    bool operator <(const std::string &rhs) const { return strcmp(cname(), rhs.c_str()) < 0; }
+    bool operator <(const TypeBasic &rhs) const { return strcmp(cname(), rhs.cname()) < 0; }
 
 protected:
     uint32_t m_id;
     uint32_t m_parent_id;
     uint32_t m_storage_id;
-    std::string m_name;
+    // Directories are renamed in place, while others may be reading them.
+    std::atomic<uint32_t> m_name;
 };
 
 #endif // SMTPFS_TYPE_BASIC
@@ -15,21 +15,27 @@
 *   along with this program. If not, see <http://www.gnu.org/licenses/>.
 * ***** END LICENSE BLOCK ***** */
 
-#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 extern "C" {
 #  include <libmtp.h>
 }
+#include "simple-mtpfs-epoch.h"
 #include "simple-mtpfs-type-dir.h"
 
 TypeDir::TypeDir():
     TypeBasic(),
     m_dirs(),
     m_files(),
+    m_dirs_index(),
+    m_files_index(),
     m_access_mutex(),
+    m_generation(0),
+    m_retired(false),
     m_fetched(false),
-    m_modif_date(0)
+    m_stale(false),
+    m_modif_date(0),
+    m_index(nullptr)
 {
 }
 
@@ -38,9 +44,15 @@ TypeDir::TypeDir(uint32_t id, uint32_t parent_id, uint32_t storage_id,
     TypeBasic(id, parent_id, storage_id, name),
     m_dirs(),
     m_files(),
+    m_dirs_index(),
+    m_files_index(),
     m_access_mutex(),
+    m_generation(0),
+    m_retired(false),
     m_fetched(false),
-    m_modif_date(0)
+    m_stale(false),
+    m_modif_date(0),
+    m_index(nullptr)
 {
 }
 
@@ -49,20 +61,109 @@ TypeDir::TypeDir(LIBMTP_file_t *file):
         file->storage_id, std::string(file->filename)),
     m_dirs(),
     m_files(),
+    m_dirs_index(),
+    m_files_index(),
     m_access_mutex(),
+    m_generation(0),
+    m_retired(false),
     m_fetched(false),
-    m_modif_date(file->modificationdate)
+    m_stale(false),
+    m_modif_date(file->modificationdate),
+    m_index(nullptr)
 {
 }
 
 TypeDir::TypeDir(const TypeDir &copy):
     TypeBasic(copy),
-    m_dirs(copy.m_dirs),
-    m_files(copy.m_files),
+    m_dirs(),
+    m_files(),
+    m_dirs_index(),
+    m_files_index(),
     m_access_mutex(),
-    m_fetched(copy.m_fetched),
-    m_modif_date(copy.m_modif_date)
+    m_generation(0),
+    m_retired(false),
+    m_fetched(copy.m_fetched.load()),
+    m_stale(copy.m_stale.load()),
+    m_modif_date(copy.m_modif_date.load()),
+    m_index(nullptr)
+{
+    copy.enterShared();
+    m_dirs = copy.m_dirs;
+    m_files = copy.m_files;
+    m_dirs_index = copy.m_dirs_index;
+    m_files_index = copy.m_files_index;
+    copy.leaveShared();
+}
+
+TypeDir::~TypeDir()
+{
+    if (m_retired)
+        Epoch::forget(this);
+}
+
+uint32_t TypeDir::dirIndex(const char *name, size_t length) const
+{
+    return m_dirs_index.find(NamePool::hash(name, length), [&](uint32_t i) {
+        return NamePool::equals(m_dirs[i].nameHandle(), name, length);
+    });
+}
+
+uint32_t TypeDir::fileIndex(const char *name, size_t length) const
+{
+    return m_files_index.find(NamePool::hash(name, length), [&](uint32_t i) {
+        return NamePool::equals(m_files[i].nameHandle(), name, length);
+    });
+}
+
+void TypeDir::indexInsertChildren(ObjectIndex *index)
 {
+    m_dirs.forEach([&](uint32_t, const TypeDir &d) {
+        indexInsertDir(index, const_cast<TypeDir&>(d));
+    });
+    m_files.forEach([&](uint32_t, const TypeFile &f) {
+        index->insert(f.id(), this, nullptr);
+    });
+}
+
+void TypeDir::indexEraseChildren(ObjectIndex *index)
+{
+    m_dirs.forEach([&](uint32_t, const TypeDir &d) {
+        indexEraseDir(index, const_cast<TypeDir&>(d));
+    });
+    m_files.forEach([&](uint32_t, const TypeFile &f) {
+        index->erase(f.id(), this);
+    });
+}
+
+void TypeDir::indexInsertDir(ObjectIndex *index, TypeDir &dir)
+{
+    // Index the subtree first, so that whoever finds the directory by its
+    // id finds it indexing its own changes.
+    dir.enterShared();
+    dir.m_index = index;
+    dir.indexInsertChildren(index);
+    dir.leaveShared();
+    index->insert(dir.id(), this, &dir);
+}
+
+void TypeDir::indexEraseDir(ObjectIndex *index, TypeDir &dir)
+{
+    index->erase(dir.id(), this);
+    dir.enterShared();
+    dir.m_index = nullptr;
+    dir.indexEraseChildren(index);
+    dir.leaveShared();
+}
+
+void TypeDir::setIndex(ObjectIndex *index)
+{
+    enterShared();
+    ObjectIndex *old_index = m_index.exchange(index);
+    if (old_index)
+        indexEraseChildren(old_index);
+    if (index)
+        indexInsertChildren(index);
+    leaveShared();
 }
 
 LIBMTP_folder_t *TypeDir::toLIBMTPFolder() const
@@ -74,48 +175,88 @@ LIBMTP_folder_t *TypeDir::toLIBMTPFolder() const
     f->folder_id = m_id;
     f->parent_id = m_parent_id;
     f->storage_id = m_storage_id;
-    f->name = strdup(m_name.c_str());
+    f->name = strdup(cname());
     f->sibling = nullptr;
     f->child = nullptr;
     return f;
 }
 
+void TypeDir::clear()
+{
+    enterCritical();
+    if (m_index)
+        indexEraseChildren(m_index);
+    m_dirs_index.clear();
+    m_files_index.clear();
+    m_dirs.clear();
+    m_files.clear();
+    ++m_generation;
+    leaveCritical();
+}
+
 void TypeDir::addDir(const TypeDir &dir)
 {
     enterCritical();
-    m_dirs.insert(dir);
+    if (dirIndex(dir.cname(), dir.nameLength()) == NameIndex::npos) {
+        const uint32_t i = m_dirs.insert(dir);
+        m_dirs_index.insert(NamePool::hash(dir.nameHandle()), i);
+        if (m_index)
+            indexInsertDir(m_index, m_dirs[i]);
+    }
     leaveCritical();
 }
 
 void TypeDir::addFile(const TypeFile &file)
 {
     enterCritical();
-    m_files.insert(file);
+    if (fileIndex(file.cname(), file.nameLength()) == NameIndex::npos) {
+        const uint32_t i = m_files.insert(file);
+        m_files_index.insert(NamePool::hash(file.nameHandle()), i);
+        if (m_index)
+            m_index.load()->insert(file.id(), this, nullptr);
+    }
     leaveCritical();
 }
 
 bool TypeDir::removeDir(const TypeDir &dir)
 {
     enterCritical();
-    auto it = std::find(m_dirs.begin(), m_dirs.end(), dir);
-    if (it == m_dirs.end()) {
+    const uint32_t i = dirIndex(dir.cname(), dir.nameLength());
+    if (i == NameIndex::npos) {
         leaveCritical();
         return false;
     }
-    m_dirs.erase(it);
+    m_dirs_index.erase(NamePool::hash(dir.nameHandle()), i);
+    if (m_index)
+        indexEraseDir(m_index, m_dirs[i]);
+    m_dirs.retire(i);
+    const uint32_t generation = m_generation;
+    m_retired = true;
+    Epoch::retire(this, [this, i, generation]() { reclaimDir(i, generation); });
     leaveCritical();
     return true;
 }
 
+void TypeDir::reclaimDir(uint32_t index, uint32_t generation)
+{
+    enterCritical();
+    if (generation == m_generation)
+        m_dirs.reclaim(index);
+    leaveCritical();
+}
+
 bool TypeDir::removeFile(const TypeFile &file)
 {
     enterCritical();
-    auto it = std::find(m_files.begin(), m_files.end(), file);
-    if (it == m_files.end()) {
+    const uint32_t i = fileIndex(file.cname(), file.nameLength());
+    if (i == NameIndex::npos) {
         leaveCritical();
         return false;
     }
-    m_files.erase(it);
+    m_files_index.erase(NamePool::hash(file.nameHandle()), i);
+    if (m_index)
+        m_index.load()->erase(m_files[i].id(), this);
+    m_files.erase(i);
     leaveCritical();
     return true;
 }
@@ -123,43 +264,109 @@ bool TypeDir::removeFile(const TypeFile &file)
 bool TypeDir::replaceFile(const TypeFile &oldfile, const TypeFile &newfile)
 {
     enterCritical();
-    auto it = std::find(m_files.begin(), m_files.end(), oldfile);
-    if (it == m_files.end()) {
+    const uint32_t i = fileIndex(oldfile.cname(), oldfile.nameLength());
+    if (i == NameIndex::npos) {
+        leaveCritical();
+        return false;
+    }
+    m_files_index.erase(NamePool::hash(oldfile.nameHandle()), i);
+    if (m_index)
+        m_index.load()->erase(m_files[i].id(), this);
+    if (fileIndex(newfile.cname(), newfile.nameLength()) != NameIndex::npos) {
+        m_files.erase(i);
+    } else {
+        m_files[i] = newfile;
+        m_files_index.insert(NamePool::hash(newfile.nameHandle()), i);
+        if (m_index)
+            m_index.load()->insert(newfile.id(), this, nullptr);
+    }
+    leaveCritical();
+    return true;
+}
+
+bool TypeDir::renameDir(const std::string &oldname, const std::string &newname)
+{
+    enterCritical();
+    const uint32_t i = dirIndex(oldname.data(), oldname.size());
+    if (i == NameIndex::npos ||
+        dirIndex(newname.data(), newname.size()) != NameIndex::npos) {
         leaveCritical();
         return false;
     }
-    m_files.erase(it);
-    m_files.insert(newfile);
+    m_dirs_index.erase(NamePool::hash(oldname.data(), oldname.size()), i);
+    m_dirs[i].setName(newname);
+    m_dirs_index.insert(NamePool::hash(newname.data(), newname.size()), i);
+    leaveCritical();
+    return true;
+}
+
+bool TypeDir::renameFile(const std::string &oldname, const std::string &newname)
+{
+    enterCritical();
+    const uint32_t i = fileIndex(oldname.data(), oldname.size());
+    if (i == NameIndex::npos ||
+        fileIndex(newname.data(), newname.size()) != NameIndex::npos) {
+        leaveCritical();
+        return false;
+    }
+    m_files_index.erase(NamePool::hash(oldname.data(), oldname.size()), i);
+    m_files[i].setName(newname);
+    m_files_index.insert(NamePool::hash(newname.data(), newname.size()), i);
     leaveCritical();
     return true;
 }
 
 TypeDir &TypeDir::operator =(const TypeDir &rhs)
 {
+    if (this == &rhs)
+        return *this;
+
     TypeBasic::operator =(rhs);
+    enterCritical();
+    if (m_index)
+        indexEraseChildren(m_index);
+    rhs.enterShared();
     m_dirs = rhs.m_dirs;
     m_files = rhs.m_files;
-    m_fetched = rhs.m_fetched;
+    m_dirs_index = rhs.m_dirs_index;
+    m_files_index = rhs.m_files_index;
+    rhs.leaveShared();
+    ++m_generation;
+    if (m_index)
+        indexInsertChildren(m_index);
+    leaveCritical();
+    m_fetched = rhs.m_fetched.load();
+    m_stale = rhs.m_stale.load();
     return *this;
 }
 
 const TypeDir *TypeDir::dir(const std::string &name) const
 {
-    enterCritical();
-    auto it = std::find(m_dirs.begin(), m_dirs.end(), name);
-    leaveCritical();
-    if (it == m_dirs.end())
-        return nullptr;
-    return &*it;
+    enterShared();
+    const uint32_t i = dirIndex(name.data(), name.size());
+    const TypeDir *d = i != NameIndex::npos ? &m_dirs[i] : nullptr;
+    leaveShared();
+    return d;
 }
 
-const TypeFile *TypeDir::file(const std::string &name) const
+std::unique_ptr<const TypeFile> TypeDir::file(const std::string &name) const
 {
-    enterCritical();
-    auto it = std::find(m_files.begin(), m_files.end(), name);
-    leaveCritical();
-    if (it == m_files.end())
-        return nullptr;
-//    getpwnam();
-    return &*it;
+    enterShared();
+    const uint32_t i = fileIndex(name.data(), name.size());
+    std::unique_ptr<const TypeFile> f(i != NameIndex::npos ?
+        new TypeFile(m_files[i]) : nullptr);
+    leaveShared();
+    return f;
+}
+
+void TypeDir::memoryUsage(size_t &objects, size_t &bytes) const
+{
+    enterShared();
+    objects += m_dirs.size() + m_files.size();
+    bytes += m_dirs.memoryUsage() + m_files.memoryUsage() +
+        m_dirs_index.memoryUsage() + m_files_index.memoryUsage();
+    m_dirs.forEach([&](uint32_t, const TypeDir &d) {
+        d.memoryUsage(objects, bytes);
+    });
+    leaveShared();
 }
@@ -18,10 +18,13 @@
 #ifndef SMTPFS_TYPE_DIR_H
 #define SMTPFS_TYPE_DIR_H
 
-#include <mutex>
-#include <set>
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
 #include <string>
 
+#include "simple-mtpfs-node-arena.h"
+#include "simple-mtpfs-object-index.h"
 #include "simple-mtpfs-type-basic.h"
 #include "simple-mtpfs-type-file.h"
 
@@ -33,27 +36,47 @@ public:
         const std::string &name);
     TypeDir(LIBMTP_file_t *file);
     TypeDir(const TypeDir &copy);
+    ~TypeDir();
 
+    // Lookups and visits share the directory; only changes to its
+    // children take it exclusively.
     void enterCritical() const { m_access_mutex.lock(); }
     void leaveCritical() const { m_access_mutex.unlock(); }
+    void enterShared() const { m_access_mutex.lock_shared(); }
+    void leaveShared() const { m_access_mutex.unlock_shared(); }
 
-    void clear() { m_dirs.clear(); m_files.clear(); }
+    // Keeps the index up to date with the objects below this directory.
+    void setIndex(ObjectIndex *index);
+
+    void clear();
     void setFetched(bool f = true) { m_fetched = f; }
     bool isFetched() const { return m_fetched; }
+    void setStale(bool s = true) { m_stale = s; }
+    bool isStale() const { return m_stale; }
     void addDir(const TypeDir &dir);
     void addFile(const TypeFile &file);
     bool removeDir(const TypeDir &dir);
     bool removeFile(const TypeFile &file);
     bool replaceFile(const TypeFile &oldfile, const TypeFile &newfile);
+    bool renameDir(const std::string &oldname, const std::string &newname);
+    bool renameFile(const std::string &oldname, const std::string &newname);
 
-    std::set<TypeDir>::size_type dirCount() const { return m_dirs.size(); }
-    std::set<TypeFile>::size_type fileCount() const { return m_files.size(); }
-    const TypeDir  *dir(const std::string &name) const;
-    const TypeFile *file(const std::string &name) const;
-    std::set<TypeDir> dirs() const { return m_dirs; }
-    std::set<TypeFile> files() const { return m_files; }
+    uint32_t dirCount() const { return m_dirs.size(); }
+    uint32_t fileCount() const { return m_files.size(); }
+    const TypeDir *dir(const std::string &name) const;
+    // Files are replaced in place; this returns a copy.
+    std::unique_ptr<const TypeFile> file(const std::string &name) const;
+    // Visit the children in place, with the directory locked; func must
+    // not call back into this directory.
+    template <typename F> void forEachDir(F func) const;
+    template <typename F> void forEachFile(F func) const;
+    template <typename F> void forEachName(F func) const;
     bool isEmpty() const { return m_dirs.empty() && m_files.empty(); }
 
+    // Adds up the objects below this directory and the bytes their
+    // metadata takes, not counting the shared name pool.
+    void memoryUsage(size_t &objects, size_t &bytes) const;
+
 	time_t modificationDate() const { return m_modif_date; }
     void setModificationDate(time_t modif_date) { m_modif_date = modif_date; }
 	
@@ -65,11 +88,58 @@ public:
     bool operator <(const TypeDir &rhs) const { return TypeBasic::operator <(rhs); }
 
 private:
-    std::set<TypeDir> m_dirs;
-    std::set<TypeFile> m_files;
-    mutable std::mutex m_access_mutex;
-    bool m_fetched;
-    time_t m_modif_date;
+    uint32_t dirIndex(const char *name, size_t length) const;
+    uint32_t fileIndex(const char *name, size_t length) const;
+    // Called with the directory locked.
+    void indexInsertChildren(ObjectIndex *index);
+    void indexEraseChildren(ObjectIndex *index);
+    void indexInsertDir(ObjectIndex *index, TypeDir &dir);
+    void indexEraseDir(ObjectIndex *index, TypeDir &dir);
+    void reclaimDir(uint32_t index, uint32_t generation);
+
+    // Children are packed in arenas. Removed directories are retired rather
+    // than destroyed, so pointers handed out by dir() stay valid until every
+    // Epoch section running at the removal has ended, or until this
+    // directory is cleared or destroyed. The name indexes make every lookup
+    // by name O(1), regardless of the directory size.
+    NodeArena<TypeDir> m_dirs;
+    NodeArena<TypeFile> m_files;
+    NameIndex m_dirs_index;
+    NameIndex m_files_index;
+    mutable std::shared_timed_mutex m_access_mutex;
+    // Bumped whenever the arenas are replaced, so that a reclaim queued
+    // before does not touch a slot which has been reused since.
+    uint32_t m_generation;
+    bool m_retired;
+    std::atomic<bool> m_fetched;
+    std::atomic<bool> m_stale;
+    std::atomic<time_t> m_modif_date;
+    std::atomic<ObjectIndex*> m_index;
 };
 
+template <typename F>
+void TypeDir::forEachDir(F func) const
+{
+    enterShared();
+    m_dirs.forEach([&](uint32_t, const TypeDir &d) { func(d); });
+    leaveShared();
+}
+
+template <typename F>
+void TypeDir::forEachFile(F func) const
+{
+    enterShared();
+    m_files.forEach([&](uint32_t, const TypeFile &f) { func(f); });
+    leaveShared();
+}
+
+template <typename F>
+void TypeDir::forEachName(F func) const
+{
+    enterShared();
+    m_dirs.forEach([&](uint32_t, const TypeDir &d) { func(d.cname()); });
+    m_files.forEach([&](uint32_t, const TypeFile &f) { func(f.cname()); });
+    leaveShared();
+}
+
 #endif // SMTPFS_TYPE_DIR_H
@@ -57,7 +57,7 @@ LIBMTP_file_t *TypeFile::toLIBMTPFile() const
     f->item_id = m_id;
     f->parent_id = m_parent_id;
     f->storage_id = m_storage_id;
-    f->filename = strdup(m_name.c_str());
+    f->filename = strdup(cname());
     f->filesize = m_size;
     f->modificationdate = m_modif_date;
     f->filetype = LIBMTP_FILETYPE_UNKNOWN;
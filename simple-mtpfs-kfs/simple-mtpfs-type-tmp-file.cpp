@@ -16,15 +16,29 @@
 * ***** END LICENSE BLOCK ***** */
 
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "simple-mtpfs-type-tmp-file.h"
 
+// How far ahead of a sequential reader of a mapped file pages are requested.
+static const size_t s_map_readahead = 1024 * 1024;
+
 TypeTmpFile::TypeTmpFile():
     m_path_device(),
     m_path_tmp(),
-    m_file_descriptors(),
-    m_modified(false)
+    m_file_desc(-1),
+    m_modified(false),
+    m_download(),
+    m_upload(),
+    m_map_mutex(),
+    m_map(nullptr),
+    m_map_size(0),
+    m_map_next(0),
+    m_map_advice(MapAdviceNone)
 {
 }
 
@@ -33,51 +47,99 @@ TypeTmpFile::TypeTmpFile(const std::string &path_device,
         bool modified):
     m_path_device(path_device),
     m_path_tmp(path_tmp),
-    m_modified(modified)
+    m_file_desc(file_desc),
+    m_modified(modified),
+    m_download(),
+    m_upload(),
+    m_map_mutex(),
+    m_map(nullptr),
+    m_map_size(0),
+    m_map_next(0),
+    m_map_advice(MapAdviceNone)
 {
-    m_file_descriptors.insert(file_desc);
 }
 
-TypeTmpFile::TypeTmpFile(const TypeTmpFile &copy):
-    m_path_device(copy.m_path_device),
-    m_path_tmp(copy.m_path_tmp),
-    m_file_descriptors(copy.m_file_descriptors),
-    m_modified(copy.m_modified)
-{
+int TypeTmpFile::close(){
+    unmap();
+    if (m_file_desc < 0)
+        return 0;
+
+    int rval = ::close(m_file_desc);
+    m_file_desc = -1;
+    if (rval && errno != EBADF)
+        return errno;
+    return 0;
 }
 
-bool TypeTmpFile::hasFileDescriptor(int fd)
+ssize_t TypeTmpFile::readMapped(char *buf, size_t size, off_t offset)
 {
-    auto it = std::find(m_file_descriptors.begin(),
-        m_file_descriptors.end(), fd);
-    return it != m_file_descriptors.end();
+    std::lock_guard<std::mutex> lock(m_map_mutex);
+    if (m_file_desc < 0 || offset < 0)
+        return -1;
+
+    if (!m_map) {
+        struct stat st;
+        if (::fstat(m_file_desc, &st) != 0 || st.st_size <= 0)
+            return -1;
+        void *map = ::mmap(nullptr, static_cast<size_t>(st.st_size),
+            PROT_READ, MAP_SHARED, m_file_desc, 0);
+        if (map == MAP_FAILED) {
+            logerr("Can not map '", m_path_tmp, "': ", strerror(errno), ".\n");
+            return -1;
+        }
+        m_map = static_cast<char*>(map);
+        m_map_size = static_cast<size_t>(st.st_size);
+        m_map_next = 0;
+        m_map_advice = MapAdviceNone;
+    }
+
+    // The file may have grown since it was mapped; the mapping does not
+    // tell where it ends now.
+    const size_t off = static_cast<size_t>(offset);
+    if (off >= m_map_size || size > m_map_size - off)
+        return -1;
+    const size_t len = size;
+
+    // Switch the kernel hint when the access pattern changes; sequential
+    // readers additionally get the pages ahead of them faulted in early.
+    if (off == m_map_next) {
+        if (m_map_advice != MapAdviceSequential) {
+            ::madvise(m_map, m_map_size, MADV_SEQUENTIAL);
+            m_map_advice = MapAdviceSequential;
+        }
+        const size_t ahead = off + len;
+        if (ahead < m_map_size) {
+            const size_t page = static_cast<size_t>(::getpagesize());
+            const size_t start = ahead & ~(page - 1);
+            ::madvise(m_map + start,
+                std::min(s_map_readahead, m_map_size - start), MADV_WILLNEED);
+        }
+    } else if (m_map_advice != MapAdviceRandom) {
+        ::madvise(m_map, m_map_size, MADV_RANDOM);
+        m_map_advice = MapAdviceRandom;
+    }
+    m_map_next = off + len;
+
+    memcpy(buf, m_map + off, len);
+    return static_cast<ssize_t>(len);
 }
 
-void TypeTmpFile::removeFileDescriptor(int fd)
+bool TypeTmpFile::isMappedRange(off_t offset, size_t size) const
 {
-    auto it = std::find(m_file_descriptors.begin(),
-        m_file_descriptors.end(), fd);
-    if (it == m_file_descriptors.end())
-        return;
-    m_file_descriptors.erase(it);
+    std::lock_guard<std::mutex> lock(m_map_mutex);
+    return m_map && offset >= 0 &&
+        static_cast<size_t>(offset) + size <= m_map_size;
 }
 
-TypeTmpFile &TypeTmpFile::operator =(const TypeTmpFile &rhs)
+void TypeTmpFile::unmap()
 {
-    m_path_device = rhs.m_path_device;
-    m_path_tmp = rhs.m_path_tmp;
-    m_file_descriptors = rhs.m_file_descriptors;
-    m_modified = rhs.m_modified;
-    return *this;
-}
+    std::lock_guard<std::mutex> lock(m_map_mutex);
+    if (!m_map)
+        return;
 
-int TypeTmpFile::close(){
-    for (int fd : m_file_descriptors) {
-        int rval = ::close(static_cast<int>(fd));
-        
-        if (rval && errno != EBADF) {
-            return errno;
-        }
-    }
-    return 0;
+    ::munmap(m_map, m_map_size);
+    m_map = nullptr;
+    m_map_size = 0;
+    m_map_next = 0;
+    m_map_advice = MapAdviceNone;
 }
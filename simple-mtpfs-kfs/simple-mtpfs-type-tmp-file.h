@@ -18,8 +18,12 @@
 #ifndef SMTPFS_TYPE_TMP_FILE_H
 #define SMTPFS_TYPE_TMP_FILE_H
 
-#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <sys/types.h>
+#include "simple-mtpfs-object-download.h"
+#include "simple-mtpfs-object-upload.h"
 #include "simple-mtpfs-type-file.h"
 #include "simple-mtpfs-log.h"
 
@@ -27,24 +31,43 @@ class TypeTmpFile
 {
 public:
     TypeTmpFile();
-    TypeTmpFile(const TypeTmpFile &copy);
     TypeTmpFile(const std::string &path_device, const std::string &path_tmp,
         int file_desc, bool modified = false);
 
     std::string pathDevice() const { return m_path_device; }
+    // Only while the file is out of the pool and held by nobody else.
+    void setPathDevice(const std::string &path) { m_path_device = path; }
     std::string pathTmp() const { return m_path_tmp; }
 
     bool isModified() const { return m_modified; }
     void setModified(bool modified = true) { m_modified = modified; }
 
-    std::set<int> fileDescriptors() const { return m_file_descriptors; }
-    void addFileDescriptor(int fd) { m_file_descriptors.insert(fd); }
-    bool hasFileDescriptor(int fd);
-    void removeFileDescriptor(int fd);
-    int refcnt() const { return m_file_descriptors.size(); }
+    // Set while the content is still being pulled from the device.
+    std::shared_ptr<ObjectDownload> download() const { return m_download; }
+    void setDownload(const std::shared_ptr<ObjectDownload> &download) { m_download = download; }
+
+    // Set while the content is being streamed to the device as it is
+    // written; the staged copy is kept as a fallback.
+    std::shared_ptr<ObjectUpload> upload() const { return m_upload; }
+    void setUpload(const std::shared_ptr<ObjectUpload> &upload) { m_upload = upload; }
+
+    // One descriptor, opened for reading and writing, serves every user
+    // of the file until the pool releases it.
+    int fileDescriptor() const { return m_file_desc; }
     int close();
 
-    TypeTmpFile &operator =(const TypeTmpFile &rhs);
+    // Once the content is complete, reads are served from a mapping of the
+    // whole file. Returns -1 when the file can not be mapped, or the range
+    // is not within the mapping, and the caller should fall back to pread().
+    // Writes growing the file past the mapping and truncation have to drop
+    // it with unmap(). The mapping is locked, so it is never dropped while
+    // another thread is copying from it.
+    ssize_t readMapped(char *buf, size_t size, off_t offset);
+    bool isMappedRange(off_t offset, size_t size) const;
+    void unmap();
+
+    TypeTmpFile(const TypeTmpFile &copy) = delete;
+    TypeTmpFile &operator =(const TypeTmpFile &rhs) = delete;
 
     bool operator ==(const TypeTmpFile &rhs) const
     {
@@ -66,8 +89,22 @@ public:
 private:
     std::string m_path_device;
     std::string m_path_tmp;
-    std::set<int> m_file_descriptors;
+    int m_file_desc;
     bool m_modified;
+    std::shared_ptr<ObjectDownload> m_download;
+    std::shared_ptr<ObjectUpload> m_upload;
+
+    enum MapAdvice {
+        MapAdviceNone,
+        MapAdviceSequential,
+        MapAdviceRandom
+    };
+
+    mutable std::mutex m_map_mutex;
+    char *m_map;
+    size_t m_map_size;
+    size_t m_map_next;
+    MapAdvice m_map_advice;
 };
 
 #endif // SMTPFS_TYPE_TMP_FILE_H
@@ -103,6 +103,20 @@ std::string smtpfs_realpath(const std::string &path)
     return std::string(real_path ? buf : "");
 }
 
+std::string smtpfs_normalize_path(const std::string &path)
+{
+    std::string result("/");
+    result.reserve(path.size() + 1);
+    for (char c : path) {
+        if (c == '/' && result.back() == '/')
+            continue;
+        result.push_back(c);
+    }
+    if (result.size() > 1 && result.back() == '/')
+        result.pop_back();
+    return result;
+}
+
 std::string smtpfs_get_tmpdir()
 {
     const char *c_tmp = getenv("TMP");
@@ -125,6 +139,19 @@ std::string smtpfs_get_tmpdir()
     return tmp_dir;
 }
 
+std::string smtpfs_get_cachedir()
+{
+    const char *c_home = getenv("HOME");
+    if (!c_home)
+        return std::string();
+
+    std::string cache_dir(c_home);
+    cache_dir += "/Library/Caches/simple-mtpfs";
+    if (!smtpfs_check_dir(cache_dir) && !smtpfs_create_dir(cache_dir))
+        return std::string();
+    return cache_dir;
+}
+
 bool smtpfs_create_dir(const std::string &dirname)
 {
     return ::mkdir(dirname.c_str(), S_IRWXU) == 0;
@@ -42,7 +42,9 @@ private:
 std::string smtpfs_dirname(const std::string &path);
 std::string smtpfs_basename(const std::string &path);
 std::string smtpfs_realpath(const std::string &path);
+std::string smtpfs_normalize_path(const std::string &path);
 std::string smtpfs_get_tmpdir();
+std::string smtpfs_get_cachedir();
 
 bool smtpfs_create_dir(const std::string &dirname);
 bool smtpfs_remove_dir(const std::string &dirname);
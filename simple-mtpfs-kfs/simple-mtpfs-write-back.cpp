@@ -0,0 +1,273 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include "simple-mtpfs-write-back.h"
+
+WriteBack::WriteBack():
+    m_flush(),
+    m_mutex(),
+    m_cv(),
+    m_objects(),
+    m_bytes(0),
+    m_thread(),
+    m_stop(false)
+{
+}
+
+WriteBack::~WriteBack()
+{
+    stop();
+}
+
+int WriteBack::write(uint32_t id, uint64_t offset, const char *buf,
+    size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto obj_it = m_objects.find(id);
+    if (obj_it == m_objects.end())
+        obj_it = m_objects.emplace(id, Object{{}, 0, Clock::now(), false, 0}).first;
+    Object &object = obj_it->second;
+    if (object.error != 0)
+        return takeError(id);
+    if (object.ranges.empty())
+        object.dirtied = Clock::now();
+
+    // Find the ranges the write overlaps or adjoins and merge them into one.
+    uint64_t start = offset;
+    uint64_t end = offset + size;
+    auto first = object.ranges.upper_bound(offset);
+    if (first != object.ranges.begin()) {
+        auto prev = std::prev(first);
+        if (prev->first + prev->second.size() >= offset)
+            first = prev;
+    }
+    auto last = first;
+    while (last != object.ranges.end() && last->first <= end) {
+        start = std::min(start, last->first);
+        end = std::max(end, last->first + last->second.size());
+        ++last;
+    }
+
+    std::vector<unsigned char> data(static_cast<size_t>(end - start));
+    for (auto it = first; it != last; ++it) {
+        memcpy(data.data() + (it->first - start), it->second.data(),
+            it->second.size());
+        object.bytes -= it->second.size();
+        m_bytes -= it->second.size();
+    }
+    memcpy(data.data() + (offset - start), buf, size);
+    object.ranges.erase(first, last);
+    object.bytes += data.size();
+    m_bytes += data.size();
+    object.ranges.emplace(start, std::move(data));
+
+    if (!m_thread.joinable() && !m_stop)
+        m_thread = std::thread(&WriteBack::worker, this);
+
+    int rval = 0;
+    if (m_bytes > s_budget) {
+        std::vector<uint32_t> ids;
+        for (const auto &entry : m_objects)
+            ids.push_back(entry.first);
+        for (uint32_t flush_id : ids) {
+            int flush_rval = flushObject(lock, flush_id, flush_id == id);
+            if (flush_id == id)
+                rval = flush_rval;
+        }
+    } else if (object.bytes >= s_flush_threshold) {
+        rval = flushObject(lock, id, true);
+    }
+
+    return rval < 0 ? rval : static_cast<int>(size);
+}
+
+int WriteBack::read(uint32_t id, uint64_t offset, size_t size, char *buf)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Data being sent is neither here nor on the device yet.
+    auto obj_it = m_objects.find(id);
+    while (obj_it != m_objects.end() && obj_it->second.flushing) {
+        m_cv.wait(lock);
+        obj_it = m_objects.find(id);
+    }
+    if (obj_it == m_objects.end() || size == 0)
+        return 0;
+    Object &object = obj_it->second;
+
+    const uint64_t end = offset + size;
+    auto it = object.ranges.upper_bound(offset);
+    if (it != object.ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second.size() >= end) {
+            memcpy(buf, prev->second.data() + (offset - prev->first), size);
+            return static_cast<int>(size);
+        }
+        if (prev->first + prev->second.size() > offset)
+            it = prev;
+    }
+    if (it == object.ranges.end() || it->first >= end)
+        return 0;
+
+    // The device has to provide part of the read, so it needs the dirty
+    // data first.
+    return flushObject(lock, id, true);
+}
+
+int WriteBack::flush(uint32_t id)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int rval = flushObject(lock, id, true);
+    int error = takeError(id);
+    return rval < 0 ? rval : error;
+}
+
+int WriteBack::flushAll()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::vector<uint32_t> ids;
+    for (const auto &entry : m_objects)
+        ids.push_back(entry.first);
+
+    int rval = 0;
+    for (uint32_t id : ids) {
+        int flush_rval = flushObject(lock, id, true);
+        int error = takeError(id);
+        if (flush_rval < 0)
+            rval = flush_rval;
+        else if (error < 0)
+            rval = error;
+    }
+    return rval;
+}
+
+void WriteBack::discard(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto obj_it = m_objects.find(id);
+    if (obj_it == m_objects.end())
+        return;
+
+    // A flush in progress accounts for the data it took.
+    m_bytes -= obj_it->second.bytes;
+    m_objects.erase(obj_it);
+    m_cv.notify_all();
+}
+
+int WriteBack::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+    return flushAll();
+}
+
+int WriteBack::flushObject(std::unique_lock<std::mutex> &lock, uint32_t id,
+    bool report)
+{
+    // The data of a flush in progress may be older than the ranges left
+    // here; wait for it, so that the device gets them in order.
+    auto obj_it = m_objects.find(id);
+    while (obj_it != m_objects.end() && obj_it->second.flushing) {
+        m_cv.wait(lock);
+        obj_it = m_objects.find(id);
+    }
+    if (obj_it == m_objects.end())
+        return 0;
+
+    std::map<uint64_t, std::vector<unsigned char>> ranges;
+    ranges.swap(obj_it->second.ranges);
+    const size_t bytes = obj_it->second.bytes;
+    obj_it->second.bytes = 0;
+    obj_it->second.flushing = true;
+    lock.unlock();
+
+    // The rest of the ranges is dropped after a failure; the device would
+    // most likely refuse them as well.
+    int rval = 0;
+    for (const auto &range : ranges) {
+        const std::vector<unsigned char> &data = range.second;
+        for (size_t done = 0; done < data.size() && rval == 0; ) {
+            const size_t chunk = std::min<size_t>(data.size() - done,
+                size_t(s_max_transfer));
+            rval = m_flush(id, range.first + done, data.data() + done,
+                static_cast<uint32_t>(chunk));
+            done += chunk;
+        }
+        if (rval != 0)
+            break;
+    }
+
+    lock.lock();
+    m_bytes -= bytes;
+    m_cv.notify_all();
+    obj_it = m_objects.find(id);
+    if (obj_it == m_objects.end())
+        return report ? rval : 0;
+    Object &object = obj_it->second;
+    object.flushing = false;
+    if (rval < 0 && !report && object.error == 0)
+        object.error = rval;
+    if (object.ranges.empty() && object.error == 0)
+        m_objects.erase(obj_it);
+    return report ? rval : 0;
+}
+
+int WriteBack::takeError(uint32_t id)
+{
+    auto obj_it = m_objects.find(id);
+    if (obj_it == m_objects.end() || obj_it->second.error == 0)
+        return 0;
+
+    int rval = obj_it->second.error;
+    obj_it->second.error = 0;
+    if (obj_it->second.ranges.empty() && !obj_it->second.flushing)
+        m_objects.erase(obj_it);
+    return rval;
+}
+
+void WriteBack::worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        m_cv.wait_for(lock, std::chrono::milliseconds(500));
+        if (m_stop)
+            break;
+
+        const Clock::time_point old = Clock::now() -
+            std::chrono::seconds(int(s_flush_age));
+        std::vector<uint32_t> ids;
+        for (const auto &entry : m_objects) {
+            const Object &object = entry.second;
+            if (!object.ranges.empty() && !object.flushing &&
+                object.dirtied <= old)
+                ids.push_back(entry.first);
+        }
+        for (uint32_t id : ids)
+            flushObject(lock, id, false);
+    }
+}
@@ -0,0 +1,105 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+#ifndef SMTPFS_WRITE_BACK_H
+#define SMTPFS_WRITE_BACK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Write-back buffer for partial object writes. Writes are kept per object
+// as dirty ranges, merged when they overlap or adjoin, and sent to the
+// device in transfers of up to s_max_transfer bytes once an object holds
+// s_flush_threshold dirty bytes, all objects together hold s_budget, its
+// oldest dirty data is s_flush_age seconds old, or the object is flushed
+// explicitly. A flush nobody waits for keeps its error for the next
+// write or flush of the object.
+class WriteBack
+{
+public:
+    // Writes size bytes of data to an object at offset; returns 0 or
+    // a negative errno.
+    typedef std::function<int(uint32_t id, uint64_t offset,
+        const unsigned char *data, uint32_t size)> FlushFunc;
+
+    WriteBack();
+    ~WriteBack();
+
+    void setFlushFunc(const FlushFunc &flush) { m_flush = flush; }
+
+    // Returns size or a negative errno of a flush of the object, either
+    // one the write triggered or an earlier one.
+    int write(uint32_t id, uint64_t offset, const char *buf, size_t size);
+
+    // Serves a read lying within one dirty range and returns its size.
+    // Returns 0 when the read has to go to the device; dirty data it only
+    // partly covers is flushed first. Returns a negative errno when that
+    // flush fails.
+    int read(uint32_t id, uint64_t offset, size_t size, char *buf);
+
+    int flush(uint32_t id);
+    int flushAll();
+    void discard(uint32_t id);
+    // Flushes everything and stops the age timer.
+    int stop();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Dirty ranges of an object, keyed by their offset. Ranges being sent
+    // are taken out, with flushing set until they are on the device.
+    struct Object
+    {
+        std::map<uint64_t, std::vector<unsigned char>> ranges;
+        size_t bytes;
+        Clock::time_point dirtied;
+        bool flushing;
+        int error;
+    };
+
+    // Called and returns with m_mutex held, but drops it while the data
+    // is sent. The error is returned when report is set, otherwise it is
+    // kept in the object.
+    int flushObject(std::unique_lock<std::mutex> &lock, uint32_t id,
+        bool report);
+    int takeError(uint32_t id);
+    void worker();
+
+    static const size_t s_max_transfer = 16 * 1024 * 1024;
+    static const size_t s_flush_threshold = 8 * 1024 * 1024;
+    static const size_t s_budget = 32 * 1024 * 1024;
+    static const int s_flush_age = 2;
+
+    FlushFunc m_flush;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::unordered_map<uint32_t, Object> m_objects;
+    // Dirty bytes, including those being sent.
+    size_t m_bytes;
+    std::thread m_thread;
+    bool m_stop;
+};
+
+#endif // SMTPFS_WRITE_BACK_H
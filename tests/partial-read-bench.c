@@ -0,0 +1,236 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+/*
+ * Benchmark of partial object reads, the path every read of a file on the
+ * device takes. It reports how many bytes libmtp copies per byte delivered
+ * into the buffer of the caller, for the plain read, which allocates the
+ * data and leaves the caller to copy it out, and for the read straight into
+ * the buffer of the caller. The device is simulated below ptp.c: the data
+ * of each bulk transfer lands in a block, as it does in the USB glue, and
+ * is handed to the data handler from there.
+ *
+ * Copies are counted by renaming memcpy and realloc in libmtp. Not part of
+ * the Xcode project; build and run it with:
+ *   CFLAGS="-O2 -DHAVE_CONFIG_H -D_FORTIFY_SOURCE=0 -I../libmtp"
+ *   for f in libmtp ptp unicode util; do
+ *     cc $CFLAGS -Dmemcpy=bench_memcpy -Drealloc=bench_realloc \
+ *       -c ../libmtp/$f.c -o $f.o
+ *   done
+ *   cc $CFLAGS partial-read-bench.c libmtp.o ptp.o unicode.o util.o \
+ *     -liconv -o partial-read-bench
+ *   ./partial-read-bench
+ * (drop -liconv where iconv is part of the C library).
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __APPLE__
+#  include <malloc/malloc.h>
+#  define usable_size(p) malloc_size(p)
+#else
+#  include <malloc.h>
+#  define usable_size(p) malloc_usable_size(p)
+#endif
+#include "libmtp.h"
+#include "ptp.h"
+#include "playlist-spl.h"
+
+/* The USB glue reads in blocks of this size. */
+#define BLOCK_SIZE (0x3e00 + 0x200)
+
+static const uint32_t s_sizes[] = { 4096, 65536, 131072, 1048576 };
+static const uint64_t s_object_size = 1ULL << 30;
+
+static unsigned long long g_copied;
+
+void *bench_memcpy(void *dst, const void *src, size_t n)
+{
+  g_copied += n;
+  return memcpy(dst, src, n);
+}
+
+void *bench_realloc(void *p, size_t n)
+{
+  size_t old = p ? usable_size(p) : 0;
+  void *q = realloc(p, n);
+
+  /* A block which moves takes its contents along */
+  if (q && p && q != p)
+    g_copied += old < n ? old : n;
+  return q;
+}
+
+/* The simulated device. */
+static uint32_t g_offset;
+static uint32_t g_length;
+
+static uint16_t dev_sendreq(PTPParams *params, PTPContainer *req, int dataphase)
+{
+  g_offset = req->Param2;
+  g_length = req->Param3;
+  return PTP_RC_OK;
+}
+
+static uint16_t dev_getdata(PTPParams *params, PTPContainer *ptp,
+                            PTPDataHandler *handler)
+{
+  unsigned char block[BLOCK_SIZE];
+  uint32_t done = 0;
+
+  while (done < g_length) {
+    uint32_t n = g_length - done < BLOCK_SIZE ? g_length - done : BLOCK_SIZE;
+    uint32_t i;
+    uint16_t ret;
+
+    /* The bulk transfer itself, not a copy made by libmtp */
+    for (i = 0; i < n; i++)
+      block[i] = (unsigned char) (g_offset + done + i);
+    ret = handler->putfunc(params, handler->priv, n, block);
+    if (ret != PTP_RC_OK)
+      return ret;
+    done += n;
+  }
+  return PTP_RC_OK;
+}
+
+static uint16_t dev_getresp(PTPParams *params, PTPContainer *resp)
+{
+  memset(resp, 0, sizeof(*resp));
+  resp->Code = PTP_RC_OK;
+  resp->Transaction_ID = params->transaction_id - 1;
+  return PTP_RC_OK;
+}
+
+/* The USB glue and the playlist code are not linked in. */
+void dump_usbinfo(void *ptp_usb) {}
+const char *get_playlist_extension(void *ptp_usb) { return ".pla"; }
+void close_device(void *ptp_usb, PTPParams *params) {}
+LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
+                                           PTPParams *params, void **usbinfo)
+{
+  return LIBMTP_ERROR_CONNECTING;
+}
+void set_usb_device_timeout(void *ptp_usb, int timeout) {}
+void get_usb_device_timeout(void *ptp_usb, int *timeout) { *timeout = 0; }
+int guess_usb_speed(void *ptp_usb) { return 0; }
+LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t **devices,
+                                                int *numdevs)
+{
+  *devices = NULL;
+  *numdevs = 0;
+  return LIBMTP_ERROR_NO_DEVICE_ATTACHED;
+}
+uint16_t ptp_usb_event_async(PTPParams *params, PTPEventCbFn cb, void *user_data)
+{
+  return PTP_RC_OperationNotSupported;
+}
+uint16_t ptp_usb_event_async_cancel(PTPParams *params)
+{
+  return PTP_RC_OperationNotSupported;
+}
+uint16_t ptp_usb_event_wait(PTPParams *params, PTPContainer *event)
+{
+  return PTP_RC_OperationNotSupported;
+}
+int is_spl_playlist(PTPObjectInfo *oi) { return 0; }
+void spl_to_playlist_t(LIBMTP_mtpdevice_t *device, PTPObjectInfo *oi,
+                       const uint32_t id, LIBMTP_playlist_t * const pl) {}
+int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
+                      LIBMTP_playlist_t * const metadata) { return -1; }
+int update_spl_playlist(LIBMTP_mtpdevice_t *device,
+                        LIBMTP_playlist_t * const newlist) { return -1; }
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads the first 256 MB of the object in reads of the given size. */
+static void run(LIBMTP_mtpdevice_t *device, uint32_t size, int to_buffer,
+                unsigned char *buf)
+{
+  const uint64_t total = 256ULL << 20;
+  unsigned long long delivered = 0;
+  uint64_t offset;
+  double start;
+
+  g_copied = 0;
+  start = now();
+  for (offset = 0; offset < total; offset += size) {
+    unsigned int got = 0;
+
+    if (to_buffer) {
+      if (LIBMTP_GetPartialObject_To_Buffer(device, 1, offset, size,
+                                            s_object_size, buf, &got) != 0)
+        exit(1);
+    } else {
+      unsigned char *data = NULL;
+
+      /* What LIBMTP_GetPartialObject() comes down to, after it has
+       * asked the device for the size of the object */
+      if (ptp_getpartialobject((PTPParams *) device->params, 1,
+                               (uint32_t) offset, size, &data, &got) != PTP_RC_OK)
+        exit(1);
+      /* As fileRead did, into the buffer of the caller */
+      bench_memcpy(buf, data, got);
+      free(data);
+    }
+    if (got != size || buf[0] != (unsigned char) offset ||
+        buf[size - 1] != (unsigned char) (offset + size - 1))
+      exit(1);
+    delivered += got;
+  }
+  printf("%10u %-10s %8.2f %10.0f\n", size, to_buffer ? "to buffer" : "allocated",
+         (double) g_copied / delivered, delivered / (now() - start) / 1e6);
+}
+
+int main(void)
+{
+  uint16_t operations[] = { PTP_OC_GetPartialObject };
+  LIBMTP_mtpdevice_t device;
+  PTPParams params;
+  unsigned char *buf;
+  unsigned i;
+
+  memset(&params, 0, sizeof(params));
+  params.sendreq_func = dev_sendreq;
+  params.getdata_func = dev_getdata;
+  params.getresp_func = dev_getresp;
+  params.transaction_id = 1;
+  params.deviceinfo.OperationsSupported = operations;
+  params.deviceinfo.OperationsSupported_len = 1;
+  memset(&device, 0, sizeof(device));
+  device.params = &params;
+
+  buf = malloc(s_sizes[sizeof(s_sizes) / sizeof(s_sizes[0]) - 1]);
+  if (!buf)
+    return 1;
+  printf("%10s %-10s %8s %10s\n", "read", "path", "copies", "MB/s");
+  for (i = 0; i < sizeof(s_sizes) / sizeof(s_sizes[0]); i++) {
+    run(&device, s_sizes[i], 0, buf);
+    run(&device, s_sizes[i], 1, buf);
+  }
+  free(buf);
+  return 0;
+}
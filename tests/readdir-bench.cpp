@@ -0,0 +1,109 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+// Benchmark of readdir on the cached tree. A directory with a fixed number
+// of children is listed while the subtree cached below each child grows
+// deeper. Streaming the names, as readdir does, takes the same time at any
+// depth; copying the children, as readdir did through dirs() and files(),
+// takes time in proportion to the whole subtree.
+//
+// Not part of the Xcode project; build and run it with:
+//   g++ -std=gnu++14 -O2 -pthread -I../libmtp -I../simple-mtpfs-kfs \
+//     readdir-bench.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-type-dir.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-type-file.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-object-index.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-name-pool.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-epoch.cpp -o readdir-bench
+//   ./readdir-bench
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "simple-mtpfs-type-dir.h"
+
+static const int s_children = 100;
+static const int s_files = 10;
+static const int s_depths[] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+
+static uint32_t g_next_id = 1;
+
+// A directory holding s_files files and, depth levels down, a chain of
+// directories holding as many.
+static TypeDir makeSubtree(uint32_t parent_id, const std::string &name, int depth)
+{
+    TypeDir dir(g_next_id++, parent_id, 1, name);
+    for (int i = 0; i < s_files; ++i) {
+        dir.addFile(TypeFile(g_next_id++, dir.id(), 1,
+            "file" + std::to_string(i), 0, 0));
+    }
+    if (depth > 0)
+        dir.addDir(makeSubtree(dir.id(), "sub", depth - 1));
+    return dir;
+}
+
+template <typename F>
+static double nsPerCall(F func)
+{
+    typedef std::chrono::steady_clock Clock;
+    int runs = 1;
+    for (;;) {
+        const Clock::time_point start = Clock::now();
+        for (int i = 0; i < runs; ++i)
+            func();
+        const double ns = std::chrono::duration<double, std::nano>(
+            Clock::now() - start).count();
+        if (ns > 2e8)
+            return ns / runs;
+        runs *= 2;
+    }
+}
+
+int main()
+{
+    // Stands in for kfscontents_t; appending copies the name, as
+    // kfscontents_append() does.
+    std::vector<std::string> contents;
+    contents.reserve(s_children + s_files + 2);
+
+    printf("%6s %10s %14s %14s\n", "depth", "objects", "stream ns", "copy ns");
+    for (int depth : s_depths) {
+        TypeDir root(0, 0, 1, "storage");
+        for (int i = 0; i < s_children; ++i)
+            root.addDir(makeSubtree(0, "dir" + std::to_string(i), depth));
+        size_t objects = 0;
+        size_t bytes = 0;
+        root.memoryUsage(objects, bytes);
+
+        const double stream = nsPerCall([&]() {
+            contents.clear();
+            root.forEachName([&](const char *name) {
+                contents.emplace_back(name);
+            });
+        });
+        const double copy = nsPerCall([&]() {
+            contents.clear();
+            std::vector<TypeDir> dirs;
+            root.forEachDir([&](const TypeDir &d) { dirs.push_back(d); });
+            for (const TypeDir &d : dirs)
+                contents.emplace_back(d.cname());
+        });
+        printf("%6d %10zu %14.0f %14.0f\n", depth, objects, stream, copy);
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/* ***** BEGIN LICENSE BLOCK *****
+*   Copyright (C) 2012-2016, Peter Hatina <phatina@gmail.com>
+*
+*   This program is free software; you can redistribute it and/or
+*   modify it under the terms of the GNU General Public License as
+*   published by the Free Software Foundation; either version 2 of
+*   the License, or (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program. If not, see <http://www.gnu.org/licenses/>.
+* ***** END LICENSE BLOCK ***** */
+
+// Stress test of the cached tree: readers resolve and list directories, as
+// getattr and readdir do, while writers create, remove and rename them,
+// as mkdir, rmdir, unlink and rename and the device events do. Removed
+// directories must be reclaimed once no reader can see them any more.
+//
+// Not part of the Xcode project; build and run it with:
+//   g++ -std=gnu++14 -O1 -g -fsanitize=thread -pthread -I../libmtp \
+//     -I../simple-mtpfs-kfs tree-stress.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-type-dir.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-type-file.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-object-index.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-name-pool.cpp \
+//     ../simple-mtpfs-kfs/simple-mtpfs-epoch.cpp -o tree-stress
+//   ./tree-stress [seconds]
+// and again with -fsanitize=address instead of thread.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "simple-mtpfs-epoch.h"
+#include "simple-mtpfs-object-index.h"
+#include "simple-mtpfs-type-dir.h"
+
+static const int s_dirs = 64;
+static const int s_files = 8;
+static const int s_readers = 4;
+static const int s_writers = 3;
+static const uint32_t s_storage = 0x10001;
+
+static std::atomic<bool> g_stop(false);
+static std::atomic<uint32_t> g_next_id(1);
+static std::atomic<unsigned long> g_reads(0);
+static std::atomic<unsigned long> g_writes(0);
+
+static std::string dirName(unsigned i) { return "dir" + std::to_string(i); }
+static std::string fileName(unsigned i) { return "file" + std::to_string(i); }
+
+static TypeDir makeDir(uint32_t parent_id, const std::string &name)
+{
+    TypeDir dir(g_next_id++, parent_id, s_storage, name);
+    TypeDir sub(g_next_id++, dir.id(), s_storage, "sub");
+    for (int i = 0; i < s_files; ++i)
+        sub.addFile(TypeFile(g_next_id++, sub.id(), s_storage, fileName(i), i, 0));
+    dir.addDir(sub);
+    for (int i = 0; i < s_files; ++i)
+        dir.addFile(TypeFile(g_next_id++, dir.id(), s_storage, fileName(i), i, 0));
+    dir.setFetched();
+    return dir;
+}
+
+static void reader(TypeDir *root, ObjectIndex *index, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    while (!g_stop) {
+        Epoch::Section section;
+        // getattr: resolve the path one component at a time
+        const TypeDir *dir = root->dir(dirName(rng() % s_dirs));
+        if (!dir)
+            continue;
+        std::unique_ptr<const TypeFile> file(dir->file(fileName(rng() % s_files)));
+        if (file && file->size() >= static_cast<uint64_t>(s_files))
+            std::abort();
+        // readdir: list the directory and the one below it
+        size_t names = 0;
+        dir->forEachName([&](const char *name) { names += name[0] != '\0'; });
+        const TypeDir *sub = dir->dir("sub");
+        if (sub) {
+            sub->forEachName([&](const char *name) { names += name[0] != '\0'; });
+            // events find objects by id instead
+            const TypeDir *by_id = index->dir(sub->id());
+            if (by_id && by_id->id() != sub->id())
+                std::abort();
+        }
+        if (dir->name().compare(0, 3, "dir") != 0)
+            std::abort();
+        ++g_reads;
+    }
+}
+
+static void writer(TypeDir *root, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    while (!g_stop) {
+        Epoch::Section section;
+        const unsigned i = rng() % s_dirs;
+        const TypeDir *dir = root->dir(dirName(i));
+        switch (rng() % 4) {
+        case 0: // mkdir
+            if (!dir)
+                root->addDir(makeDir(root->id(), dirName(i)));
+            break;
+        case 1: // rmdir, or the directory vanishing on the device
+            if (dir)
+                root->removeDir(*dir);
+            break;
+        case 2: { // rename into the sub directory and back out again
+            if (!dir)
+                break;
+            TypeDir *sub = const_cast<TypeDir*>(dir->dir("sub"));
+            if (!sub)
+                break;
+            TypeDir moved(*sub);
+            moved.setName("moved");
+            const_cast<TypeDir*>(dir)->removeDir(*sub);
+            const_cast<TypeDir*>(dir)->addDir(moved);
+            const_cast<TypeDir*>(dir)->renameDir("moved", "sub");
+            break;
+        }
+        default: { // unlink and create again
+            if (!dir)
+                break;
+            TypeDir *d = const_cast<TypeDir*>(dir);
+            const std::string name(fileName(rng() % s_files));
+            std::unique_ptr<const TypeFile> file(d->file(name));
+            if (file) {
+                d->removeFile(*file);
+                d->addFile(*file);
+            }
+            break;
+        }
+        }
+        ++g_writes;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const int seconds = argc > 1 ? atoi(argv[1]) : 5;
+
+    ObjectIndex index;
+    TypeDir root(0, 0, s_storage, "storage");
+    root.setIndex(&index);
+    for (int i = 0; i < s_dirs; ++i)
+        root.addDir(makeDir(root.id(), dirName(i)));
+
+    size_t objects = 0;
+    size_t initial = 0;
+    root.memoryUsage(objects, initial);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < s_readers; ++i)
+        threads.emplace_back(reader, &root, &index, 1 + i);
+    for (int i = 0; i < s_writers; ++i)
+        threads.emplace_back(writer, &root, 100 + i);
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    g_stop = true;
+    for (std::thread &t : threads)
+        t.join();
+    Epoch::collect();
+
+    objects = 0;
+    size_t bytes = 0;
+    root.memoryUsage(objects, bytes);
+    printf("%lu reads, %lu writes, %zu retired pending, %zu -> %zu bytes\n",
+        g_reads.load(), g_writes.load(), Epoch::pending(), initial, bytes);
+
+    // Every retired directory has been reclaimed and its slot reused, so
+    // the tree is about the size it started at however long it ran.
+    if (Epoch::pending() != 0 || bytes > 2 * initial) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}